@@ -60,6 +60,13 @@ extern "C" {
 #define RTS_PIN_NUMBER	NRF_GPIO_PIN_MAP(0,0)	// No HWFC
 #define CTS_PIN_NUMBER	NRF_GPIO_PIN_MAP(0,0)	// No HWFC
 
+// The board has the inductor needed by the nRF52840's DCDC regulator
+#define BOARD_HAS_DCDC_INDUCTOR
+
+// Notecard ATTN output, which on the Notecarrier-AF reaches the Feather's D5 when its ATTN jumper is
+// fitted.  It is held low while armed, and goes high when an armed event occurs.
+#define ATTN_PIN_NUMBER	NRF_GPIO_PIN_MAP(1,8)	// D5 P1.08
+
 #ifdef __cplusplus
 }
 #endif
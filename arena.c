@@ -0,0 +1,70 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Per-transaction arena allocator.  Everything that note-c allocates for a request and its
+// response is bump-allocated from a static arena, and freeing only decrements a count of live
+// allocations.  At the end of each transaction, once its response has been deleted with
+// NoteDeleteResponse(), arenaEndTransaction() reclaims the whole arena at once.  Allocation and
+// free are therefore O(1), and the general-purpose heap doesn't fragment over millions of
+// transactions.  Allocations that don't fit fall back to the heap.
+//
+// An allocation that is still held at the end of a transaction keeps the arena from being
+// reclaimed, because it can't be moved.  That is counted, so that an allocation held indefinitely,
+// after which everything overflows to the heap, shows up in the statistics.
+
+#include <stdlib.h>
+#include "arena.h"
+
+// The arena
+static uint8_t arena[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGNMENT)));
+static size_t arenaUsed = 0;
+static arenaStats stats;
+
+// Allocate memory, from the arena if possible and otherwise from the heap
+void *arenaMalloc(size_t size) {
+	size_t aligned = (size + (ARENA_ALIGNMENT-1)) & ~((size_t) ARENA_ALIGNMENT-1);
+	if (aligned == 0 || aligned > ARENA_SIZE - arenaUsed) {
+		stats.overflows++;
+		return malloc(size);
+	}
+	void *p = &arena[arenaUsed];
+	arenaUsed += aligned;
+	if (arenaUsed > stats.highWater)
+		stats.highWater = arenaUsed;
+	stats.allocs++;
+	stats.live++;
+	return p;
+}
+
+// Free memory.  Memory from the arena isn't reused until the end of the transaction.
+void arenaFree(void *p) {
+	if (p == NULL)
+		return;
+	if ((uint8_t *) p < &arena[0] || (uint8_t *) p >= &arena[ARENA_SIZE]) {
+		free(p);
+		return;
+	}
+	if (stats.live > 0)
+		stats.live--;
+}
+
+// Called at the end of a transaction to reclaim the whole arena, returning false and leaving it as
+// it is if allocations from it are still outstanding
+bool arenaEndTransaction() {
+	if (arenaUsed == 0)
+		return true;
+	if (stats.live != 0) {
+		stats.held++;
+		return false;
+	}
+	arenaUsed = 0;
+	stats.resets++;
+	return true;
+}
+
+// Get arena statistics
+void arenaGetStats(arenaStats *out) {
+	*out = stats;
+	out->used = arenaUsed;
+}
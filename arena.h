@@ -0,0 +1,32 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Size of the arena, and the alignment of every allocation from it
+#define ARENA_SIZE			2048
+#define ARENA_ALIGNMENT		8
+
+// Arena statistics
+typedef struct {
+	uint32_t allocs;
+	uint32_t overflows;
+	uint32_t resets;
+	uint32_t held;
+	uint32_t live;
+	size_t used;
+	size_t highWater;
+} arenaStats;
+
+void *arenaMalloc(size_t size);
+void arenaFree(void *p);
+bool arenaEndTransaction(void);
+void arenaGetStats(arenaStats *stats);
+
+#endif // ARENA_H
@@ -0,0 +1,112 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Deep sleep in System OFF between periods of activity.  In System OFF the nRF52840 draws well under
+// a microamp but nothing runs, not even the RTC, so the Notecard keeps time instead: card.attn is put
+// into "sleep" mode, which holds ATTN low for the requested number of seconds and then raises it,
+// and the pin's SENSE mechanism wakes the host.  Waking from System OFF is a reset, so the little
+// state that the application needs to carry across it is kept in a section of RAM that is neither
+// initialized at startup nor powered down, and on startup deepSleepResume() says whether this is a
+// warm restart from which that state can be recovered.
+
+#include <string.h>
+#include "main.h"
+#include "note.h"
+#include "deepsleep.h"
+#include "notereq.h"
+#include "nrf.h"
+#include "nrf_gpio.h"
+#include "boards.h"
+#include "nrf_log_ctrl.h"
+
+// State retained across System OFF, which is only trusted if both the magic number and the checksum
+// are intact
+#define RETAINED_MAGIC			0x534c4550			// "SLEP"
+typedef struct {
+	uint32_t magic;
+	uint32_t sleeps;
+	uint32_t len;
+	uint32_t checksum;
+	uint8_t state[DEEPSLEEP_STATE_MAX];
+} deepSleepRetained;
+static deepSleepRetained retained __attribute__((section(".non_init")));
+
+// Checksum of the retained state
+static uint32_t deepSleepChecksum() {
+	uint32_t sum = retained.magic ^ retained.sleeps ^ retained.len;
+	for (uint32_t i=0; i<retained.len && i<DEEPSLEEP_STATE_MAX; i++)
+		sum = (sum << 1 | sum >> 31) + retained.state[i];
+	return sum;
+}
+
+// Determine whether we've just woken from System OFF with valid retained state, and if so copy it
+// out.  Otherwise this is a cold start, and the retained state is cleared.
+bool deepSleepResume(void *state, size_t len) {
+	bool woke = (NRF_POWER->RESETREAS & POWER_RESETREAS_OFF_Msk) != 0;
+	NRF_POWER->RESETREAS = NRF_POWER->RESETREAS;
+	if (woke && retained.magic == RETAINED_MAGIC && retained.len == len && retained.checksum == deepSleepChecksum()) {
+		memcpy(state, retained.state, len);
+		return true;
+	}
+	memset(&retained, 0, sizeof(retained));
+	return false;
+}
+
+// Number of times that we've slept since the last cold start
+uint32_t deepSleepCount() {
+	return retained.sleeps;
+}
+
+// Keep the RAM sections holding the retained state powered in System OFF.  RAM0 through RAM7 each
+// have two 4KB sections, and RAM8 has six of 32KB.
+static void deepSleepRetain(const void *p, size_t len) {
+	uint32_t first = (uint32_t) (uintptr_t) p - 0x20000000;
+	uint32_t last = first + len - 1;
+	for (uint32_t offset = first & ~0xfffU; offset <= last; offset += 0x1000) {
+		uint32_t block, section;
+		if (offset < 0x10000) {
+			block = offset / 0x2000;
+			section = (offset % 0x2000) / 0x1000;
+		} else {
+			block = 8;
+			section = (offset - 0x10000) / 0x8000;
+		}
+		NRF_POWER->RAM[block].POWERSET = 1UL << (POWER_RAM_POWERSET_S0RETENTION_Pos + section);
+	}
+}
+
+// Save the state, ask the Notecard to wake us in the given number of seconds, and enter System OFF,
+// from which we return only through a reset.  The Notecard is asked with a blocking request, so the
+// caller must first let the asynchronous requests finish, or cancel them.  Returns false, having done
+// nothing, if any are still outstanding or if the Notecard couldn't be asked to wake us.
+bool deepSleepEnter(const void *state, size_t len, uint32_t seconds) {
+	if (len > DEEPSLEEP_STATE_MAX || !noteRequestAsyncIdle())
+		return false;
+
+	// Have the Notecard hold ATTN low while we sleep
+	J *req = NoteNewRequest("card.attn");
+	if (req == NULL)
+		return false;
+	JAddStringToObject(req, "mode", "sleep");
+	JAddNumberToObject(req, "seconds", seconds);
+	if (!NoteRequest(req))
+		return false;
+
+	// Retain the state
+	retained.magic = RETAINED_MAGIC;
+	retained.sleeps++;
+	retained.len = len;
+	memcpy(retained.state, state, len);
+	retained.checksum = deepSleepChecksum();
+	deepSleepRetain(&retained, sizeof(retained));
+
+	// Write out any deferred log output, then wake when ATTN rises, and power down
+	NRF_LOG_FLUSH();
+	nrf_gpio_cfg_sense_input(ATTN_PIN_NUMBER, NRF_GPIO_PIN_PULLDOWN, NRF_GPIO_PIN_SENSE_HIGH);
+	NRF_POWER->SYSTEMOFF = 1;
+	__DSB();
+	while (true)
+		__WFE();
+
+}
@@ -0,0 +1,19 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef DEEPSLEEP_H
+#define DEEPSLEEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest application state that can be retained across System OFF
+#define DEEPSLEEP_STATE_MAX		64
+
+bool deepSleepResume(void *state, size_t len);
+uint32_t deepSleepCount(void);
+bool deepSleepEnter(const void *state, size_t len, uint32_t seconds);
+
+#endif // DEEPSLEEP_H
@@ -15,6 +15,24 @@
 //
 
 #include "main.h"
+#include "sched.h"
+#include "notereq.h"
+#include "noteprep.h"
+#include "notecache.h"
+#include "notetemplate.h"
+#include "noteoutbox.h"
+#include "journal.h"
+#include "noteinbox.h"
+#include "noteattn.h"
+#include "deepsleep.h"
+#include "power.h"
+#include "noteenergy.h"
+#include "arena.h"
+#include "notebatch.h"
+#include "notepack.h"
+#include "notecomp.h"
+#include "sampler.h"
+#include "nrf_temp.h"
 #include "note.h"
 
 // This is the unique Product Identifier for your device.  This Product ID tells the Notecard what
@@ -25,10 +43,221 @@
 
 #define myProductID "org.coca-cola.soda.vending-machine.v2"
 #define myLiveDemo  true
+#define myBenchmark false
+#define myRawSamples true
+#define myUseAttn   true
+
+// The temperature is sampled much more often than data is sent to the Notecard.  Readings are summarized
+// over a window, and a note is added once per window or as soon as a reading goes out of range.
+#define mySampleMs  1000
+#if myLiveDemo
+#define myWindowMs  (15*1000)       // 15 seconds
+#else
+#define myWindowMs  (15*60*1000)    // 15 minutes
+#endif
+#define myTempLow   0.0
+#define myTempHigh  40.0
+
+// In the non-live build the host spends almost all of its time in System OFF.  Rather than sampling
+// throughout each window, it takes a short burst of samples, sends the summary, and once everything
+// has been handed to the Notecard, sleeps until the Notecard raises ATTN at the start of the next window.
+#define myDeepSleep     (!myLiveDemo && myUseAttn)
+#define myBurstSamples  10
+#define mySettleMs      100
+#define mySettleMaxMs   (30*1000)
+#define mySleepSeconds  ((myWindowMs - myBurstSamples*mySampleMs) / 1000)
+
+// Notes sent to the device in "config.qi" change the temperature band.  The Notecard raises its ATTN
+// pin when they arrive, but if ATTN isn't available the Notecard is instead asked whether any have
+// arrived, less and less often while none do.
+#if myLiveDemo
+#define myInboxMinMs    (15*1000)           // 15 seconds
+#define myInboxMaxMs    (5*60*1000)         // 5 minutes
+#else
+#define myInboxMinMs    (5*60*1000)         // 5 minutes
+#define myInboxMaxMs    (60*60*1000)        // 1 hour
+#endif
+
+// Supply voltage changes over minutes to hours, so there's no need to ask the Notecard for it on every
+// measurement; instead its response is cached for this long
+#define myVoltageTTLMs  (5*60*1000)
+
+// The temperature sampling pipeline, whose timer is run by the event scheduler rather than from a blocking loop
+static bool tempRead(void *context, float *value);
+static void tempWindowDone(const samplerWindow *window, void *context);
+static sampler tempSampler = {
+	.sampleMs = mySampleMs,
+#if myDeepSleep
+	.windowSamples = myBurstSamples,
+#else
+	.windowSamples = myWindowMs / mySampleMs,
+#endif
+	.emitWhen = SAMPLER_EMIT_WINDOW | SAMPLER_EMIT_CROSSING,
+	.thresholdLow = myTempLow,
+	.thresholdHigh = myTempHigh,
+	.read = tempRead,
+	.emit = tempWindowDone,
+};
+
+// The measurement being assembled from the sampled window and the response to an asynchronous request
+static unsigned eventCounter = 0;
+static samplerWindow tempWindow;
+static double voltage = 0;
+
+// Measurements are accumulated in RAM and added to the Notecard several at a time, as a single note
+// whose body holds an array of them, so that the cost of a transaction is shared by the whole batch.
+// The "start" flag is for demonstration purposes, to upload the data instantaneously, so that if you
+// are looking at this on notehub.io you will see the data appearing 'live'.
+#if myLiveDemo
+#define myBatchNotes    4
+#define myBatchAgeMs    (60*1000)           // 1 minute
+#else
+#define myBatchNotes    8
+#define myBatchAgeMs    (2*60*60*1000)      // 2 hours
+#endif
+
+// The schema of each measurement, against which each one is checked before being added to the batch.
+// No template is registered for it, because a batch carries a variable number of measurements in
+// each note, whereas a Notecard template describes a single flat record.
+static const noteTemplateField sensorFields[] = {
+	{ "temp", NOTETEMPLATE_FLOAT16 },
+	{ "temp_min", NOTETEMPLATE_FLOAT16 },
+	{ "temp_max", NOTETEMPLATE_FLOAT16 },
+	{ "samples", NOTETEMPLATE_INT16 },
+	{ "voltage", NOTETEMPLATE_FLOAT32 },
+	{ "count", NOTETEMPLATE_INT32 },
+};
+static noteTemplate sensorSchema = {
+	.file = "sensors.qo",
+	.fields = sensorFields,
+	.fieldCount = sizeof(sensorFields) / sizeof(sensorFields[0]),
+};
+static noteBatch sensorBatch = {
+	.file = "sensors.qo",
+	.arrayKey = "readings",
+	.schema = &sensorSchema,
+	.start = myLiveDemo,
+	.maxNotes = myBatchNotes,
+	.maxAgeMs = myBatchAgeMs,
+};
+
+// Each alarm is added to its notefile as a note of its own, so a template is registered for alarms,
+// with which the Notecard stores and sends them as compact binary records
+static const noteTemplateField alarmFields[] = {
+	{ "temp", NOTETEMPLATE_FLOAT32 },
+	{ "low", NOTETEMPLATE_FLOAT32 },
+	{ "high", NOTETEMPLATE_FLOAT32 },
+};
+static noteTemplate alarmTemplate = {
+	.file = "alarms.qo",
+	.fields = alarmFields,
+	.fieldCount = sizeof(alarmFields) / sizeof(alarmFields[0]),
+};
+
+// The body of an alarm is prepared once, and only its numbers are patched for each alarm.  The outbox
+// copies it, so it can be patched again at once.
+static char alarmText[NOTEOUTBOX_BODY_MAX];
+static notePrep alarmPrep;
+
+// When enabled, the most recent raw samples are also sent at the end of each window, packed into a
+// binary payload in quarter degrees, delta-encoded so that each sample usually takes a single byte,
+// and compressed, because a steady temperature gives long runs of the same few deltas
+static const notePackField rawFields[] = {{ NOTEPACK_INT16, 4 }};
+static notePacker rawPacker;
+
+// What is carried across deep sleep, and the job that waits for the Notecard to have been handed
+// everything before going to sleep
+#if myDeepSleep
+static struct {
+	uint32_t eventCounter;
+	float thresholdLow;
+	float thresholdHigh;
+} retainedState;
+static void sleepWhenSettled(void *context);
+SCHED_JOB_DEF(settleJob, "settle", mySettleMs, sleepWhenSettled, NULL);
+static uint32_t settledMs = 0;
+#endif
+
+// Streaming parser that extracts the "value" from the card.voltage response
+static noteParseField voltageFields[] = {{ .key = "value", .type = NOTEPARSE_NUMBER }};
+static noteParser voltageParser;
+
+// Forwards
+static void notecardConfigure(void);
+static void voltageDone(noteReqHandle handle, noteParser *parser, void *context);
+static void sensorBody(noteWriter *w, void *context);
+static void alarmBody(noteWriter *w, void *context);
+static void alarmAdd(void);
+static void configReceived(const char *file, J *note, void *context);
+static void attnFired(J *rsp, void *context);
 
 // One-time initialization
 void setup() {
 
+	// After waking from deep sleep the Notecard is already configured, and the little state that we
+	// need to carry on where we left off has been retained, so only a cold start configures it
+	bool warm = false;
+#if myDeepSleep
+	warm = deepSleepResume(&retainedState, sizeof(retainedState));
+	if (warm) {
+		eventCounter = retainedState.eventCounter;
+		tempSampler.thresholdLow = retainedState.thresholdLow;
+		tempSampler.thresholdHigh = retainedState.thresholdHigh;
+	}
+#endif
+	if (!warm)
+		notecardConfigure();
+
+	// Prepare the parser and batch that will be used for each measurement, and tell the Notecard the
+	// format of alarms before any of them are sent.  Everything goes out through the outbox,
+	// which when the link is congested gives up routine data before it gives up alarms, and whatever
+	// it gives up is kept in the flash journal until it can be replayed.
+	noteOutboxInit(NOTEOUTBOX_DROP_LOWEST);
+	if (journalInit())
+		noteOutboxSetSpill(journalAppend);
+	noteParseInit(&voltageParser, voltageFields, 1);
+	noteBatchInit(&sensorBatch);
+	if (!warm)
+		noteTemplateRegister(&alarmTemplate);
+	notePrepInit(&alarmPrep, alarmText, sizeof(alarmText), "{\"temp\":@,\"low\":@,\"high\":@}");
+	notePackInit(&rawPacker, rawFields, 1, true, true);
+#if myBenchmark
+	if (!warm) {
+		notePrepBenchmark(100);
+		notePackBenchmark(100);
+		noteCompBenchmark(10);
+		noteEnergySimulateReport("note.add", 120, 4, 50, 20000);
+		noteEnergySimulateReport("file.changes", 40, 60, 20, 10000);
+#if JOURNAL_SIMULATE
+		journalBenchmark(200);
+#endif
+	}
+#endif
+
+	// Begin sampling, starting with one right now.  Between samples, the scheduler sleeps, and in the
+	// deep sleep build the host sleeps far more deeply once the burst of samples has been sent.
+	nrf_temp_init();
+	samplerStart(&tempSampler);
+
+	// Begin watching for configuration changes sent from the service, picking up any that are already
+	// waiting.  With ATTN there's no need to check on a timer, because the host sleeps until the
+	// Notecard signals that one has arrived.
+	noteInboxWatch("config.qi", configReceived, NULL);
+#if myUseAttn
+	static const char *attnFiles[] = { "config.qi" };
+	if (noteAttnInit(attnFired, NULL) && noteAttnArm(NOTEATTN_FILES, attnFiles, 1))
+		noteInboxCheck();
+	else
+		noteInboxStart(myInboxMinMs, myInboxMaxMs);
+#else
+	noteInboxStart(myInboxMinMs, myInboxMaxMs);
+#endif
+
+}
+
+// Tell the Notecard how to reach the service, which it remembers across our deep sleeps
+static void notecardConfigure() {
+
 	// "NoteNewRequest()" uses the bundled "J" json package to allocate a "req", which is a JSON object
 	// for the request to which we will then add Request arguments.  The function allocates a "req"
 	// request structure using malloc() and initializes its "req" field with the type of request.
@@ -56,64 +285,179 @@ void setup() {
 	//		 "mode"	   : "continuous"
 	//	   }
 	// Note that NoteRequest() always uses free() to release the request data structure, and it
-	// returns "true" if success and "false" if there is any failure.
+	// returns "true" if success and "false" if there is any failure.  That is the end of the
+	// transaction, so the memory that it used is reclaimed.
 	NoteRequest(req);
+	arenaEndTransaction();
 
 }
 
-// This  main loop which is called repeatedly, add outbound data every 15 seconds
-void loop() {
+// Read the temperature from the nRF52's on-die sensor.  Unlike asking the Notecard for its temperature,
+// this doesn't involve the bus at all, so it can be done at a high rate.
+static bool tempRead(void *context, float *value) {
+	NRF_TEMP->TASKS_START = 1;
+	while (NRF_TEMP->EVENTS_DATARDY == 0) ;
+	NRF_TEMP->EVENTS_DATARDY = 0;
+	*value = nrf_temp_read() / 4.0f;
+	NRF_TEMP->TASKS_STOP = 1;
+	return true;
+}
+
+// This is called by the sampler at the end of each window, or when the temperature goes out of range
+static void tempWindowDone(const samplerWindow *window, void *context) {
 
 	// Simulate an event counter of some kind
-	static unsigned eventCounter = 0;
 	eventCounter = eventCounter + 1;
+	tempWindow = *window;
 
-	// Rather than simulating a temperature reading, use a Notecard request to read the temp
-	// from the Notecard's built-in temperature sensor.  We use NoteRequestResponse() to indicate
-	// that we would like to examine the response of the transaction.  This method takes a "request" JSON
-	// data structure as input, then processes it and returns a "response" JSON data structure with
-	// the response.  Note that because the Notecard library uses malloc(), developers must always
-	// check for NULL to ensure that there was enough memory available on the microcontroller to
-	// satisfy the allocation request.
-	double temperature = 0;
-    J *rsp = NoteRequestResponse(NoteNewRequest("card.temp"));
-    if (rsp != NULL) {
-        temperature = JGetNumber(rsp, "value");
-        NoteDeleteResponse(rsp);
-    }
-
-	// Do the same to retrieve the voltage that is detected by the Notecard on its V+ pin.
-	double voltage = 0;
-    rsp = NoteRequestResponse(NoteNewRequest("card.voltage"));
-    if (rsp != NULL) {
-        voltage = JGetNumber(rsp, "value");
-        NoteDeleteResponse(rsp);
-    }
-
-	// Enqueue the measurement to the Notecard for transmission to the Notehub, adding the "start"
-	// flag for demonstration purposes to upload the data instantaneously, so that if you are looking
-	// at this on notehub.io you will see the data appearing 'live'.)
-    J *req = NoteNewRequest("note.add");
-	if (req != NULL) {
-	    JAddStringToObject(req, "file", "sensors.qo");
-#if myLiveDemo
-	    JAddBoolToObject(req, "start", true);
-#endif
-		J *body = JCreateObject();
-		if (body != NULL) {
-			JAddNumberToObject(body, "temp", temperature);
-			JAddNumberToObject(body, "voltage", voltage);
-			JAddNumberToObject(body, "count", eventCounter);
-		    JAddItemToObject(req, "body", body);
-		}
-	    NoteRequest(req);
+	// If the temperature has gone out of range, raise an alarm, which is sent ahead of everything else
+	if (window->crossing)
+		alarmAdd();
+
+	// Retrieve the voltage that is detected by the Notecard on its V+ pin.  We use noteRequestAsyncQuery()
+	// so that this returns immediately, and so that the "value" is picked out of the response as it arrives
+	// without building a JSON tree on the heap.  voltageDone() is called once the Notecard has processed the
+	// request, although this is usually answered from the response cache without going to the Notecard at all.
+	voltage = 0;
+	noteRequestAsyncQueryCached("{\"req\":\"card.voltage\"}", &voltageParser, myVoltageTTLMs, voltageDone, NULL);
+
+	// Commit anything journaled during the window to flash, and replay what the journal holds in case the
+	// link has recovered
+	journalSync();
+	journalReplay();
+
+	// Periodically report how well requests are being pipelined to the Notecard, and the cache hit rate
+	if (eventCounter % 10 == 0) {
+		noteRequestAsyncReport();
+		noteCacheReport();
+		noteBatchReport(&sensorBatch);
+		noteOutboxReport();
+		journalReport();
+		noteInboxReport();
+		noteAttnReport();
+		noteOutboxStats outbox;
+		noteOutboxGetStats(&outbox, false);
+		powerReport(outbox.sent);
+		noteEnergyReport();
 	}
 
-	// Delay between measurements
-#if myLiveDemo
-	delay(15*1000);     // 15 seconds
-#else
-	delay(15*60*1000);  // 15 minutes
+	// Send the raw samples behind the summary, unless the previous ones are still being sent
+#if myRawSamples
+	float recent[SAMPLER_RING_SIZE];
+	int count = samplerRecent(&tempSampler, recent, window->count < SAMPLER_RING_SIZE ? window->count : SAMPLER_RING_SIZE);
+	for (int i=0; i<count; i++) {
+		JNUMBER value = recent[i];
+		if (!notePackFrame(&rawPacker, &value))
+			break;
+	}
+	notePackSubmit(&rawPacker, "samples.qo", NULL, NULL);
 #endif
 
+	// The burst is over, so stop sampling and prepare to sleep
+#if myDeepSleep
+	samplerStop(&tempSampler);
+	settledMs = 0;
+	schedJobStart(&settleJob, false);
+#endif
+
+}
+
+// Once the measurement has been added, the batch has been sent, and nothing is waiting to go to the
+// Notecard, sleep until the next window.  If that takes too long, sleep anyway, but first keep what
+// the outbox and the batch still hold in the journal, because RAM is lost in deep sleep.  Because the
+// Notecard is told to wake us with a blocking request, whatever hasn't yet been sent is cancelled,
+// and the request in flight is left to finish or time out, before going to sleep.
+#if myDeepSleep
+static void sleepWhenSettled(void *context) {
+	settledMs += mySettleMs;
+	bool idle = noteRequestAsyncIdle() && !sensorBatch.flushing;
+	for (int cls=0; cls<NOTEOUTBOX_CLASSES; cls++)
+		if (noteOutboxDepth(cls) != 0)
+			idle = false;
+	if (idle && sensorBatch.notes != 0) {
+		noteBatchFlush(&sensorBatch);
+		idle = false;
+	}
+	if (!idle && settledMs < mySettleMaxMs)
+		return;
+	noteOutboxSpillAll();
+	noteBatchSpill(&sensorBatch, journalAppend);
+	if (!noteRequestAsyncIdle()) {
+		noteRequestAsyncCancelAll();
+		return;
+	}
+	schedJobStop(&settleJob);
+	journalSync();
+	retainedState.eventCounter = eventCounter;
+	retainedState.thresholdLow = tempSampler.thresholdLow;
+	retainedState.thresholdHigh = tempSampler.thresholdHigh;
+	if (!deepSleepEnter(&retainedState, sizeof(retainedState), mySleepSeconds))
+		samplerStart(&tempSampler);
+}
+#endif
+
+// Completion of the card.voltage request, at which point the measurement is complete
+static void voltageDone(noteReqHandle handle, noteParser *parser, void *context) {
+	noteParseField *value = noteParseGet(parser, "value");
+	if (value->present)
+		voltage = value->number;
+
+	// Add the measurement to the batch, which sends it to the Notecard for transmission to the
+	// Notehub along with the others once enough of them have accumulated
+	noteBatchAddEmit(&sensorBatch, sensorBody, NULL);
+
+}
+
+// A configuration note has arrived, such as {"low":5,"high":30}, setting the band outside which an
+// alarm is raised
+static void configReceived(const char *file, J *note, void *context) {
+	J *body = JGetObjectItem(note, "body");
+	if (body == NULL)
+		return;
+	if (JIsPresent(body, "low"))
+		tempSampler.thresholdLow = JGetNumber(body, "low");
+	if (JIsPresent(body, "high"))
+		tempSampler.thresholdHigh = JGetNumber(body, "high");
+}
+
+// ATTN has fired, which for the events armed above means that inbound notes have arrived.  If the
+// Notecard couldn't be armed, check for them on a timer instead.
+static void attnFired(J *rsp, void *context) {
+	if (rsp == NULL)
+		noteInboxStart(myInboxMinMs, myInboxMaxMs);
+	else if (JGetObjectItem(rsp, "files") != NULL)
+		noteInboxCheck();
+}
+
+// Write the body of a measurement's note directly into the batch
+static void sensorBody(noteWriter *w, void *context) {
+	noteWriterObjectBegin(w, NULL);
+	noteWriterNumber(w, "temp", tempWindow.mean);
+	noteWriterNumber(w, "temp_min", tempWindow.min);
+	noteWriterNumber(w, "temp_max", tempWindow.max);
+	noteWriterInt(w, "samples", tempWindow.count);
+	noteWriterNumber(w, "voltage", voltage);
+	noteWriterInt(w, "count", eventCounter);
+	noteWriterObjectEnd(w);
+}
+
+// Add an alarm to the outbox, patching its prepared body, or writing it afresh if a number doesn't
+// fit in its slot
+static void alarmAdd() {
+	bool patched = notePrepSetNumber(&alarmPrep, 0, tempWindow.last)
+		&& notePrepSetNumber(&alarmPrep, 1, tempSampler.thresholdLow)
+		&& notePrepSetNumber(&alarmPrep, 2, tempSampler.thresholdHigh);
+	if (patched)
+		noteOutboxAddJSON(NOTEOUTBOX_ALARM, "alarms.qo", alarmPrep.json, true);
+	else
+		noteOutboxAddEmit(NOTEOUTBOX_ALARM, "alarms.qo", alarmBody, NULL, true);
+}
+
+// Write the body of an alarm note
+static void alarmBody(noteWriter *w, void *context) {
+	noteWriterObjectBegin(w, NULL);
+	noteWriterNumber(w, "temp", tempWindow.last);
+	noteWriterNumber(w, "low", tempSampler.thresholdLow);
+	noteWriterNumber(w, "high", tempSampler.thresholdHigh);
+	noteWriterObjectEnd(w);
 }
@@ -0,0 +1,543 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Persistent journal of notes that could not be delivered.  The outbox hands over the notes that it
+// gives up on, and they are appended to a log in internal flash, so that they survive both a link
+// that is down for longer than the outbox can hold out and a reset.  When the link recovers they
+// are replayed through the outbox in the order in which they were journaled.
+//
+// Flash can only be erased a page at a time, and a word can only be written twice between erases,
+// so the journal is append-only.  Each page starts with a header carrying a sequence number, and
+// pages are used round-robin, so that every page is erased equally often.  Records never span a
+// page; each is a header word holding its length and delivery state, a word holding its checksum
+// and priority, and then the file name and body padded to a whole word.  A record is marked as
+// delivered by clearing the state half of its header word, which is its second and last write.
+// Records are accumulated in RAM and written with a single call, which amortizes the cost of
+// programming flash across several records.  When the journal is full, the oldest page is erased,
+// and whatever was still pending within it is lost.
+//
+// The flash itself is reached through nrf_fstorage, or through a RAM simulation of NOR flash that
+// enforces the same rules, on which the benchmark measures write amplification and replay rate, and
+// on which the host tests in test/ check that the journal recovers from a reset during any write.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "journal.h"
+#if !JOURNAL_SIMULATE
+#include "nrf_fstorage.h"
+#include "nrf_fstorage_nvmc.h"
+#endif
+
+// Layout
+#define PAGE_MAGIC				0x4c4e524a			// "JRNL"
+#define PAGE_HEADER				8
+#define RECORD_HEADER			8
+#define RECORD_ERASED			0xffff
+#define RECORD_PENDING			0xffff
+#define RECORD_DELIVERED		0x0000
+#define PAD4(n)					(((n) + 3) & ~3U)
+
+// A position in the journal
+typedef struct {
+	int page;
+	uint32_t offset;
+} journalPos;
+
+// A record read back from the journal, and where it came from
+typedef struct {
+	journalPos pos;
+	uint32_t pageSeq;
+	uint8_t cls;
+	bool sync;
+	char file[33];
+	char body[NOTEOUTBOX_BODY_MAX];
+} journalRecord;
+
+// The sequence number of each page, where 0 means that the page holds nothing
+static uint32_t pageSeq[JOURNAL_PAGES];
+static bool initialized = false;
+
+// Where the next record goes, with records not yet in flash accumulated in the write buffer
+static journalPos tail;
+static uint8_t writeBuf[JOURNAL_WRITE_BUFFER];
+static uint32_t writeLen = 0;
+
+// The oldest record that might still be pending, and the record being replayed
+static journalPos readPos;
+static journalRecord replay;
+static bool replaying = false;
+
+static journalStats stats;
+
+// Forwards
+static void journalReplayEmit(noteWriter *w, void *context);
+static void journalReplayDone(noteReqHandle handle, J *rsp, void *context);
+
+#if JOURNAL_SIMULATE
+
+// NOR flash, on which erasing sets every bit and writing can only clear them
+static uint32_t simFlash[JOURNAL_PAGES * JOURNAL_PAGE_SIZE / 4];
+static uint8_t simWrites[JOURNAL_PAGES * JOURNAL_PAGE_SIZE / 4];
+static bool simFormatted = false;
+
+// Words that can still be written before the simulated power fails, or negative if it doesn't
+static int32_t simPowerWords = -1;
+
+// RAM starts out zeroed rather than erased, so it is erased on first use
+static const char *flashInit(void) {
+	if (!simFormatted) {
+		memset(simFlash, 0xff, sizeof(simFlash));
+		memset(simWrites, 0, sizeof(simWrites));
+		simFormatted = true;
+	}
+	return NULL;
+}
+
+static const char *flashErase(int page) {
+	if (simPowerWords == 0)
+		return NULL;
+	memset(&simFlash[page * JOURNAL_PAGE_SIZE / 4], 0xff, JOURNAL_PAGE_SIZE);
+	memset(&simWrites[page * JOURNAL_PAGE_SIZE / 4], 0, JOURNAL_PAGE_SIZE / 4);
+	return NULL;
+}
+
+static const char *flashWrite(uint32_t addr, const void *data, uint32_t len) {
+	if ((addr & 3) != 0 || (len & 3) != 0 || addr + len > sizeof(simFlash))
+		return "journal: unaligned flash write";
+	const uint8_t *p = (const uint8_t *) data;
+	for (uint32_t i=0; i<len && simPowerWords != 0; i+=4) {
+		if (simPowerWords > 0)
+			simPowerWords--;
+		uint32_t word;
+		memcpy(&word, &p[i], 4);
+		if (++simWrites[(addr + i) / 4] > 2)
+			return "journal: flash word written more than twice";
+		simFlash[(addr + i) / 4] &= word;
+	}
+	return NULL;
+}
+
+static const char *flashRead(uint32_t addr, void *data, uint32_t len) {
+	memcpy(data, (uint8_t *) simFlash + addr, len);
+	return NULL;
+}
+
+#else
+
+// Storage instance, in the flash region reserved for the journal
+static void journalStorageEvent(nrf_fstorage_evt_t *evt) {
+}
+NRF_FSTORAGE_DEF(nrf_fstorage_t journalStorage) = {
+	.evt_handler = journalStorageEvent,
+	.start_addr = JOURNAL_FLASH_START,
+	.end_addr = JOURNAL_FLASH_START + JOURNAL_PAGES*JOURNAL_PAGE_SIZE - 1,
+};
+
+// The NVMC backend completes each operation before returning, but wait in case that changes
+static const char *flashWait(ret_code_t err) {
+	if (err != NRF_SUCCESS)
+		return "journal: flash operation failed";
+	while (nrf_fstorage_is_busy(&journalStorage))
+		sleep_handler();
+	return NULL;
+}
+
+static const char *flashInit(void) {
+	return flashWait(nrf_fstorage_init(&journalStorage, &nrf_fstorage_nvmc, NULL));
+}
+
+static const char *flashErase(int page) {
+	return flashWait(nrf_fstorage_erase(&journalStorage, JOURNAL_FLASH_START + page*JOURNAL_PAGE_SIZE, 1, NULL));
+}
+
+static const char *flashWrite(uint32_t addr, const void *data, uint32_t len) {
+	return flashWait(nrf_fstorage_write(&journalStorage, JOURNAL_FLASH_START + addr, data, len, NULL));
+}
+
+static const char *flashRead(uint32_t addr, void *data, uint32_t len) {
+	return flashWait(nrf_fstorage_read(&journalStorage, JOURNAL_FLASH_START + addr, data, len));
+}
+
+#endif
+
+// Address of a position within the journal region
+static uint32_t journalAddr(journalPos pos) {
+	return pos.page * JOURNAL_PAGE_SIZE + pos.offset;
+}
+
+// Write to flash, keeping count
+static const char *journalWrite(journalPos pos, const void *data, uint32_t len) {
+	stats.flashWrites++;
+	stats.flashBytes += len;
+	return flashWrite(journalAddr(pos), data, len);
+}
+
+// Fletcher-16 of a record's payload, which detects a record torn by a reset during its write
+static uint16_t journalChecksum(const uint8_t *data, uint32_t len) {
+	uint16_t a = 0, b = 0;
+	for (uint32_t i=0; i<len; i++) {
+		a = (a + data[i]) % 255;
+		b = (b + a) % 255;
+	}
+	return (uint16_t) ((b << 8) | a);
+}
+
+// Read the record at a position, returning its length in flash, or 0 if there are no more in its page
+static uint32_t journalRead(journalPos pos, uint32_t *word0, uint32_t *word1, uint8_t *payload) {
+	if (pos.offset + RECORD_HEADER > JOURNAL_PAGE_SIZE)
+		return 0;
+	uint32_t header[2];
+	if (flashRead(journalAddr(pos), header, sizeof(header)) != NULL)
+		return 0;
+	uint32_t len = header[0] & 0xffff;
+	if (len == RECORD_ERASED || len == 0 || len > JOURNAL_RECORD_MAX || pos.offset + RECORD_HEADER + PAD4(len) > JOURNAL_PAGE_SIZE)
+		return 0;
+	*word0 = header[0];
+	*word1 = header[1];
+	if (payload != NULL) {
+		pos.offset += RECORD_HEADER;
+		if (flashRead(journalAddr(pos), payload, PAD4(len)) != NULL)
+			return 0;
+	}
+	return RECORD_HEADER + PAD4(len);
+}
+
+// True if a record has yet to be delivered
+static bool journalPending(uint32_t word0) {
+	return (word0 >> 16) == RECORD_PENDING;
+}
+
+// True if a record's payload is what was written
+static bool journalIntact(uint32_t word0, uint32_t word1, const uint8_t *payload) {
+	return journalChecksum(payload, word0 & 0xffff) == (word1 & 0xffff);
+}
+
+// The page after a page
+static int journalNextPage(int page) {
+	return (page + 1) % JOURNAL_PAGES;
+}
+
+// Erase a page and give it the next sequence number
+static bool journalFormatPage(int page, uint32_t seq) {
+	pageSeq[page] = 0;
+	if (flashErase(page) != NULL)
+		return false;
+	stats.erases++;
+	uint32_t header[2] = { PAGE_MAGIC, seq };
+	journalPos pos = { page, 0 };
+	if (journalWrite(pos, header, sizeof(header)) != NULL)
+		return false;
+	pageSeq[page] = seq;
+	return true;
+}
+
+// Count the pending records in a page
+static uint32_t journalCountPending(int page) {
+	static uint8_t payload[PAD4(JOURNAL_RECORD_MAX)];
+	uint32_t count = 0, word0, word1, len;
+	journalPos pos = { page, PAGE_HEADER };
+	while ((len = journalRead(pos, &word0, &word1, payload)) != 0) {
+		if (journalPending(word0) && journalIntact(word0, word1, payload))
+			count++;
+		pos.offset += len;
+	}
+	return count;
+}
+
+// Recover the state of the journal from flash, formatting it if it holds nothing
+bool journalInit() {
+	memset(&stats, 0, sizeof(stats));
+	writeLen = 0;
+	replaying = false;
+	initialized = (flashInit() == NULL);
+	if (!initialized)
+		return false;
+
+	// Find the valid pages, and the newest of them, which is where appending resumes
+	int newest = -1;
+	for (int page=0; page<JOURNAL_PAGES; page++) {
+		uint32_t header[2];
+		pageSeq[page] = 0;
+		if (flashRead(page * JOURNAL_PAGE_SIZE, header, sizeof(header)) == NULL && header[0] == PAGE_MAGIC && header[1] != 0 && header[1] != 0xffffffff) {
+			pageSeq[page] = header[1];
+			if (newest < 0 || header[1] > pageSeq[newest])
+				newest = page;
+		}
+	}
+	if (newest < 0) {
+		tail.page = 0;
+		tail.offset = PAGE_HEADER;
+		readPos = tail;
+		initialized = journalFormatPage(0, 1);
+		return initialized;
+	}
+
+	// Find the end of the newest page
+	uint32_t word0, word1, len;
+	tail.page = newest;
+	tail.offset = PAGE_HEADER;
+	while ((len = journalRead(tail, &word0, &word1, NULL)) != 0)
+		tail.offset += len;
+
+	// Replay starts from the oldest page, which is the first valid one after the newest
+	readPos.page = newest;
+	for (int i=1; i<=JOURNAL_PAGES; i++) {
+		int page = (newest + i) % JOURNAL_PAGES;
+		if (pageSeq[page] != 0) {
+			readPos.page = page;
+			break;
+		}
+	}
+	readPos.offset = PAGE_HEADER;
+	for (int page=0; page<JOURNAL_PAGES; page++)
+		if (pageSeq[page] != 0)
+			stats.pending += journalCountPending(page);
+	return true;
+}
+
+// Write the records accumulated in RAM to flash
+bool journalSync() {
+	if (!initialized)
+		return false;
+	if (writeLen == 0)
+		return true;
+	const char *errstr = journalWrite(tail, writeBuf, writeLen);
+	tail.offset += writeLen;
+	writeLen = 0;
+	if (errstr != NULL) {
+		NoteDebug(errstr);
+		NoteDebug("\n");
+		return false;
+	}
+	return true;
+}
+
+// Move appending on to the next page, taking it from the oldest records if the journal is full
+static bool journalAdvance() {
+	if (!journalSync())
+		return false;
+	int next = journalNextPage(tail.page);
+	uint32_t seq = pageSeq[tail.page] + 1;
+	if (pageSeq[next] != 0) {
+		uint32_t lost = journalCountPending(next);
+		stats.lost += lost;
+		stats.pending -= lost;
+		if (readPos.page == next) {
+			readPos.page = journalNextPage(next);
+			readPos.offset = PAGE_HEADER;
+		}
+	}
+	if (!journalFormatPage(next, seq))
+		return false;
+	tail.page = next;
+	tail.offset = PAGE_HEADER;
+	return true;
+}
+
+// Append a note to the journal.  It is in RAM until the write buffer fills or journalSync() is
+// called.  This has the signature of an outbox spill function, so that it can be set as one.
+bool journalAppend(noteOutboxClass cls, const char *file, const char *body, bool sync) {
+	if (!initialized)
+		return false;
+	size_t fileLen = strlen(file);
+	size_t bodyLen = strlen(body);
+	uint32_t len = 1 + fileLen + bodyLen;
+	if (fileLen > 32 || len > JOURNAL_RECORD_MAX)
+		return false;
+	uint32_t size = RECORD_HEADER + PAD4(len);
+
+	// Make room for it
+	if (writeLen + size > sizeof(writeBuf) && !journalSync())
+		return false;
+	if (tail.offset + writeLen + size > JOURNAL_PAGE_SIZE && !journalAdvance())
+		return false;
+
+	// Lay it out, with the padding left erased so that it needn't be written again
+	uint8_t *record = &writeBuf[writeLen];
+	uint8_t *payload = &record[RECORD_HEADER];
+	memset(record, 0xff, size);
+	payload[0] = (uint8_t) fileLen;
+	memcpy(&payload[1], file, fileLen);
+	memcpy(&payload[1 + fileLen], body, bodyLen);
+	uint32_t header[2];
+	header[0] = len | ((uint32_t) RECORD_PENDING << 16);
+	header[1] = journalChecksum(payload, len) | ((uint32_t) cls << 16) | ((uint32_t) (sync ? 1 : 0) << 24);
+	memcpy(record, header, sizeof(header));
+	writeLen += size;
+	stats.appended++;
+	stats.pending++;
+	stats.payloadBytes += fileLen + bodyLen;
+	return true;
+}
+
+// Find the oldest pending record, reading it into rec
+static bool journalNext(journalRecord *rec) {
+	static uint8_t payload[PAD4(JOURNAL_RECORD_MAX)];
+	for (;;) {
+		uint32_t word0, word1;
+		uint32_t len = 0;
+		if (readPos.page != tail.page || readPos.offset < tail.offset)
+			len = journalRead(readPos, &word0, &word1, payload);
+		if (len == 0) {
+			if (readPos.page == tail.page)
+				return false;
+			readPos.page = journalNextPage(readPos.page);
+			readPos.offset = PAGE_HEADER;
+			continue;
+		}
+		journalPos pos = readPos;
+		readPos.offset += len;
+		if (!journalPending(word0))
+			continue;
+		if (!journalIntact(word0, word1, payload)) {
+			stats.corrupt++;
+			continue;
+		}
+		uint32_t payloadLen = word0 & 0xffff;
+		uint32_t fileLen = payload[0];
+		if (1 + fileLen > payloadLen || payloadLen - 1 - fileLen >= sizeof(rec->body)) {
+			stats.corrupt++;
+			continue;
+		}
+		rec->pos = pos;
+		rec->pageSeq = pageSeq[pos.page];
+		rec->cls = (uint8_t) (word1 >> 16);
+		rec->sync = ((word1 >> 24) & 1) != 0;
+		memcpy(rec->file, &payload[1], fileLen);
+		rec->file[fileLen] = '\0';
+		memcpy(rec->body, &payload[1 + fileLen], payloadLen - 1 - fileLen);
+		rec->body[payloadLen - 1 - fileLen] = '\0';
+		if (rec->cls >= NOTEOUTBOX_CLASSES)
+			rec->cls = NOTEOUTBOX_BULK;
+		return true;
+	}
+}
+
+// Mark a record as delivered, unless its page has since been erased and reused
+static void journalMarkDelivered(journalRecord *rec) {
+	if (pageSeq[rec->pos.page] != rec->pageSeq)
+		return;
+	uint32_t word0, word1;
+	if (journalRead(rec->pos, &word0, &word1, NULL) == 0)
+		return;
+	word0 &= ((uint32_t) RECORD_DELIVERED << 16) | 0xffff;
+	journalWrite(rec->pos, &word0, sizeof(word0));
+	stats.replayed++;
+	stats.pending--;
+}
+
+// Begin replaying the pending records through the outbox, one at a time and oldest first.  This is
+// called whenever the link might have recovered; replay stops at the first record that isn't
+// accepted, and resumes from it on the next call.
+bool journalReplay() {
+	if (!initialized || replaying || stats.pending == 0)
+		return false;
+	if (!journalSync())
+		return false;
+	journalPos resume = readPos;
+	if (!journalNext(&replay))
+		return false;
+	replaying = noteOutboxSubmit((noteOutboxClass) replay.cls, journalReplayEmit, &replay, journalReplayDone, &replay);
+	if (!replaying)
+		readPos = resume;
+	return replaying;
+}
+
+// Write the note.add request for the record being replayed
+static void journalReplayEmit(noteWriter *w, void *context) {
+	journalRecord *rec = (journalRecord *) context;
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "note.add");
+	noteWriterString(w, "file", rec->file);
+	if (rec->sync)
+		noteWriterBool(w, "sync", true);
+	noteWriterRawValue(w, "body", rec->body);
+	noteWriterObjectEnd(w);
+}
+
+// Completion of a replayed record, after which the next one is replayed.  A record that wasn't
+// accepted is left pending, and replay is resumed from it later.
+static void journalReplayDone(noteReqHandle handle, J *rsp, void *context) {
+	journalRecord *rec = (journalRecord *) context;
+	bool success = (rsp != NULL && !NoteResponseError(rsp));
+	if (rsp != NULL)
+		NoteDeleteResponse(rsp);
+	replaying = false;
+	if (!success) {
+		if (pageSeq[rec->pos.page] == rec->pageSeq)
+			readPos = rec->pos;
+		return;
+	}
+	journalMarkDelivered(rec);
+	journalReplay();
+}
+
+// Get the statistics
+void journalGetStats(journalStats *out) {
+	*out = stats;
+}
+
+// Report what has been journaled, and what it has cost in flash
+void journalReport() {
+	char buf[224];
+	uint32_t amp = stats.payloadBytes == 0 ? 0 : (uint32_t) (((uint64_t) stats.flashBytes * 100) / stats.payloadBytes);
+	snprintf(buf, sizeof(buf), "journal: %lu pending, %lu appended, %lu replayed, %lu lost, %lu corrupt, %lu flash bytes in %lu writes, %lu erases, amplification %lu.%02lu\n",
+			 (unsigned long) stats.pending, (unsigned long) stats.appended, (unsigned long) stats.replayed,
+			 (unsigned long) stats.lost, (unsigned long) stats.corrupt, (unsigned long) stats.flashBytes,
+			 (unsigned long) stats.flashWrites, (unsigned long) stats.erases,
+			 (unsigned long) (amp / 100), (unsigned long) (amp % 100));
+	NoteDebug(buf);
+}
+
+#if JOURNAL_SIMULATE
+
+// Append records in the simulation as if the link were down, then replay them all as if it had
+// recovered, reporting the write amplification and the rate at which records are read back.  The
+// simulated flash is erased both before and after.
+void journalBenchmark(int records) {
+	static journalRecord rec;
+	char buf[128];
+	if (records <= 0)
+		return;
+	journalSimulateErase();
+	uint32_t began = cycles();
+	for (int i=0; i<records; i++) {
+		char body[48];
+		snprintf(body, sizeof(body), "{\"temp\":%d.%d,\"voltage\":4.12,\"count\":%d}", 20 + i % 10, i % 4, i);
+		journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", body, false);
+	}
+	journalSync();
+	uint32_t appendCycles = (cycles() - began) / records;
+	journalReport();
+
+	// Replay, as journalReplay() would if the outbox accepted everything at once
+	uint32_t replayed = 0;
+	began = cycles();
+	while (journalNext(&rec)) {
+		journalMarkDelivered(&rec);
+		replayed++;
+	}
+	uint32_t replayCycles = replayed == 0 ? 0 : (cycles() - began) / replayed;
+	snprintf(buf, sizeof(buf), "journal: %lu cycles per append, %lu records replayed at %lu cycles each\n",
+			 (unsigned long) appendCycles, (unsigned long) replayed, (unsigned long) replayCycles);
+	NoteDebug(buf);
+	journalReport();
+	journalSimulateErase();
+}
+
+// Erase the simulated flash and start again with an empty journal
+void journalSimulateErase() {
+	for (int page=0; page<JOURNAL_PAGES; page++)
+		flashErase(page);
+	journalInit();
+}
+
+// Fail the simulated power once this many more words have been written, after which flash is left
+// as it was, as if the device had reset part way through a write.  A negative count restores it.
+void journalSimulatePowerLoss(int32_t words) {
+	simPowerWords = words;
+}
+
+#endif
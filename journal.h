@@ -0,0 +1,58 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "noteoutbox.h"
+
+// If true, the journal is kept in a RAM simulation of NOR flash rather than in internal flash, so that
+// its behavior and benchmarks can be exercised without wearing the real thing
+#ifndef JOURNAL_SIMULATE
+#define JOURNAL_SIMULATE		false
+#endif
+
+// Geometry of the journal, which by default occupies the top 64KB of the nRF52840's internal flash.  That
+// is reserved by the .journal section in flash_placement.xml, and FLASH_SIZE excludes it.
+#define JOURNAL_PAGE_SIZE		4096
+#if JOURNAL_SIMULATE
+#define JOURNAL_PAGES			4
+#else
+#define JOURNAL_PAGES			16
+#define JOURNAL_FLASH_START		(0x100000 - JOURNAL_PAGES*JOURNAL_PAGE_SIZE)
+#endif
+
+// Records are accumulated in RAM and written to flash together, in a single write of many words
+#define JOURNAL_WRITE_BUFFER	256
+#define JOURNAL_RECORD_MAX		(1 + 32 + NOTEOUTBOX_BODY_MAX)
+
+// Statistics, from which write amplification can be derived as flashBytes over payloadBytes
+typedef struct {
+	uint32_t appended;
+	uint32_t replayed;
+	uint32_t lost;
+	uint32_t corrupt;
+	uint32_t pending;
+	uint32_t payloadBytes;
+	uint32_t flashBytes;
+	uint32_t flashWrites;
+	uint32_t erases;
+} journalStats;
+
+bool journalInit(void);
+bool journalAppend(noteOutboxClass cls, const char *file, const char *body, bool sync);
+bool journalSync(void);
+bool journalReplay(void);
+void journalGetStats(journalStats *stats);
+void journalReport(void);
+#if JOURNAL_SIMULATE
+void journalBenchmark(int records);
+void journalSimulateErase(void);
+void journalSimulatePowerLoss(int32_t words);
+#endif
+
+#endif // JOURNAL_H
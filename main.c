@@ -11,21 +11,25 @@
 #include "nrf_delay.h"
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
+#include "nrf_log_default_backends.h"
+#include "SEGGER_RTT.h"
 #include "nrf_drv_power.h"
 #include "nrf_serial.h"
 #include "app_timer.h"
 #include "app_error.h"
 #include "app_util.h"
+#include "app_util_platform.h"
 #include "boards.h"
 #include "note.h"
+#include "sched.h"
+#include "pool.h"
+#include "power.h"
+#include "notetrace.h"
 
-#ifdef USING_SES
+#if defined(USING_SES) && NOTETRACE_DEBUG_PRINTF
 #include <cross_studio_io.h>
 #endif
 
-// Choose whether to use I2C or SERIAL for the Notecard
-#define	NOTECARD_USE_I2C	true
-
 // The Notecard serial port operates at a fixed 9600 N/8/1 with no hardware flow control.
 NRF_SERIAL_DRV_UART_CONFIG_DEF(m_uart0_drv_config,
 							   RX_PIN_NUMBER, TX_PIN_NUMBER,
@@ -63,19 +67,28 @@ uint64_t appClock = 0;
 APP_TIMER_DEF(timerAppTick);
 void timerAppTickHandler(void *context);
 
-// Data used for Notecard I/O functions
+// Single-shot RTC timer used by delay() so that the CPU can sleep rather than spin.  Long delays are
+// broken into segments because the RTC counter is only 24 bits wide (512 seconds at 32768 Hz).
+#define	DELAY_SEGMENT_MILLISECONDS (60*1000)
+APP_TIMER_DEF(timerDelay);
+static volatile bool delayExpired = false;
+void timerDelayHandler(void *context);
+
+// Allocation counters, maintained by the allocation hooks that are registered with note-c
+static uint32_t heapAllocs = 0;
+static uint32_t heapFrees = 0;
+
+// Data used for Notecard I/O functions.  The I2C buffers are static so that no I/O touches the heap;
+// they have room for the length header and for the largest chunk that we ask note-c to use.
 static size_t serialAvailable = 0;
 static char serialBuffer;
+static uint32_t serialLineLen = 0;
+static uint8_t i2cWriteBuffer[sizeof(uint8_t) + NOTE_I2C_MAX_DEFAULT];
+static uint8_t i2cReadBuffer[(sizeof(uint8_t)*2) + NOTE_I2C_MAX_DEFAULT];
 
 // Forwards
-void noteSerialReset(void);
-void noteSerialTransmit(uint8_t *text, size_t len, bool flush);
-bool noteSerialAvailable(void);
-char noteSerialReceive(void);
-void noteI2CReset(uint16_t DevAddress);
-size_t noteDebugSerialOutput(const char *message);
-const char *noteI2CTransmit(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size);
-const char *noteI2CReceive(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size, uint32_t *avail);
+void noteDebugSerialOutput(const char *text);
+void noteTraceRTTOutput(const char *text);
 
 // Main entry point
 int main(void) {
@@ -85,14 +98,28 @@ int main(void) {
 
 	// Initialize peripherals including the millisecond clock used for detecting I/O timeouts
 	nrf_drv_clock_init();
-	nrf_drv_power_init(NULL);
+	powerInit();
 	nrf_drv_clock_lfclk_request(NULL);
 	app_timer_init();
+
+	// Initialize logging to RTT.  Logging is deferred, so a log point only stores its arguments with an
+	// RTC timestamp, and the formatting and output are done by the run loop when idle.
+	NRF_LOG_INIT(app_timer_cnt_get);
+	NRF_LOG_DEFAULT_BACKENDS_INIT();
+
+	schedInit();
 	app_timer_create(&timerAppTick, APP_TIMER_MODE_REPEATED, timerAppTickHandler);
 	app_timer_start(timerAppTick, APP_TIMER_TICKS(APPTICK_MILLISECONDS), NULL);
+	app_timer_create(&timerDelay, APP_TIMER_MODE_SINGLE_SHOT, timerDelayHandler);
+
+	// Enable the DWT cycle counter, used for measuring the CPU cost of code paths
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 
 	// Register callbacks with note-c subsystem that it needs for I/O, memory, timer
-	NoteSetFn(malloc, free, delay, millis);
+	poolInit();
+	NoteSetFn(noteMalloc, noteFree, delay, millis);
 
 	// Register callbacks for Notecard I/O
 #if NOTECARD_USE_I2C
@@ -101,14 +128,20 @@ int main(void) {
 	NoteSetFnSerial(noteSerialReset, noteSerialTransmit, noteSerialAvailable, noteSerialReceive);
 #endif
 
-	// If running under SES, register a debug hook so that we can watch notecard I/O in the Output window
-#ifdef USING_SES
-	NoteSetFnDebugOutput(noteDebugSerialOutput);
+	// Record all Notecard I/O in the trace ring, and note-c's debug output whole in its text ring, both of
+	// which are cheap enough to leave enabled.  They are drained when idle to RTT, or to the SES Output
+	// window if that has been chosen.
+	NoteSetFnDebugOutput(noteTraceDebug);
+#if defined(USING_SES) && NOTETRACE_DEBUG_PRINTF
+	noteTraceSetOutput(noteDebugSerialOutput);
+#else
+	noteTraceSetOutput(noteTraceRTTOutput);
 #endif
 
-	// Use this method of invoking main app code so that we can re-use familiar Arduino examples
+	// Use this method of invoking main app code so that we can re-use familiar Arduino examples, except
+	// that rather than looping, setup() starts jobs that are then run by the event scheduler
 	setup();
-	while (true) loop();
+	schedRun();
 
 }
 
@@ -122,6 +155,9 @@ void noteSerialReset() {
 		nrf_serial_rx_drain(&serial_uart);
 		nrf_serial_uninit(&serial_uart);
 	}
+	noteTraceRecord(NOTETRACE_RESET, NULL, 0);
+	NRF_LOG_INFO("serial: reset");
+	serialLineLen = 0;
 	nrf_serial_init(&serial_uart, &m_uart0_drv_config, &serial_config);
 #ifdef SERIAL_SOFTWARE_PULLUP
 	nrf_gpio_cfg_input(RX_PIN_NUMBER, NRF_GPIO_PIN_PULLUP);
@@ -130,6 +166,9 @@ void noteSerialReset() {
 
 // Serial write data function
 void noteSerialTransmit(uint8_t *text, size_t len, bool flush) {
+	powerTransportActive();
+	noteTraceRecord(NOTETRACE_TX, text, len);
+	NRF_LOG_INFO("serial: tx %u", len);
 	nrf_serial_write(&serial_uart, text, len, NULL, NRF_SERIAL_MAX_TIMEOUT);
 	if (flush)
 		nrf_serial_flush(&serial_uart, 0);
@@ -137,6 +176,7 @@ void noteSerialTransmit(uint8_t *text, size_t len, bool flush) {
 
 // Serial "is anything available" function, which does a read-ahead for data into a serial buffer
 bool noteSerialAvailable() {
+	powerTransportActive();
 	if (!serialAvailable) {
 		ret_code_t err_code = nrf_serial_read(&serial_uart, &serialBuffer, sizeof(serialBuffer), &serialAvailable, 5);
 		if (err_code != NRF_SUCCESS && err_code != NRF_ERROR_TIMEOUT)
@@ -149,6 +189,12 @@ bool noteSerialAvailable() {
 char noteSerialReceive() {
 	while (!noteSerialAvailable()) ;
 	serialAvailable = 0;
+	noteTraceReceiveByte((uint8_t) serialBuffer);
+	serialLineLen++;
+	if (serialBuffer == '\n') {
+		NRF_LOG_INFO("serial: rx %u", serialLineLen);
+		serialLineLen = 0;
+	}
 	return serialBuffer;
 }
 
@@ -159,6 +205,8 @@ void noteI2CReset(uint16_t DevAddress) {
 		first = false;
 	else
 		nrfx_twi_uninit(&m_twi.u.twi);
+	noteTraceRecord(NOTETRACE_RESET, NULL, 0);
+	NRF_LOG_INFO("i2c: reset");
 	nrf_drv_twi_init(&m_twi, &twi_config, NULL, NULL);
 	nrf_drv_twi_enable(&m_twi);
 }
@@ -169,18 +217,23 @@ void noteI2CReset(uint16_t DevAddress) {
 const char *noteI2CTransmit(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size) {
 	char *errstr = NULL;
 	int writelen = sizeof(uint8_t) + Size;
-	uint8_t *writebuf = malloc(writelen);
-	if (writebuf == NULL) {
-		errstr = "i2c: insufficient memory (write)";
+	uint8_t *writebuf = i2cWriteBuffer;
+	if (writelen > (int) sizeof(i2cWriteBuffer)) {
+		errstr = "i2c: write too large";
 	} else {
 		writebuf[0] = Size;
 		memcpy(&writebuf[1], pBuffer, Size);
+		noteTraceRecord(NOTETRACE_TX, pBuffer, Size);
+		NRF_LOG_INFO("i2c: tx %u", Size);
 		ret_code_t err_code = nrf_drv_twi_tx(&m_twi, DevAddress, writebuf, writelen, false);
-		free(writebuf);
 		if (err_code != NRF_SUCCESS) {
 			errstr = "i2c: write error";
 		}
 	}
+	if (errstr != NULL) {
+		noteTraceRecord(NOTETRACE_ERROR, errstr, strlen(errstr));
+		NRF_LOG_WARNING("%s", errstr);
+	}
 	return errstr;
 }
 
@@ -206,9 +259,9 @@ const char *noteI2CReceive(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size,
 	if (errstr == NULL) {
 
 		int readlen = Size + (sizeof(uint8_t)*2);
-		uint8_t *readbuf = malloc(readlen);
-		if (readbuf == NULL) {
-			errstr = "i2c: insufficient memory (read)";
+		uint8_t *readbuf = i2cReadBuffer;
+		if (readlen > (int) sizeof(i2cReadBuffer)) {
+			errstr = "i2c: read too large";
 		} else {
 			err_code = nrf_drv_twi_rx(&m_twi, DevAddress, readbuf, readlen);
 			if (err_code != NRF_SUCCESS) {
@@ -221,22 +274,29 @@ const char *noteI2CReceive(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size,
 				} else {
 					*available = availbyte;
 					memcpy(pBuffer, &readbuf[2], Size);
+					if (Size > 0) {
+						noteTraceRecord(NOTETRACE_RX, pBuffer, Size);
+						NRF_LOG_INFO("i2c: rx %u, %u available", Size, availbyte);
+					} else {
+						NRF_LOG_DEBUG("i2c: poll, %u available", availbyte);
+					}
 				}
 			}
-			free(readbuf);
 		}
 	}
 
 	// Done
+	if (errstr != NULL) {
+		noteTraceRecord(NOTETRACE_ERROR, errstr, strlen(errstr));
+		NRF_LOG_WARNING("%s", errstr);
+	}
 	return errstr;
 
 }
 
-// Handle sleep while waiting for serial I/O
+// Handle sleep while waiting for serial I/O, or for anything else
 void sleep_handler(void) {
-	__WFE();
-	__SEV();
-	__WFE();
+	powerSleep();
 }
 
 // One second timer handler
@@ -244,9 +304,61 @@ void timerAppTickHandler(void *context) {
 	appClock += APPTICK_MILLISECONDS;
 }
 
-// Delay the specified number of milliseconds
+// Delay timer handler, which just wakes up the sleeping delay() loop
+void timerDelayHandler(void *context) {
+	delayExpired = true;
+}
+
+// Delay the specified number of milliseconds, sleeping until an RTC compare event fires.  We only
+// busy-wait for durations too short for the RTC to time, or when called from an interrupt handler
+// because the RTC interrupt could then never preempt us.
 void delay(uint32_t ms) {
-	nrf_delay_ms(ms);
+	if (current_int_priority_get() != APP_IRQ_PRIORITY_THREAD) {
+		nrf_delay_ms(ms);
+		return;
+	}
+	while (ms > 0) {
+		uint32_t segment = ms > DELAY_SEGMENT_MILLISECONDS ? DELAY_SEGMENT_MILLISECONDS : ms;
+		uint32_t ticks = APP_TIMER_TICKS(segment);
+		ms -= segment;
+		if (ticks < APP_TIMER_MIN_TIMEOUT_TICKS) {
+			nrf_delay_ms(segment);
+			continue;
+		}
+		delayExpired = false;
+		if (app_timer_start(timerDelay, ticks, NULL) != NRF_SUCCESS) {
+			nrf_delay_ms(segment);
+			continue;
+		}
+		while (!delayExpired)
+			sleep_handler();
+	}
+}
+
+// Allocate memory on behalf of note-c.  J nodes and short strings come from fixed-size block pools,
+// and anything else from a per-transaction arena that is reclaimed as a whole at the end of each
+// transaction, with the heap used only when both of those are exhausted.
+void *noteMalloc(size_t size) {
+	heapAllocs++;
+	return poolMalloc(size);
+}
+
+// Free memory on behalf of note-c
+void noteFree(void *p) {
+	if (p != NULL)
+		heapFrees++;
+	poolFree(p);
+}
+
+// Get the number of allocations and frees done by note-c since boot
+void heapStats(uint32_t *allocs, uint32_t *frees) {
+	*allocs = heapAllocs;
+	*frees = heapFrees;
+}
+
+// Get the CPU cycle counter, which wraps every 67 seconds at 64 MHz
+uint32_t cycles() {
+	return DWT->CYCCNT;
 }
 
 // Get the number of app milliseconds since boot (this will wrap)
@@ -254,9 +366,17 @@ long unsigned int millis() {
 	return (long unsigned int) appClock;
 }
 
-// On SES (Crossworks), it's possible to do SWD debug output using this debug_printf call.
-#ifdef USING_SES
-size_t noteDebugSerialOutput(const char *message) {
-	debug_printf(message);
+// On SES (Crossworks), it's possible to do SWD debug output using this debug_printf call.  Because
+// it stalls for milliseconds per line, it is only used if chosen, and only when draining the trace
+// from idle.
+#if defined(USING_SES) && NOTETRACE_DEBUG_PRINTF
+void noteDebugSerialOutput(const char *text) {
+	debug_printf("%s", text);
 }
 #endif
+
+// Otherwise, the trace is written to RTT alongside the log.  Both are only written when idle, a line
+// at a time, so that they don't interleave.
+void noteTraceRTTOutput(const char *text) {
+	SEGGER_RTT_WriteString(0, text);
+}
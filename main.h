@@ -6,10 +6,32 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+// Choose whether to use I2C or SERIAL for the Notecard
+#define	NOTECARD_USE_I2C	true
+
+// Choose whether, when built under SES, the trace and debug output is drained to its Output window
+// with debug_printf rather than to RTT.  It stalls for milliseconds per line, so it is opt-in.
+#ifndef NOTETRACE_DEBUG_PRINTF
+#define	NOTETRACE_DEBUG_PRINTF	false
+#endif
+
+// Notecard I/O functions, registered with note-c and also used directly by the async request path
+void noteSerialReset(void);
+void noteSerialTransmit(uint8_t *text, size_t len, bool flush);
+bool noteSerialAvailable(void);
+char noteSerialReceive(void);
+void noteI2CReset(uint16_t DevAddress);
+const char *noteI2CTransmit(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size);
+const char *noteI2CReceive(uint16_t DevAddress, uint8_t* pBuffer, uint16_t Size, uint32_t *avail);
+
 void delay(uint32_t ms);
 long unsigned int millis(void);
+uint32_t cycles(void);
+void *noteMalloc(size_t size);
+void noteFree(void *p);
+void heapStats(uint32_t *allocs, uint32_t *frees);
+void sleep_handler(void);
 void setup(void);
-void loop(void);
 
 #endif // MAIN_H
 
@@ -0,0 +1,126 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// MD5 message digest, per RFC 1321.  This is what the Notecard uses to verify the contents of its
+// binary buffer, so it is used here for that purpose only, not for anything requiring security.
+
+#include <string.h>
+#include "md5.h"
+
+// Per-round shift amounts
+static const uint8_t shifts[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+// Per-round constants, the integer parts of abs(sin(i+1)) * 2^32
+static const uint32_t sines[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+// Process one 64-byte block
+static void md5Block(md5Context *ctx, const uint8_t *block) {
+	uint32_t m[16];
+	for (int i=0; i<16; i++)
+		m[i] = (uint32_t) block[i*4] | ((uint32_t) block[i*4+1] << 8) | ((uint32_t) block[i*4+2] << 16) | ((uint32_t) block[i*4+3] << 24);
+	uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+	for (int i=0; i<64; i++) {
+		uint32_t f;
+		int g;
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5*i + 1) % 16;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3*i + 5) % 16;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7*i) % 16;
+		}
+		f += a + sines[i] + m[g];
+		a = d;
+		d = c;
+		c = b;
+		b += (f << shifts[i]) | (f >> (32 - shifts[i]));
+	}
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+}
+
+// Begin a digest
+void md5Init(md5Context *ctx) {
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->bytes = 0;
+}
+
+// Add data to a digest
+void md5Update(md5Context *ctx, const uint8_t *data, size_t len) {
+	size_t used = (size_t) (ctx->bytes % 64);
+	ctx->bytes += len;
+	if (used > 0) {
+		size_t n = 64 - used;
+		if (n > len)
+			n = len;
+		memcpy(&ctx->block[used], data, n);
+		data += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		md5Block(ctx, ctx->block);
+	}
+	for (; len >= 64; data += 64, len -= 64)
+		md5Block(ctx, data);
+	memcpy(ctx->block, data, len);
+}
+
+// Finish a digest
+void md5Final(md5Context *ctx, uint8_t digest[MD5_DIGEST_LEN]) {
+	uint64_t bits = ctx->bytes * 8;
+	uint8_t pad[72];
+	size_t padLen = 64 - (size_t) ((ctx->bytes + 8) % 64);
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (int i=0; i<8; i++)
+		pad[padLen+i] = (uint8_t) (bits >> (i*8));
+	md5Update(ctx, pad, padLen + 8);
+	for (int i=0; i<16; i++)
+		digest[i] = (uint8_t) (ctx->state[i/4] >> ((i%4)*8));
+}
+
+// Finish a digest, as lowercase hex
+void md5FinalHex(md5Context *ctx, char hex[MD5_HEX_LEN]) {
+	static const char digits[] = "0123456789abcdef";
+	uint8_t digest[MD5_DIGEST_LEN];
+	md5Final(ctx, digest);
+	for (int i=0; i<MD5_DIGEST_LEN; i++) {
+		hex[i*2] = digits[digest[i] >> 4];
+		hex[i*2+1] = digits[digest[i] & 0x0f];
+	}
+	hex[MD5_DIGEST_LEN*2] = '\0';
+}
+
+// Digest a buffer, as lowercase hex
+void md5Hex(const uint8_t *data, size_t len, char hex[MD5_HEX_LEN]) {
+	md5Context ctx;
+	md5Init(&ctx);
+	md5Update(&ctx, data, len);
+	md5FinalHex(&ctx, hex);
+}
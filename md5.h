@@ -0,0 +1,28 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef MD5_H
+#define MD5_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Length of a digest, and of its hex representation including the terminator
+#define MD5_DIGEST_LEN		16
+#define MD5_HEX_LEN			(MD5_DIGEST_LEN*2+1)
+
+// State of an incremental digest
+typedef struct {
+	uint32_t state[4];
+	uint64_t bytes;
+	uint8_t block[64];
+} md5Context;
+
+void md5Init(md5Context *ctx);
+void md5Update(md5Context *ctx, const uint8_t *data, size_t len);
+void md5Final(md5Context *ctx, uint8_t digest[MD5_DIGEST_LEN]);
+void md5FinalHex(md5Context *ctx, char hex[MD5_HEX_LEN]);
+void md5Hex(const uint8_t *data, size_t len, char hex[MD5_HEX_LEN]);
+
+#endif // MD5_H
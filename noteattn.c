@@ -0,0 +1,196 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Interrupt-driven wakeup through the Notecard's ATTN pin.  card.attn arms the Notecard to drive ATTN
+// high when one of a chosen set of events occurs, such as the arrival of inbound notes, and a GPIOTE
+// port event senses the rising edge while the host sleeps.  Because the port event uses the pin's
+// SENSE mechanism rather than a GPIOTE channel, it costs no current while waiting, and nothing runs at
+// all until the Notecard has something to say.  When ATTN fires, card.attn is asked which events
+// occurred, the handler is told, and ATTN is armed again.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "sched.h"
+#include "notereq.h"
+#include "noteattn.h"
+#include "nrfx_gpiote.h"
+#include "nrf_gpio.h"
+#include "app_timer.h"
+#include "boards.h"
+
+// What the Notecard is armed for, so that it can be armed again in the same way
+static uint8_t armEvents = 0;
+static const char *armFiles[NOTEATTN_MAX_FILES];
+static int armFileCount = 0;
+
+static noteAttnHandler attnHandler = NULL;
+static void *attnContext = NULL;
+static volatile bool armed = false;
+static bool querying = false;
+static noteAttnStats stats;
+
+// Timer used to delay retries of arming
+APP_TIMER_DEF(timerRetry);
+static bool timerCreated = false;
+static int retries = 0;
+
+// Forwards
+static void noteAttnFired(void *context);
+static void noteAttnArmDone(noteReqHandle handle, J *rsp, void *context);
+static void noteAttnQueryDone(noteReqHandle handle, J *rsp, void *context);
+static void noteAttnRearm(void *context);
+
+// Pin change handler, called at interrupt level on the rising edge of ATTN
+static void noteAttnPinHandler(nrfx_gpiote_pin_t pin, nrf_gpiote_polarity_t action) {
+	if (!armed)
+		return;
+	armed = false;
+	if (!schedPost(noteAttnFired, NULL))
+		armed = true;
+}
+
+// Begin sensing ATTN, whose events are reported to the handler once it has been armed
+bool noteAttnInit(noteAttnHandler handler, void *context) {
+	attnHandler = handler;
+	attnContext = context;
+	if (!nrfx_gpiote_is_init() && nrfx_gpiote_init() != NRFX_SUCCESS)
+		return false;
+
+	// A low-accuracy input uses the PORT event, and the pull-down keeps an unconnected pin from firing
+	nrfx_gpiote_in_config_t config = NRFX_GPIOTE_CONFIG_IN_SENSE_LOTOHI(false);
+	config.pull = NRF_GPIO_PIN_PULLDOWN;
+	if (nrfx_gpiote_in_init(ATTN_PIN_NUMBER, &config, noteAttnPinHandler) != NRFX_SUCCESS)
+		return false;
+	nrfx_gpiote_in_event_enable(ATTN_PIN_NUMBER, true);
+	return true;
+}
+
+// Write the card.attn request that arms the Notecard
+static void noteAttnEmitArm(noteWriter *w, void *context) {
+	char mode[48];
+	strcpy(mode, "arm");
+	if (armEvents & NOTEATTN_FILES)
+		strcat(mode, ",files");
+	if (armEvents & NOTEATTN_MOTION)
+		strcat(mode, ",motion");
+	if (armEvents & NOTEATTN_CONNECTED)
+		strcat(mode, ",connected");
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "card.attn");
+	noteWriterString(w, "mode", mode);
+	if ((armEvents & NOTEATTN_FILES) && armFileCount > 0) {
+		noteWriterArrayBegin(w, "files");
+		for (int i=0; i<armFileCount; i++)
+			noteWriterString(w, NULL, armFiles[i]);
+		noteWriterArrayEnd(w);
+	}
+	noteWriterObjectEnd(w);
+}
+
+// Arm the Notecard to raise ATTN when any of the events occurs, where files are the inbound notefiles
+// watched for NOTEATTN_FILES.  The Notecard stays armed across firings, because it is armed again
+// each time that the handler has been told.
+bool noteAttnArm(uint8_t events, const char **files, int fileCount) {
+	if (fileCount > NOTEATTN_MAX_FILES)
+		return false;
+	armEvents = events;
+	armFileCount = fileCount;
+	for (int i=0; i<fileCount; i++)
+		armFiles[i] = files[i];
+	armed = false;
+	return noteRequestAsyncEmit(noteAttnEmitArm, NULL, noteAttnArmDone, NULL) != 0;
+}
+
+// Retry timer handler, called at interrupt level
+static void timerRetryHandler(void *context) {
+	if (!schedPost(noteAttnRearm, NULL))
+		app_timer_start(timerRetry, APP_TIMER_TICKS(NOTEATTN_RETRY_MS), NULL);
+}
+
+// Arming has failed, so try again after a delay, or once the retries are exhausted tell the owner
+static void noteAttnArmFailed() {
+	stats.failed++;
+	if (retries < NOTEATTN_RETRIES) {
+		uint32_t ms = NOTEATTN_RETRY_MS << retries;
+		retries++;
+		if (!timerCreated)
+			timerCreated = (app_timer_create(&timerRetry, APP_TIMER_MODE_SINGLE_SHOT, timerRetryHandler) == NRF_SUCCESS);
+		if (timerCreated && app_timer_start(timerRetry, APP_TIMER_TICKS(ms), NULL) == NRF_SUCCESS)
+			return;
+	}
+	retries = 0;
+	char buf[64];
+	snprintf(buf, sizeof(buf), "noteattn: can't arm the Notecard\n");
+	NoteDebug(buf);
+	if (attnHandler != NULL)
+		attnHandler(NULL, attnContext);
+}
+
+// Arm the Notecard again in the same way
+static void noteAttnRearm(void *context) {
+	if (!noteAttnArm(armEvents, armFiles, armFileCount))
+		noteAttnArmFailed();
+}
+
+// True if the Notecard is armed and ATTN hasn't yet fired
+bool noteAttnArmed() {
+	return armed;
+}
+
+// Completion of arming, after which ATTN is low until an event occurs.  If ATTN is already high, an
+// event occurred before the edge could be sensed, so it is treated as having fired.
+static void noteAttnArmDone(noteReqHandle handle, J *rsp, void *context) {
+	bool success = (rsp != NULL && !NoteResponseError(rsp));
+	if (rsp != NULL)
+		NoteDeleteResponse(rsp);
+	if (!success) {
+		noteAttnArmFailed();
+		return;
+	}
+	retries = 0;
+	stats.arms++;
+	armed = true;
+	if (nrf_gpio_pin_read(ATTN_PIN_NUMBER)) {
+		armed = false;
+		noteAttnFired(NULL);
+	}
+}
+
+// ATTN has fired, so ask the Notecard why
+static void noteAttnFired(void *context) {
+	stats.fires++;
+	if (querying)
+		return;
+	querying = (noteRequestAsyncJSON("{\"req\":\"card.attn\"}", noteAttnQueryDone, NULL) != 0);
+	if (!querying) {
+		stats.failed++;
+		noteAttnRearm(NULL);
+	}
+}
+
+// Completion of the query, which is handed to the handler before the Notecard is armed again
+static void noteAttnQueryDone(noteReqHandle handle, J *rsp, void *context) {
+	querying = false;
+	if (rsp != NULL && !NoteResponseError(rsp) && attnHandler != NULL)
+		attnHandler(rsp, attnContext);
+	else
+		stats.failed++;
+	if (rsp != NULL)
+		NoteDeleteResponse(rsp);
+	noteAttnRearm(NULL);
+}
+
+// Get the statistics
+void noteAttnGetStats(noteAttnStats *out) {
+	*out = stats;
+}
+
+// Report how often ATTN has fired
+void noteAttnReport() {
+	char buf[96];
+	snprintf(buf, sizeof(buf), "noteattn: %lu arms, %lu fires, %lu failed\n",
+			 (unsigned long) stats.arms, (unsigned long) stats.fires, (unsigned long) stats.failed);
+	NoteDebug(buf);
+}
@@ -0,0 +1,43 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEATTN_H
+#define NOTEATTN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "note.h"
+
+// Events that can be armed to raise the Notecard's ATTN pin
+#define NOTEATTN_FILES			0x01		// Notes have arrived in one of the watched inbound notefiles
+#define NOTEATTN_MOTION			0x02		// The Notecard's accelerometer has detected motion
+#define NOTEATTN_CONNECTED		0x04		// The Notecard has connected to the service
+
+// Maximum number of notefiles that may be watched through ATTN
+#define NOTEATTN_MAX_FILES		4
+
+// If arming fails, it is retried this many times, with a delay that doubles from the first
+#define NOTEATTN_RETRIES		5
+#define NOTEATTN_RETRY_MS		1000
+
+// Called in thread context after ATTN has fired, with the card.attn response describing why, such as
+// {"files":["config.qi"]} or {"motion":true}.  The response is freed when the handler returns.  If
+// the Notecard couldn't be armed even after retrying, the handler is called with a NULL response, so
+// that its owner can fall back to polling.
+typedef void (*noteAttnHandler)(J *rsp, void *context);
+
+// How often ATTN has woken the host, compared with how often it has been armed
+typedef struct {
+	uint32_t arms;
+	uint32_t fires;
+	uint32_t failed;
+} noteAttnStats;
+
+bool noteAttnInit(noteAttnHandler handler, void *context);
+bool noteAttnArm(uint8_t events, const char **files, int fileCount);
+bool noteAttnArmed(void);
+void noteAttnGetStats(noteAttnStats *stats);
+void noteAttnReport(void);
+
+#endif // NOTEATTN_H
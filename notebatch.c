@@ -0,0 +1,273 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Batched uplink.  Rather than adding every reading to a notefile with its own note.add, the bodies
+// of pending notes are written into a fixed RAM buffer as compact JSON, and are sent together as the
+// array within the body of a single note once enough of them, enough bytes, or a note that is old
+// enough, has accumulated.  The framing of the request and the round trip to the Notecard are then
+// paid once per batch rather than once per reading.
+//
+// The batch is streamed to the Notecard by a writer straight out of the buffer in which it was
+// accumulated, so no heap is used and nothing larger than one I2C chunk is ever copied.  Notes may
+// continue to be added while a batch is in flight; they are placed after it in the buffer, and are
+// moved down once the Notecard has accepted it.  If the Notecard rejects the batch it is retained
+// and sent again when the age threshold next expires.
+//
+// Batches are sent through the outbox as routine traffic, so that alarms are sent ahead of them.  When
+// the host is about to lose what is in RAM, the notes that haven't been sent can be spilled one at a
+// time to somewhere more durable, such as the journal, whose records are too small for a whole batch.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "notebatch.h"
+
+// The portion of the buffer that a note is being written into
+typedef struct {
+	noteBatch *b;
+	size_t len;
+} noteBatchAppend;
+
+// The writer used to add notes, which are always added in thread context
+static noteWriter writer;
+
+// Forwards
+static void noteBatchAge(void *context);
+static void noteBatchEmit(noteWriter *w, void *context);
+static void noteBatchDone(noteReqHandle handle, J *rsp, void *context);
+
+// Prepare a batch.  The caller fills in the configuration fields and leaves the rest zeroed.
+bool noteBatchInit(noteBatch *b) {
+	if (b->file == NULL || b->arrayKey == NULL)
+		return false;
+	if (b->maxBytes == 0 || b->maxBytes > NOTEBATCH_BUFFER_LEN)
+		b->maxBytes = NOTEBATCH_BUFFER_LEN;
+	b->ageJob.name = "batch";
+	b->ageJob.periodMs = b->maxAgeMs;
+	b->ageJob.handler = noteBatchAge;
+	b->ageJob.context = b;
+	return true;
+}
+
+// True if a threshold has been reached
+static bool noteBatchDue(noteBatch *b) {
+	return (b->maxNotes != 0 && b->notes >= b->maxNotes) || b->len >= b->maxBytes;
+}
+
+// Start timing the age of the oldest pending note.  If its age can't be timed, rather than holding
+// the pending notes until some other threshold is reached, they are sent now.
+static void noteBatchAgeStart(noteBatch *b) {
+	if (b->maxAgeMs == 0 || schedJobStart(&b->ageJob, false))
+		return;
+	char buf[64];
+	snprintf(buf, sizeof(buf), "notebatch: %s: can't time the age of notes\n", b->file);
+	NoteDebug(buf);
+	noteBatchFlush(b);
+}
+
+// Output function used to write a note into the free space at the end of the buffer
+static const char *noteBatchOutput(void *context, const uint8_t *data, size_t len) {
+	noteBatchAppend *a = (noteBatchAppend *) context;
+	if (a->len + len > NOTEBATCH_BUFFER_LEN)
+		return "batch is full";
+	memcpy(&a->b->buf[a->len], data, len);
+	a->len += len;
+	return NULL;
+}
+
+// Begin writing a note
+static void noteBatchNoteBegin(noteBatch *b, noteBatchAppend *a) {
+	a->b = b;
+	a->len = b->len;
+	noteWriterBegin(&writer, noteBatchOutput, a);
+}
+
+// Finish writing a note, and flush the batch if that has reached a threshold.  If the note didn't
+// fit it is dropped, and the batch is flushed to make room for the next.  Each note is followed by
+// a comma, so that the buffer is always a valid JSON array body but for the last.
+static bool noteBatchNoteEnd(noteBatch *b, noteBatchAppend *a) {
+	if (noteWriterEnd(&writer) != NULL || a->len >= NOTEBATCH_BUFFER_LEN) {
+		b->stats.dropped++;
+		noteBatchFlush(b);
+		return false;
+	}
+	if (b->schema != NULL) {
+		const char *errstr = noteTemplateCheckJSON(b->schema, &b->buf[b->len], a->len - b->len);
+		if (errstr != NULL) {
+			char buf[96];
+			snprintf(buf, sizeof(buf), "notebatch: %s: %s\n", b->file, errstr);
+			NoteDebug(buf);
+			b->stats.invalid++;
+			return false;
+		}
+	}
+	b->buf[a->len++] = ',';
+	b->len = (uint16_t) a->len;
+	b->notes++;
+	b->stats.added++;
+	if (b->notes == b->flushNotes + 1)
+		noteBatchAgeStart(b);
+	if (!b->flushing && noteBatchDue(b))
+		noteBatchFlush(b);
+	return true;
+}
+
+// Add a note whose body is a J object, which remains owned by the caller
+bool noteBatchAdd(noteBatch *b, J *body) {
+	noteBatchAppend a;
+	noteBatchNoteBegin(b, &a);
+	noteWriterJ(&writer, NULL, body);
+	return noteBatchNoteEnd(b, &a);
+}
+
+// Add a note whose body is already JSON text
+bool noteBatchAddJSON(noteBatch *b, const char *json) {
+	noteBatchAppend a;
+	noteBatchNoteBegin(b, &a);
+	noteWriterRaw(&writer, json, strlen(json));
+	return noteBatchNoteEnd(b, &a);
+}
+
+// Add a note whose body is written by a function, which is the cheapest way of adding a note
+bool noteBatchAddEmit(noteBatch *b, noteReqEmitter emit, void *context) {
+	noteBatchAppend a;
+	noteBatchNoteBegin(b, &a);
+	emit(&writer, context);
+	return noteBatchNoteEnd(b, &a);
+}
+
+// Send the pending notes to the Notecard now, regardless of thresholds.  Returns false if there is
+// nothing to send, if a batch is already in flight, or if the outbox won't take it.
+bool noteBatchFlush(noteBatch *b) {
+	if (b->flushing || b->notes == 0)
+		return false;
+	b->flushLen = b->len;
+	b->flushNotes = b->notes;
+	b->flushing = noteOutboxSubmit(NOTEOUTBOX_ROUTINE, noteBatchEmit, b, noteBatchDone, b);
+	if (!b->flushing) {
+		b->flushLen = 0;
+		b->flushNotes = 0;
+		return false;
+	}
+	schedJobStop(&b->ageJob);
+	b->stats.flushes++;
+	return true;
+}
+
+// Length of the note at the start of the specified text, up to the comma that follows it
+static size_t noteBatchNoteLen(const char *text, size_t len) {
+	int depth = 0;
+	bool quoted = false;
+	bool escaped = false;
+	for (size_t i=0; i<len; i++) {
+		char c = text[i];
+		if (escaped)
+			escaped = false;
+		else if (quoted && c == '\\')
+			escaped = true;
+		else if (c == '"')
+			quoted = !quoted;
+		else if (quoted)
+			continue;
+		else if (c == '{' || c == '[')
+			depth++;
+		else if (c == '}' || c == ']')
+			depth--;
+		else if (c == ',' && depth == 0)
+			return i;
+	}
+	return len;
+}
+
+// Hand the pending notes that aren't in flight to a spill function, each as a batch of one so that
+// the notefile still receives bodies of the same shape, returning how many were taken.  The rest are
+// dropped, so that the batch is left holding no more than what is in flight.
+uint16_t noteBatchSpill(noteBatch *b, noteOutboxSpill spill) {
+	char body[NOTEOUTBOX_BODY_MAX];
+	uint16_t spilled = 0;
+	size_t offset = b->flushLen;
+	while (offset < b->len) {
+		size_t noteLen = noteBatchNoteLen(&b->buf[offset], b->len - offset);
+		int len = snprintf(body, sizeof(body), "{\"%s\":[%.*s]}", b->arrayKey, (int) noteLen, &b->buf[offset]);
+		if (len > 0 && (size_t) len < sizeof(body) && spill(NOTEOUTBOX_ROUTINE, b->file, body, false))
+			spilled++;
+		else
+			b->stats.dropped++;
+		offset += noteLen + 1;
+	}
+	b->stats.spilled += spilled;
+	b->len = b->flushLen;
+	b->notes = b->flushNotes;
+	if (b->notes == 0)
+		schedJobStop(&b->ageJob);
+	return spilled;
+}
+
+// Get the statistics for a batch, optionally resetting them
+void noteBatchGetStats(noteBatch *b, noteBatchStats *stats, bool reset) {
+	if (stats != NULL)
+		*stats = b->stats;
+	if (reset)
+		memset(&b->stats, 0, sizeof(b->stats));
+}
+
+// Report how many notes have been carried by how few transactions
+void noteBatchReport(noteBatch *b) {
+	char buf[160];
+	snprintf(buf, sizeof(buf), "notebatch: %s: %lu notes in %lu transactions (%lu failed, %lu dropped, %lu invalid, %lu spilled), %lu bytes\n",
+			 b->file, (unsigned long) b->stats.sent, (unsigned long) b->stats.flushes, (unsigned long) b->stats.failed,
+			 (unsigned long) b->stats.dropped, (unsigned long) b->stats.invalid, (unsigned long) b->stats.spilled,
+			 (unsigned long) b->stats.bytes);
+	NoteDebug(buf);
+}
+
+// The oldest pending note has reached the age threshold
+static void noteBatchAge(void *context) {
+	noteBatchFlush((noteBatch *) context);
+}
+
+// Write the note.add request that carries the batch, at the moment that it is transmitted
+static void noteBatchEmit(noteWriter *w, void *context) {
+	noteBatch *b = (noteBatch *) context;
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "note.add");
+	noteWriterString(w, "file", b->file);
+	if (b->start)
+		noteWriterBool(w, "start", true);
+	noteWriterObjectBegin(w, "body");
+	noteWriterArrayBegin(w, b->arrayKey);
+	noteWriterRaw(w, b->buf, b->flushLen - 1);
+	noteWriterArrayEnd(w);
+	noteWriterObjectEnd(w);
+	noteWriterObjectEnd(w);
+}
+
+// Completion of a batch, which is discarded if the Notecard accepted it, else retained to be retried.
+// The response is NULL if the outbox dropped the batch to make room for something more important.
+static void noteBatchDone(noteReqHandle handle, J *rsp, void *context) {
+	noteBatch *b = (noteBatch *) context;
+	bool success = (rsp != NULL && !NoteResponseError(rsp));
+	if (rsp != NULL)
+		NoteDeleteResponse(rsp);
+	if (success) {
+		b->stats.sent += b->flushNotes;
+		b->stats.bytes += b->flushLen;
+		memmove(b->buf, &b->buf[b->flushLen], b->len - b->flushLen);
+		b->len -= b->flushLen;
+		b->notes -= b->flushNotes;
+	} else {
+		b->stats.failed++;
+	}
+	b->flushLen = 0;
+	b->flushNotes = 0;
+	b->flushing = false;
+
+	// Send what accumulated meanwhile if that has itself reached a threshold, else time its age
+	if (b->notes == 0)
+		return;
+	if (success && noteBatchDue(b) && noteBatchFlush(b))
+		return;
+	noteBatchAgeStart(b);
+
+}
@@ -0,0 +1,64 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEBATCH_H
+#define NOTEBATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+#include "sched.h"
+#include "notereq.h"
+#include "notewriter.h"
+#include "notetemplate.h"
+#include "noteoutbox.h"
+
+// RAM in which the bodies of pending notes are held, which is also the upper bound on the size
+// of the body of the note that carries them
+#define NOTEBATCH_BUFFER_LEN	768
+
+// Statistics for a batch
+typedef struct {
+	uint32_t added;
+	uint32_t sent;
+	uint32_t dropped;
+	uint32_t invalid;
+	uint32_t flushes;
+	uint32_t failed;
+	uint32_t spilled;
+	uint32_t bytes;
+} noteBatchStats;
+
+// Notes that are accumulated in RAM and added to a notefile together, as a single note whose body
+// holds an array of the individual bodies, when any of the configured thresholds is reached.
+// Thresholds that are zero are not used.  If a schema is supplied, notes that don't fit it are rejected.
+typedef struct {
+	const char *file;
+	const char *arrayKey;
+	noteTemplate *schema;
+	bool start;
+	uint16_t maxNotes;
+	uint16_t maxBytes;
+	uint32_t maxAgeMs;
+	schedJob ageJob;
+	char buf[NOTEBATCH_BUFFER_LEN];
+	uint16_t len;
+	uint16_t notes;
+	uint16_t flushLen;
+	uint16_t flushNotes;
+	bool flushing;
+	noteBatchStats stats;
+} noteBatch;
+
+bool noteBatchInit(noteBatch *b);
+bool noteBatchAdd(noteBatch *b, J *body);
+bool noteBatchAddJSON(noteBatch *b, const char *json);
+bool noteBatchAddEmit(noteBatch *b, noteReqEmitter emit, void *context);
+bool noteBatchFlush(noteBatch *b);
+uint16_t noteBatchSpill(noteBatch *b, noteOutboxSpill spill);
+void noteBatchGetStats(noteBatch *b, noteBatchStats *stats, bool reset);
+void noteBatchReport(noteBatch *b);
+
+#endif // NOTEBATCH_H
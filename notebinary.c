@@ -0,0 +1,338 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Bulk binary transfer through the Notecard's binary buffer.  Rather than base64-encoding data and
+// wrapping it in JSON strings, data is sent as raw bytes that follow a card.binary.put request on
+// the wire, and received as raw bytes in place of the JSON response to card.binary.get.  So that
+// the newline that terminates every request and response can't occur within the data, the data is
+// COBS-encoded, which removes every zero byte at a cost of one byte in 254, and then XORed with the
+// newline.  Every chunk carries the MD5 of its contents, which the Notecard verifies, and the MD5 of
+// the whole buffer is compared with the Notecard's at the end of each transfer.
+//
+// Transfers are asynchronous, and are made of a sequence of requests on the request queue, each of
+// which is issued from the completion of the one before.  Data is encoded straight out of the
+// caller's buffer as it is transmitted, and decoded straight into it as it is received.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "notebinary.h"
+
+// Longest run of non-zero bytes in a COBS block
+#define COBS_MAX_RUN	254
+
+// Steps of a transfer
+enum {
+	PHASE_CLEAR,
+	PHASE_PUT,
+	PHASE_PUT_VERIFY,
+	PHASE_GET_INFO,
+	PHASE_GET,
+	PHASE_DONE
+};
+
+// Forwards
+static void noteBinaryNext(noteBinaryXfer *x);
+static void noteBinaryInfoDone(noteReqHandle handle, noteParser *parser, void *context);
+static void noteBinaryPutDone(noteReqHandle handle, J *rsp, void *context);
+static void noteBinaryGetDone(noteReqHandle handle, const char *errstr, void *context);
+
+// Output function that only counts bytes
+static const char *noteBinaryCount(void *context, const uint8_t *data, size_t len) {
+	return NULL;
+}
+
+// Number of bytes that the specified data occupies once encoded
+size_t noteCobsEncodedLen(const uint8_t *data, size_t len) {
+	static noteWriter w;
+	noteWriterBegin(&w, noteBinaryCount, NULL);
+	noteCobsWrite(&w, data, len, NOTEBINARY_EOP);
+	noteWriterEnd(&w);
+	return w.total;
+}
+
+// Write data COBS-encoded, with every byte XORed with eop so that eop never occurs within it.  Each
+// block is a code byte, which is one more than the number of non-zero bytes that follow it, with a
+// zero implied after them unless the block is the longest possible or the last.
+void noteCobsWrite(noteWriter *w, const uint8_t *data, size_t len, uint8_t eop) {
+	char out[32];
+	size_t i = 0;
+	for (;;) {
+		size_t run = 0;
+		while (i + run < len && data[i + run] != 0 && run < COBS_MAX_RUN)
+			run++;
+		out[0] = (char) ((run + 1) ^ eop);
+		size_t outLen = 1;
+		for (size_t j=0; j<run; j++) {
+			out[outLen++] = (char) (data[i + j] ^ eop);
+			if (outLen == sizeof(out)) {
+				noteWriterRaw(w, out, outLen);
+				outLen = 0;
+			}
+		}
+		noteWriterRaw(w, out, outLen);
+		i += run;
+		if (i == len)
+			break;
+		if (run < COBS_MAX_RUN)
+			i++;
+	}
+}
+
+// Begin decoding into the specified buffer
+void noteCobsDecodeBegin(noteCobsDecoder *d, uint8_t *out, size_t outMax) {
+	memset(d, 0, sizeof(noteCobsDecoder));
+	d->out = out;
+	d->outMax = outMax;
+}
+
+// Append a decoded byte
+static bool noteCobsPut(noteCobsDecoder *d, uint8_t ch) {
+	if (d->outLen == d->outMax) {
+		d->invalid = true;
+		return false;
+	}
+	d->out[d->outLen++] = ch;
+	return true;
+}
+
+// Decode data as it arrives, until eop is seen, after which further data is ignored.  The zero
+// implied at the end of a block is only output once another block follows it.  Returns false if
+// the data is invalid or doesn't fit.
+bool noteCobsDecodeFeed(noteCobsDecoder *d, const uint8_t *data, size_t len, uint8_t eop) {
+	for (size_t i=0; i<len && !d->done; i++) {
+		if (d->invalid)
+			return false;
+		if (data[i] == eop) {
+			d->done = true;
+			if (d->remaining != 0)
+				d->invalid = true;
+			break;
+		}
+		uint8_t ch = data[i] ^ eop;
+		if (d->remaining > 0) {
+			noteCobsPut(d, ch);
+			d->remaining--;
+			continue;
+		}
+		if (ch == 0) {
+			d->invalid = true;
+			break;
+		}
+		if (d->zeroPending)
+			noteCobsPut(d, 0);
+		d->remaining = ch - 1;
+		d->zeroPending = (ch != COBS_MAX_RUN + 1);
+	}
+	return !d->invalid;
+}
+
+// Begin a transfer
+static void noteBinaryBegin(noteBinaryXfer *x, uint8_t phase, noteBinaryCallback callback, void *context) {
+	x->offset = 0;
+	x->phase = phase;
+	x->callback = callback;
+	x->context = context;
+	x->startMs = (uint32_t) millis();
+	md5Init(&x->md5);
+	memset(x->fields, 0, sizeof(x->fields));
+	x->fields[0].key = "length";
+	x->fields[0].type = NOTEPARSE_NUMBER;
+	x->fields[1].key = "max";
+	x->fields[1].type = NOTEPARSE_NUMBER;
+	x->fields[2].key = "status";
+	x->fields[2].type = NOTEPARSE_STRING;
+	x->fields[2].string = x->cardStatus;
+	x->fields[2].stringMax = sizeof(x->cardStatus);
+	noteParseInit(&x->parser, x->fields, 3);
+}
+
+// Send a buffer to the Notecard's binary buffer, replacing what was there.  The data must remain
+// unchanged until the callback has been called.  Returns false if the request queue is full.
+bool noteBinaryPut(noteBinaryXfer *x, const uint8_t *data, size_t len, noteBinaryCallback callback, void *context) {
+	noteBinaryBegin(x, PHASE_CLEAR, callback, context);
+	x->data = (uint8_t *) data;
+	x->len = len;
+	x->size = len;
+	return noteRequestAsyncQuery("{\"req\":\"card.binary\",\"delete\":true}", &x->parser, noteBinaryInfoDone, x) != 0;
+}
+
+// Receive the contents of the Notecard's binary buffer into a buffer, whose length is in x->len
+// once the callback has been called.  Returns false if the request queue is full.
+bool noteBinaryGet(noteBinaryXfer *x, uint8_t *buffer, size_t bufferSize, noteBinaryCallback callback, void *context) {
+	noteBinaryBegin(x, PHASE_GET_INFO, callback, context);
+	x->data = buffer;
+	x->len = 0;
+	x->size = bufferSize;
+	return noteRequestAsyncQuery("{\"req\":\"card.binary\"}", &x->parser, noteBinaryInfoDone, x) != 0;
+}
+
+// Report how long the most recent transfer took
+void noteBinaryReport(noteBinaryXfer *x) {
+	uint32_t rate = x->elapsedMs == 0 ? 0 : (uint32_t) (((uint64_t) x->len * 1000) / x->elapsedMs);
+	char buf[96];
+	snprintf(buf, sizeof(buf), "notebinary: %lu bytes in %lu ms (%lu bytes/s)\n",
+			 (unsigned long) x->len, (unsigned long) x->elapsedMs, (unsigned long) rate);
+	NoteDebug(buf);
+}
+
+// End a transfer
+static void noteBinaryFinish(noteBinaryXfer *x, const char *errstr) {
+	x->phase = PHASE_DONE;
+	x->elapsedMs = (uint32_t) millis() - x->startMs;
+	if (x->callback != NULL)
+		x->callback(x, errstr, x->context);
+}
+
+// Write a card.binary.put request followed by the encoded chunk.  The newline that the request
+// queue appends to every request terminates the binary data.
+static void noteBinaryPutEmit(noteWriter *w, void *context) {
+	noteBinaryXfer *x = (noteBinaryXfer *) context;
+	const uint8_t *chunk = &x->data[x->offset];
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "card.binary.put");
+	noteWriterInt(w, "cobs", (long) noteCobsEncodedLen(chunk, x->chunkLen));
+	noteWriterString(w, "status", x->chunkStatus);
+	if (x->offset > 0)
+		noteWriterInt(w, "offset", (long) x->offset);
+	noteWriterObjectEnd(w);
+	noteWriterRaw(w, "\n", 1);
+	noteCobsWrite(w, chunk, x->chunkLen, NOTEBINARY_EOP);
+}
+
+// Write a card.binary.get request for a chunk
+static void noteBinaryGetEmit(noteWriter *w, void *context) {
+	noteBinaryXfer *x = (noteBinaryXfer *) context;
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "card.binary.get");
+	noteWriterInt(w, "offset", (long) x->offset);
+	noteWriterInt(w, "length", (long) x->chunkLen);
+	noteWriterObjectEnd(w);
+}
+
+// Receive the response to card.binary.get, which is either the encoded chunk or, if the Notecard
+// couldn't satisfy the request, a JSON error
+static bool noteBinaryGetSink(void *context, const uint8_t *data, size_t len) {
+	noteBinaryXfer *x = (noteBinaryXfer *) context;
+	if (x->received == 0 && len > 0 && data[0] == '{')
+		x->parsingJSON = true;
+	x->received += len;
+	if (x->parsingJSON)
+		return noteParseSink(&x->parser, data, len);
+	noteCobsDecodeFeed(&x->decoder, data, len, NOTEBINARY_EOP);
+	return true;
+}
+
+// Issue the request for the next step of a transfer
+static void noteBinaryNext(noteBinaryXfer *x) {
+	bool queued = false;
+	switch (x->phase) {
+
+	case PHASE_PUT:
+		if (x->offset == x->len) {
+			x->phase = PHASE_PUT_VERIFY;
+			md5FinalHex(&x->md5, x->chunkStatus);
+			queued = (noteRequestAsyncQuery("{\"req\":\"card.binary\"}", &x->parser, noteBinaryInfoDone, x) != 0);
+			break;
+		}
+		x->chunkLen = x->len - x->offset;
+		if (x->chunkLen > NOTEBINARY_CHUNK_LEN)
+			x->chunkLen = NOTEBINARY_CHUNK_LEN;
+		md5Hex(&x->data[x->offset], x->chunkLen, x->chunkStatus);
+		md5Update(&x->md5, &x->data[x->offset], x->chunkLen);
+		queued = (noteRequestAsyncEmit(noteBinaryPutEmit, x, noteBinaryPutDone, x) != 0);
+		break;
+
+	case PHASE_GET:
+		if (x->offset == x->len) {
+			md5FinalHex(&x->md5, x->chunkStatus);
+			noteBinaryFinish(x, strcmp(x->chunkStatus, x->cardStatus) == 0 ? NULL : "binary data is corrupt");
+			return;
+		}
+		x->chunkLen = x->len - x->offset;
+		if (x->chunkLen > NOTEBINARY_CHUNK_LEN)
+			x->chunkLen = NOTEBINARY_CHUNK_LEN;
+		x->received = 0;
+		x->parsingJSON = false;
+		noteParseReset(&x->parser);
+		noteCobsDecodeBegin(&x->decoder, &x->data[x->offset], x->chunkLen);
+		queued = (noteRequestAsyncStream(noteBinaryGetEmit, x, noteBinaryGetSink, x, noteBinaryGetDone, x) != 0);
+		break;
+
+	}
+	if (!queued)
+		noteBinaryFinish(x, "request queue is full");
+}
+
+// Completion of a card.binary request, which reports the length and MD5 of the binary buffer
+static void noteBinaryInfoDone(noteReqHandle handle, noteParser *parser, void *context) {
+	noteBinaryXfer *x = (noteBinaryXfer *) context;
+	if (parser->err[0] != '\0') {
+		noteBinaryFinish(x, parser->err);
+		return;
+	}
+	size_t length = (size_t) noteParseGet(parser, "length")->number;
+	size_t max = (size_t) noteParseGet(parser, "max")->number;
+	switch (x->phase) {
+
+	case PHASE_CLEAR:
+		if (max != 0 && x->len > max) {
+			noteBinaryFinish(x, "data is too large for the binary buffer");
+			return;
+		}
+		x->phase = PHASE_PUT;
+		break;
+
+	case PHASE_PUT_VERIFY:
+		if (length != x->len || strcmp(x->cardStatus, x->chunkStatus) != 0)
+			noteBinaryFinish(x, "binary data is corrupt");
+		else
+			noteBinaryFinish(x, NULL);
+		return;
+
+	case PHASE_GET_INFO:
+		if (length > x->size) {
+			noteBinaryFinish(x, "buffer is too small for the binary data");
+			return;
+		}
+		x->len = length;
+		x->phase = PHASE_GET;
+		break;
+
+	}
+	noteBinaryNext(x);
+}
+
+// Completion of a card.binary.put request
+static void noteBinaryPutDone(noteReqHandle handle, J *rsp, void *context) {
+	noteBinaryXfer *x = (noteBinaryXfer *) context;
+	bool success = (rsp != NULL && !NoteResponseError(rsp));
+	if (!success) {
+		static char err[NOTEPARSE_ERR_MAX];
+		strlcpy(err, rsp == NULL ? "insufficient memory" : JGetString(rsp, "err"), sizeof(err));
+		if (rsp != NULL)
+			NoteDeleteResponse(rsp);
+		noteBinaryFinish(x, err);
+		return;
+	}
+	NoteDeleteResponse(rsp);
+	x->offset += x->chunkLen;
+	noteBinaryNext(x);
+}
+
+// Completion of a card.binary.get request, whose response has been decoded into the buffer
+static void noteBinaryGetDone(noteReqHandle handle, const char *errstr, void *context) {
+	noteBinaryXfer *x = (noteBinaryXfer *) context;
+	if (errstr == NULL && x->parsingJSON)
+		errstr = x->parser.err[0] != '\0' ? x->parser.err : "unrecognized response from card";
+	if (errstr == NULL && (!x->decoder.done || x->decoder.invalid || x->decoder.outLen != x->chunkLen))
+		errstr = "binary data is corrupt";
+	if (errstr != NULL) {
+		noteBinaryFinish(x, errstr);
+		return;
+	}
+	md5Update(&x->md5, &x->data[x->offset], x->chunkLen);
+	x->offset += x->chunkLen;
+	noteBinaryNext(x);
+}
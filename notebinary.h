@@ -0,0 +1,72 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEBINARY_H
+#define NOTEBINARY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+#include "md5.h"
+#include "notereq.h"
+#include "noteparse.h"
+#include "notewriter.h"
+
+// Binary data is COBS-encoded and then XORed with the end-of-packet byte, which is the newline that
+// terminates every response, so that the encoded data never contains it
+#define NOTEBINARY_EOP			'\n'
+
+// Bytes of binary data moved by each card.binary.put or card.binary.get request.  Data is encoded
+// and decoded directly between the caller's buffer and the transport, so this costs no RAM.
+#define NOTEBINARY_CHUNK_LEN	2048
+
+// An incremental COBS decoder, which decodes data into a buffer as it arrives
+typedef struct {
+	uint8_t *out;
+	size_t outMax;
+	size_t outLen;
+	uint8_t remaining;
+	bool zeroPending;
+	bool done;
+	bool invalid;
+} noteCobsDecoder;
+
+// A transfer between a buffer in RAM and the Notecard's binary buffer
+typedef struct noteBinaryXfer noteBinaryXfer;
+
+// Called in thread context when a transfer is complete.  errstr is NULL if it succeeded.
+typedef void (*noteBinaryCallback)(noteBinaryXfer *x, const char *errstr, void *context);
+
+struct noteBinaryXfer {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	size_t offset;
+	size_t chunkLen;
+	uint8_t phase;
+	noteBinaryCallback callback;
+	void *context;
+	md5Context md5;
+	char chunkStatus[MD5_HEX_LEN];
+	char cardStatus[MD5_HEX_LEN];
+	noteParseField fields[3];
+	noteParser parser;
+	size_t received;
+	bool parsingJSON;
+	noteCobsDecoder decoder;
+	uint32_t startMs;
+	uint32_t elapsedMs;
+};
+
+size_t noteCobsEncodedLen(const uint8_t *data, size_t len);
+void noteCobsWrite(noteWriter *w, const uint8_t *data, size_t len, uint8_t eop);
+void noteCobsDecodeBegin(noteCobsDecoder *d, uint8_t *out, size_t outMax);
+bool noteCobsDecodeFeed(noteCobsDecoder *d, const uint8_t *data, size_t len, uint8_t eop);
+
+bool noteBinaryPut(noteBinaryXfer *x, const uint8_t *data, size_t len, noteBinaryCallback callback, void *context);
+bool noteBinaryGet(noteBinaryXfer *x, uint8_t *buffer, size_t bufferSize, noteBinaryCallback callback, void *context);
+void noteBinaryReport(noteBinaryXfer *x);
+
+#endif // NOTEBINARY_H
@@ -0,0 +1,212 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Opt-in response cache for slow-changing Notecard queries such as card.voltage.  Responses are
+// cached for a TTL chosen per request, keyed by the complete request text so that both the request
+// type and its arguments must match.  A hash of the text is compared first, so that most entries are
+// passed over without comparing the text itself.  A cache hit is replayed from RAM through the
+// same path as a response arriving from the Notecard, without touching the bus.  Responses that
+// contain an error are never cached.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "notecache.h"
+#include "notewriter.h"
+
+// FNV-1a hash parameters
+#define FNV_OFFSET_BASIS	2166136261UL
+#define FNV_PRIME			16777619UL
+
+// A cached response
+typedef struct {
+	bool valid;
+	noteCacheKey key;
+	uint32_t storedMs;
+	uint32_t ttlMs;
+	char reqType[NOTECACHE_REQ_MAX];
+	uint16_t len;
+	uint8_t rsp[NOTECACHE_RESPONSE_MAX];
+} noteCacheEntry;
+
+// The cache, and the response that is currently being captured into it
+static noteCacheEntry entries[NOTECACHE_ENTRIES];
+static noteCacheEntry pending;
+static bool pendingActive = false;
+static noteCacheStats stats;
+
+// Fold data into an FNV-1a hash
+static uint32_t noteCacheHash(uint32_t hash, const uint8_t *data, size_t len) {
+	while (len--) {
+		hash ^= *data++;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+// Add text to a key, which no longer fits if the text won't
+static void noteCacheKeyAdd(noteCacheKey *key, const uint8_t *data, size_t len) {
+	key->hash = noteCacheHash(key->hash, data, len);
+	if (!key->fits || key->len + len > sizeof(key->text)) {
+		key->fits = false;
+		return;
+	}
+	memcpy(&key->text[key->len], data, len);
+	key->len += len;
+}
+
+// Make the key for the text of a request
+void noteCacheKeyJSON(noteCacheKey *key, const char *json) {
+	key->hash = FNV_OFFSET_BASIS;
+	key->len = 0;
+	key->fits = true;
+	noteCacheKeyAdd(key, (const uint8_t *) json, strlen(json));
+}
+
+// Extract the request type from the text of a request
+void noteCacheReqTypeJSON(const char *json, char *reqType, size_t reqTypeMax) {
+	reqType[0] = '\0';
+	const char *p = strstr(json, "\"req\":\"");
+	if (p == NULL)
+		return;
+	p += strlen("\"req\":\"");
+	size_t len = 0;
+	while (p[len] != '\0' && p[len] != '"' && len+1 < reqTypeMax) {
+		reqType[len] = p[len];
+		len++;
+	}
+	reqType[len] = '\0';
+}
+
+// Streaming writer output that adds to a key rather than transmitting
+static const char *noteCacheKeyOutput(void *context, const uint8_t *data, size_t len) {
+	noteCacheKeyAdd((noteCacheKey *) context, data, len);
+	return NULL;
+}
+
+// Make the key for a request as it would be transmitted, without serializing it into the heap
+void noteCacheKeyJ(noteCacheKey *key, J *req) {
+	key->hash = FNV_OFFSET_BASIS;
+	key->len = 0;
+	key->fits = true;
+	noteWriter w;
+	noteWriterBegin(&w, noteCacheKeyOutput, key);
+	noteWriterJ(&w, NULL, req);
+	noteWriterEnd(&w);
+}
+
+// True if an entry was stored under a key
+static bool noteCacheMatch(noteCacheEntry *e, const noteCacheKey *key) {
+	return e->key.hash == key->hash && e->key.len == key->len && memcmp(e->key.text, key->text, key->len) == 0;
+}
+
+// True if an entry has expired
+static bool noteCacheExpired(noteCacheEntry *e) {
+	return (uint32_t) millis() - e->storedMs >= e->ttlMs;
+}
+
+// Look up a cached response, counting the hit or miss
+bool noteCacheLookup(const noteCacheKey *key, const uint8_t **rsp, size_t *len) {
+	if (!key->fits) {
+		stats.uncacheable++;
+		return false;
+	}
+	for (int i=0; i<NOTECACHE_ENTRIES; i++) {
+		noteCacheEntry *e = &entries[i];
+		if (!e->valid || !noteCacheMatch(e, key))
+			continue;
+		if (noteCacheExpired(e)) {
+			e->valid = false;
+			break;
+		}
+		stats.hits++;
+		*rsp = e->rsp;
+		*len = e->len;
+		return true;
+	}
+	stats.misses++;
+	return false;
+}
+
+// Begin capturing the response to a request that missed the cache, unless it can't be cached
+void noteCacheBegin(const noteCacheKey *key, const char *reqType, uint32_t ttlMs) {
+	pendingActive = false;
+	if (!key->fits)
+		return;
+	memset(&pending, 0, sizeof(pending));
+	pending.key = *key;
+	pending.ttlMs = ttlMs;
+	strlcpy(pending.reqType, reqType == NULL ? "" : reqType, sizeof(pending.reqType));
+	pendingActive = true;
+}
+
+// Capture response data as it arrives, giving up if it won't fit
+void noteCacheAppend(const uint8_t *data, size_t len) {
+	if (!pendingActive)
+		return;
+	if (pending.len + len > sizeof(pending.rsp)) {
+		pendingActive = false;
+		return;
+	}
+	memcpy(&pending.rsp[pending.len], data, len);
+	pending.len += len;
+}
+
+// Finish capturing, storing the response in place of the oldest or an expired entry
+void noteCacheCommit(bool success) {
+	if (!pendingActive)
+		return;
+	pendingActive = false;
+	if (!success || pending.len == 0)
+		return;
+	char rspText[NOTECACHE_RESPONSE_MAX+1];
+	memcpy(rspText, pending.rsp, pending.len);
+	rspText[pending.len] = '\0';
+	if (strstr(rspText, "\"err\"") != NULL)
+		return;
+	noteCacheEntry *victim = &entries[0];
+	for (int i=0; i<NOTECACHE_ENTRIES; i++) {
+		noteCacheEntry *e = &entries[i];
+		if (!e->valid || noteCacheMatch(e, &pending.key) || noteCacheExpired(e)) {
+			victim = e;
+			break;
+		}
+		if (e->storedMs - victim->storedMs > 0x80000000UL)
+			victim = e;
+	}
+	*victim = pending;
+	victim->storedMs = (uint32_t) millis();
+	victim->valid = true;
+	stats.stores++;
+}
+
+// Invalidate all cached responses to requests of the specified type, or all of them if NULL
+void noteCacheInvalidate(const char *reqType) {
+	for (int i=0; i<NOTECACHE_ENTRIES; i++) {
+		noteCacheEntry *e = &entries[i];
+		if (e->valid && (reqType == NULL || strcmp(e->reqType, reqType) == 0)) {
+			e->valid = false;
+			stats.invalidations++;
+		}
+	}
+}
+
+// Get cache statistics, optionally resetting them
+void noteCacheGetStats(noteCacheStats *out, bool reset) {
+	if (out != NULL)
+		*out = stats;
+	if (reset)
+		memset(&stats, 0, sizeof(stats));
+}
+
+// Report the cache hit rate, for use in tuning TTLs
+void noteCacheReport() {
+	char buf[160];
+	uint32_t lookups = stats.hits + stats.misses;
+	snprintf(buf, sizeof(buf), "notecache: %lu hits, %lu misses (%lu%% hit rate), %lu too long to cache, %lu stored, %lu invalidated\n",
+			 (unsigned long) stats.hits, (unsigned long) stats.misses,
+			 (unsigned long) (lookups == 0 ? 0 : (stats.hits * 100) / lookups),
+			 (unsigned long) stats.uncacheable, (unsigned long) stats.stores, (unsigned long) stats.invalidations);
+	NoteDebug(buf);
+}
@@ -0,0 +1,50 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTECACHE_H
+#define NOTECACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+
+// Number of responses that can be cached, and the longest response that will be cached
+#define NOTECACHE_ENTRIES		4
+#define NOTECACHE_RESPONSE_MAX	96
+#define NOTECACHE_REQ_MAX		24
+
+// Longest request whose response will be cached, because the whole text of the request is the key
+#define NOTECACHE_KEY_MAX		80
+
+// The key under which a response is cached, which is the text of the request and a hash of it.  fits
+// is false if the request was too long to be keyed, and so can't be cached.
+typedef struct {
+	uint32_t hash;
+	uint16_t len;
+	bool fits;
+	char text[NOTECACHE_KEY_MAX];
+} noteCacheKey;
+
+// Cache statistics
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t uncacheable;
+	uint32_t stores;
+	uint32_t invalidations;
+} noteCacheStats;
+
+void noteCacheKeyJSON(noteCacheKey *key, const char *json);
+void noteCacheKeyJ(noteCacheKey *key, J *req);
+void noteCacheReqTypeJSON(const char *json, char *reqType, size_t reqTypeMax);
+bool noteCacheLookup(const noteCacheKey *key, const uint8_t **rsp, size_t *len);
+void noteCacheBegin(const noteCacheKey *key, const char *reqType, uint32_t ttlMs);
+void noteCacheAppend(const uint8_t *data, size_t len);
+void noteCacheCommit(bool success);
+void noteCacheInvalidate(const char *reqType);
+void noteCacheGetStats(noteCacheStats *stats, bool reset);
+void noteCacheReport(void);
+
+#endif // NOTECACHE_H
@@ -0,0 +1,262 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Streaming LZSS compression, in the style of heatshrink, for payloads on their way to base64.
+// Every byte saved here is four thirds of a byte saved on the link to the Notecard and over the air.
+// Data is compressed as it is written, against a window of the most recent bytes, and the output
+// is a bit stream of literals and back-references.  RAM is bounded by the window and a small
+// output buffer, and no heap is used.
+//
+// The match search is a simple scan of the window, which is slower than a hashed search but needs
+// no index, and which is fast enough for the few hundred bytes of a typical payload.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "note.h"
+#include "notecomp.h"
+
+// Hand buffered output to the output function
+static void noteCompFlush(noteCompressor *c) {
+	if (c->outLen == 0)
+		return;
+	if (c->errstr == NULL)
+		c->errstr = c->output(c->context, c->out, c->outLen);
+	c->outBytes += c->outLen;
+	c->outLen = 0;
+}
+
+// Append bits to the output, most significant first
+static void noteCompBits(noteCompressor *c, uint32_t value, int count) {
+	while (count-- > 0) {
+		c->bits = (uint8_t) ((c->bits << 1) | ((value >> count) & 1));
+		if (++c->bitCount == 8) {
+			c->out[c->outLen++] = c->bits;
+			c->bits = 0;
+			c->bitCount = 0;
+			if (c->outLen == sizeof(c->out))
+				noteCompFlush(c);
+		}
+	}
+}
+
+// Byte at a position relative to the start of the lookahead, where negative positions are in the
+// window.  A match may run on into the lookahead, just as the decompressor's copy does.
+static uint8_t noteCompByteAt(noteCompressor *c, int pos) {
+	if (pos >= 0)
+		return c->look[pos];
+	return c->window[(c->windowHead + NOTECOMP_WINDOW_LEN + pos) % NOTECOMP_WINDOW_LEN];
+}
+
+// Move bytes from the lookahead into the window
+static void noteCompConsume(noteCompressor *c, int n) {
+	for (int i=0; i<n; i++) {
+		c->window[c->windowHead] = c->look[i];
+		c->windowHead = (c->windowHead + 1) % NOTECOMP_WINDOW_LEN;
+		if (c->windowFill < NOTECOMP_WINDOW_LEN)
+			c->windowFill++;
+	}
+	c->lookLen -= n;
+	memmove(c->look, &c->look[n], c->lookLen);
+}
+
+// Encode the start of the lookahead as the longest match in the window, or else as a literal
+static void noteCompStep(noteCompressor *c) {
+	int bestLen = 0, bestDist = 0;
+	for (int dist=1; dist<=c->windowFill && bestLen<c->lookLen; dist++) {
+		int len = 0;
+		while (len < c->lookLen && noteCompByteAt(c, len - dist) == c->look[len])
+			len++;
+		if (len > bestLen) {
+			bestLen = len;
+			bestDist = dist;
+		}
+	}
+	if (bestLen >= NOTECOMP_MIN_MATCH) {
+		noteCompBits(c, 0, 1);
+		noteCompBits(c, bestDist - 1, NOTECOMP_WINDOW_BITS);
+		noteCompBits(c, bestLen - NOTECOMP_MIN_MATCH, NOTECOMP_LENGTH_BITS);
+		noteCompConsume(c, bestLen);
+	} else {
+		noteCompBits(c, 1, 1);
+		noteCompBits(c, c->look[0], 8);
+		noteCompConsume(c, 1);
+	}
+}
+
+// Begin compressing
+void noteCompBegin(noteCompressor *c, noteCompOutput output, void *context) {
+	memset(c, 0, sizeof(noteCompressor));
+	c->output = output;
+	c->context = context;
+}
+
+// Compress data
+void noteCompWrite(noteCompressor *c, const uint8_t *data, size_t len) {
+	c->inBytes += len;
+	while (len-- > 0) {
+		c->look[c->lookLen++] = *data++;
+		if (c->lookLen == NOTECOMP_MAX_MATCH)
+			noteCompStep(c);
+	}
+}
+
+// Finish compressing, padding the last byte with zero bits, which are too few to be taken for a
+// back-reference.  An error message is returned, else NULL if success.
+const char *noteCompEnd(noteCompressor *c) {
+	while (c->lookLen > 0)
+		noteCompStep(c);
+	if (c->bitCount > 0)
+		noteCompBits(c, 0, 8 - c->bitCount);
+	noteCompFlush(c);
+	return c->errstr;
+}
+
+// Hand buffered output to the output function
+static void noteDecompFlush(noteDecompressor *d) {
+	if (d->outLen == 0)
+		return;
+	if (d->errstr == NULL)
+		d->errstr = d->output(d->context, d->out, d->outLen);
+	d->outBytes += d->outLen;
+	d->outLen = 0;
+}
+
+// Output a decompressed byte, retaining it in the window
+static void noteDecompPut(noteDecompressor *d, uint8_t ch) {
+	d->window[d->windowHead] = ch;
+	d->windowHead = (d->windowHead + 1) % NOTECOMP_WINDOW_LEN;
+	d->out[d->outLen++] = ch;
+	if (d->outLen == sizeof(d->out))
+		noteDecompFlush(d);
+}
+
+// Begin decompressing
+void noteDecompBegin(noteDecompressor *d, noteCompOutput output, void *context) {
+	memset(d, 0, sizeof(noteDecompressor));
+	d->output = output;
+	d->context = context;
+}
+
+// Decompress data, decoding each literal or back-reference as soon as all of its bits have arrived
+void noteDecompWrite(noteDecompressor *d, const uint8_t *data, size_t len) {
+	const int refBits = 1 + NOTECOMP_WINDOW_BITS + NOTECOMP_LENGTH_BITS;
+	while (len-- > 0) {
+		d->bits = (d->bits << 8) | *data++;
+		d->bitCount += 8;
+		for (;;) {
+			bool literal = ((d->bits >> (d->bitCount - 1)) & 1) != 0;
+			if (literal && d->bitCount >= 9) {
+				d->bitCount -= 9;
+				noteDecompPut(d, (uint8_t) (d->bits >> d->bitCount));
+			} else if (!literal && d->bitCount >= refBits) {
+				d->bitCount -= refBits;
+				uint32_t ref = d->bits >> d->bitCount;
+				int dist = ((ref >> NOTECOMP_LENGTH_BITS) & (NOTECOMP_WINDOW_LEN - 1)) + 1;
+				int count = (ref & ((1 << NOTECOMP_LENGTH_BITS) - 1)) + NOTECOMP_MIN_MATCH;
+				while (count-- > 0)
+					noteDecompPut(d, d->window[(d->windowHead + NOTECOMP_WINDOW_LEN - dist) % NOTECOMP_WINDOW_LEN]);
+			} else {
+				break;
+			}
+			d->bits &= (1UL << d->bitCount) - 1;
+			if (d->bitCount == 0)
+				break;
+		}
+	}
+}
+
+// Finish decompressing, discarding the padding.  An error message is returned, else NULL if success.
+const char *noteDecompEnd(noteDecompressor *d) {
+	noteDecompFlush(d);
+	return d->errstr;
+}
+
+// Benchmark output, which checks the decompressed data against the original
+typedef struct {
+	const uint8_t *expected;
+	size_t len;
+	bool mismatch;
+} noteCompCheck;
+static const char *noteCompVerify(void *context, const uint8_t *data, size_t len) {
+	noteCompCheck *check = (noteCompCheck *) context;
+	if (len > check->len || memcmp(check->expected, data, len) != 0)
+		check->mismatch = true;
+	else {
+		check->expected += len;
+		check->len -= len;
+	}
+	return NULL;
+}
+
+// Benchmark output that retains the compressed data
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+	size_t max;
+} noteCompStore;
+static const char *noteCompKeep(void *context, const uint8_t *data, size_t len) {
+	noteCompStore *store = (noteCompStore *) context;
+	if (store->len + len > store->max)
+		return "benchmark buffer overflow";
+	memcpy(&store->buf[store->len], data, len);
+	store->len += len;
+	return NULL;
+}
+
+// Measure the compression ratio and cycles per byte of a sample, and check that it survives the
+// round trip
+static void noteCompMeasure(const char *name, const uint8_t *data, size_t len, int iterations) {
+	static noteCompressor c;
+	static noteDecompressor d;
+	static uint8_t packed[640];
+	noteCompStore store = { packed, 0, sizeof(packed) };
+	noteCompCheck check;
+	uint32_t began = cycles();
+	for (int i=0; i<iterations; i++) {
+		store.len = 0;
+		noteCompBegin(&c, noteCompKeep, &store);
+		noteCompWrite(&c, data, len);
+		noteCompEnd(&c);
+	}
+	uint32_t compCycles = (cycles() - began) / iterations;
+	began = cycles();
+	for (int i=0; i<iterations; i++) {
+		check.expected = data;
+		check.len = len;
+		check.mismatch = false;
+		noteDecompBegin(&d, noteCompVerify, &check);
+		noteDecompWrite(&d, packed, store.len);
+		noteDecompEnd(&d);
+	}
+	uint32_t decompCycles = (cycles() - began) / iterations;
+	bool ok = (c.errstr == NULL && !check.mismatch && check.len == 0);
+	char report[160];
+	snprintf(report, sizeof(report), "notecomp: %s %lu -> %lu bytes (%lu%%), %lu cycles/byte compress, %lu decompress%s\n",
+			 name, (unsigned long) len, (unsigned long) store.len, (unsigned long) (store.len * 100 / len),
+			 (unsigned long) (compCycles / len), (unsigned long) (decompCycles / len), ok ? "" : ", ROUND TRIP FAILED");
+	NoteDebug(report);
+}
+
+// Measure compression of a waveform of 16-bit samples and of log text
+void noteCompBenchmark(int iterations) {
+	static uint8_t sample[512];
+	if (iterations <= 0)
+		return;
+
+	// A triangle wave whose offset wanders from one cycle to the next, as little-endian 16-bit samples
+	for (int i=0; i<256; i++) {
+		int phase = i % 40;
+		int16_t value = (int16_t) ((phase < 20 ? phase : 40 - phase) * 100 + (i / 40) % 3);
+		sample[i*2] = (uint8_t) value;
+		sample[i*2+1] = (uint8_t) (value >> 8);
+	}
+	noteCompMeasure("waveform", sample, sizeof(sample), iterations);
+
+	// Log lines
+	size_t len = 0;
+	for (int i=0; len+48 < sizeof(sample); i++)
+		len += snprintf((char *) &sample[len], sizeof(sample)-len, "temp=%d.%02d voltage=4.12 count=%d\n", 23 + i / 4, (i % 4) * 25, i);
+	noteCompMeasure("log", sample, len, iterations);
+}
@@ -0,0 +1,63 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTECOMP_H
+#define NOTECOMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Shape of the encoding.  A back-reference is a 0 bit followed by the distance back into the window
+// and the length of the match, and a literal is a 1 bit followed by the byte.
+#define NOTECOMP_WINDOW_BITS	8
+#define NOTECOMP_LENGTH_BITS	4
+#define NOTECOMP_WINDOW_LEN		(1 << NOTECOMP_WINDOW_BITS)
+#define NOTECOMP_MIN_MATCH		2
+#define NOTECOMP_MAX_MATCH		(NOTECOMP_MIN_MATCH + (1 << NOTECOMP_LENGTH_BITS) - 1)
+
+// Destination for compressed or decompressed data.  An error message is returned, else NULL if success.
+typedef const char *(*noteCompOutput)(void *context, const uint8_t *data, size_t len);
+
+// A streaming LZSS compressor, whose RAM is bounded by the size of its window
+typedef struct {
+	noteCompOutput output;
+	void *context;
+	uint8_t window[NOTECOMP_WINDOW_LEN];
+	uint16_t windowHead;
+	uint16_t windowFill;
+	uint8_t look[NOTECOMP_MAX_MATCH];
+	uint8_t lookLen;
+	uint8_t bits;
+	uint8_t bitCount;
+	uint8_t out[32];
+	uint8_t outLen;
+	uint32_t inBytes;
+	uint32_t outBytes;
+	const char *errstr;
+} noteCompressor;
+
+// The matching decompressor
+typedef struct {
+	noteCompOutput output;
+	void *context;
+	uint8_t window[NOTECOMP_WINDOW_LEN];
+	uint16_t windowHead;
+	uint32_t bits;
+	uint8_t bitCount;
+	uint8_t out[32];
+	uint8_t outLen;
+	uint32_t outBytes;
+	const char *errstr;
+} noteDecompressor;
+
+void noteCompBegin(noteCompressor *c, noteCompOutput output, void *context);
+void noteCompWrite(noteCompressor *c, const uint8_t *data, size_t len);
+const char *noteCompEnd(noteCompressor *c);
+void noteDecompBegin(noteDecompressor *d, noteCompOutput output, void *context);
+void noteDecompWrite(noteDecompressor *d, const uint8_t *data, size_t len);
+const char *noteDecompEnd(noteDecompressor *d);
+void noteCompBenchmark(int iterations);
+
+#endif // NOTECOMP_H
@@ -0,0 +1,224 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Energy per Notecard transaction.  Each request is timestamped as it moves from one phase to the
+// next, with both the cycle counter, which only advances while the CPU is running, and the RTC, which
+// always does, so that the time within each phase is split into time running and time asleep.
+// Applying a model of the current drawn by the CPU and transport peripherals in each state gives an
+// estimate of the energy of each phase of each request, and of the CPU sleeping between them.
+//
+// Nothing here depends on the SDK other than the RTC counter and the cycle counter, so it is also
+// built on the host by the tests in test/, with both counters supplied by the test.
+//
+// The same model also drives a simulation of a transaction, computed from its size and the timing of
+// the transport rather than measured, so that the cost of a request over I2C and over serial can be
+// compared without hardware, and a measurement checked against the expectation.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "note.h"
+#include "notewire.h"
+#include "notereq.h"
+#include "noteenergy.h"
+#include "app_timer.h"
+
+// Transport timing used by the simulation.  TWI sends 9 bits per byte at 100kHz, and the UART 10 bits
+// per byte at 9600 baud, with the CPU woken briefly by the UART for each byte.
+#define TWI_US_PER_BYTE			90
+#define UART_US_PER_BYTE		1042
+#define UART_CYCLES_PER_BYTE	200
+#define CPU_HZ					64000000
+
+static noteEnergyModel model;
+static bool modelSet = false;
+static noteEnergyStats stats;
+
+// Names of the phases, for reports
+static const char *phaseNames[NOTEENERGY_PHASES] = { "build", "tx", "wait", "rx", "parse" };
+
+// The model of the current drawn by this board in each state
+void noteEnergyDefaultModel(noteEnergyModel *m) {
+	m->cpuHz = CPU_HZ;
+	m->supplyMv = POWER_SUPPLY_MV;
+#ifdef BOARD_HAS_DCDC_INDUCTOR
+	m->runUa = POWER_UA_RUN_DCDC;
+#else
+	m->runUa = POWER_UA_RUN_LDO;
+#endif
+	m->sleepUa = POWER_UA_SLEEP;
+	m->twiUa = NOTEENERGY_UA_TWI;
+	m->uartUa = NOTEENERGY_UA_UART;
+	m->hfxoUa = POWER_UA_HFXO;
+	m->i2c = NOTECARD_USE_I2C;
+}
+
+// Replace the model with one that has been measured, or that describes another board
+void noteEnergySetModel(const noteEnergyModel *m) {
+	model = *m;
+	modelSet = true;
+}
+
+// The model in use
+static const noteEnergyModel *noteEnergyModelGet() {
+	if (!modelSet) {
+		noteEnergyDefaultModel(&model);
+		modelSet = true;
+	}
+	return &model;
+}
+
+// Current drawn by the transport during a phase, in addition to the CPU
+static uint32_t noteEnergyPeripheralUa(const noteEnergyModel *m, int phase) {
+	if (m->i2c)
+		return (phase == NOTEENERGY_TX || phase == NOTEENERGY_RX) ? m->twiUa : 0;
+	return (phase == NOTEENERGY_TX || phase == NOTEENERGY_WAIT || phase == NOTEENERGY_RX) ? m->uartUa + m->hfxoUa : 0;
+}
+
+// Add the time of a phase to the totals, and its energy in nanojoules, given how long it took and how
+// much of that the CPU was running.  The rest of the time the CPU was asleep, which is accounted for
+// on its own.
+static void noteEnergyAccount(const noteEnergyModel *m, noteEnergyStats *s, int phase, uint64_t wallUs, uint64_t activeUs) {
+	if (activeUs > wallUs)
+		wallUs = activeUs;
+	uint64_t picocoulombs = activeUs * m->runUa + wallUs * noteEnergyPeripheralUa(m, phase);
+	s->wallUs[phase] += wallUs;
+	s->activeUs[phase] += activeUs;
+	s->nj[phase] += (picocoulombs * m->supplyMv) / 1000000;
+	s->sleepUs += wallUs - activeUs;
+	s->sleepNj += ((wallUs - activeUs) * m->sleepUa * m->supplyMv) / 1000000;
+}
+
+// Begin timestamping a transaction
+void noteEnergyBegin(noteEnergyTxn *t, noteEnergyPhase phase) {
+	memset(t, 0, sizeof(noteEnergyTxn));
+	t->phase = (uint8_t) phase;
+	t->markCycles = cycles();
+	t->markTicks = app_timer_cnt_get();
+}
+
+// Move a transaction into another phase, charging the time since the last mark to the phase it was in
+void noteEnergyMark(noteEnergyTxn *t, noteEnergyPhase phase) {
+	uint32_t nowCycles = cycles();
+	uint32_t nowTicks = app_timer_cnt_get();
+	if (t->phase < NOTEENERGY_PHASES) {
+		t->cycles[t->phase] += nowCycles - t->markCycles;
+		t->ticks[t->phase] += app_timer_cnt_diff_compute(nowTicks, t->markTicks);
+	}
+	t->phase = (uint8_t) phase;
+	t->markCycles = nowCycles;
+	t->markTicks = nowTicks;
+}
+
+// Finish a transaction, adding its time and energy to the totals
+void noteEnergyEnd(noteEnergyTxn *t) {
+	const noteEnergyModel *m = noteEnergyModelGet();
+	noteEnergyMark(t, NOTEENERGY_IDLE);
+	uint32_t ticksPerSecond = APP_TIMER_CLOCK_FREQ / (APP_TIMER_CONFIG_RTC_FREQUENCY + 1);
+	for (int p=0; p<NOTEENERGY_PHASES; p++) {
+		uint64_t wallUs = ((uint64_t) t->ticks[p] * 1000000) / ticksPerSecond;
+		uint64_t activeUs = ((uint64_t) t->cycles[p] * 1000000) / m->cpuHz;
+		noteEnergyAccount(m, &stats, p, wallUs, activeUs);
+	}
+	stats.requests++;
+}
+
+// Get the totals, optionally resetting them
+void noteEnergyGetStats(noteEnergyStats *out, bool reset) {
+	if (out != NULL)
+		*out = stats;
+	if (reset)
+		memset(&stats, 0, sizeof(stats));
+}
+
+// Total energy of all phases and of sleep, in nanojoules
+uint64_t noteEnergyTotal(const noteEnergyStats *s) {
+	uint64_t nj = s->sleepNj;
+	for (int p=0; p<NOTEENERGY_PHASES; p++)
+		nj += s->nj[p];
+	return nj;
+}
+
+// Format the energy of each phase and of sleep per request, and the time that the CPU was asleep
+static void noteEnergyFormat(char *buf, size_t size, const char *prefix, const noteEnergyStats *s) {
+	uint32_t n = s->requests == 0 ? 1 : s->requests;
+	uint64_t wall = 0;
+	int len = snprintf(buf, size, "%s%lu.%03luuJ/req (", prefix,
+					   (unsigned long) (noteEnergyTotal(s) / n / 1000), (unsigned long) ((noteEnergyTotal(s) / n) % 1000));
+	for (int p=0; p<NOTEENERGY_PHASES && len > 0 && (size_t) len < size; p++) {
+		wall += s->wallUs[p];
+		len += snprintf(&buf[len], size-len, "%s %lu.%03lu, ", phaseNames[p],
+						(unsigned long) (s->nj[p] / n / 1000), (unsigned long) ((s->nj[p] / n) % 1000));
+	}
+	uint32_t asleep = wall == 0 ? 0 : (uint32_t) ((s->sleepUs * 100) / wall);
+	if (len > 0 && (size_t) len < size)
+		snprintf(&buf[len], size-len, "sleep %lu.%03lu), %lums, asleep %lu%% (%lums)\n",
+				 (unsigned long) (s->sleepNj / n / 1000), (unsigned long) ((s->sleepNj / n) % 1000),
+				 (unsigned long) (wall / n / 1000), (unsigned long) asleep, (unsigned long) (s->sleepUs / n / 1000));
+}
+
+// Report the measured energy per request, by phase
+void noteEnergyReport() {
+	char buf[224], prefix[48];
+	snprintf(prefix, sizeof(prefix), "noteenergy: %lu requests, ", (unsigned long) stats.requests);
+	noteEnergyFormat(buf, sizeof(buf), prefix, &stats);
+	NoteDebug(buf);
+}
+
+// Simulate a transaction whose request and response are of the given lengths, which the Notecard
+// takes waitMs to process, and whose serialization and parsing take cpuCycles altogether.  The
+// transport is the one in the model.  Returns the energy in nanojoules, and optionally the breakdown.
+uint64_t noteEnergySimulate(const noteEnergyModel *m, uint32_t reqBytes, uint32_t rspBytes, uint32_t waitMs, uint32_t cpuCycles, noteEnergyStats *out) {
+	uint64_t wallUs[NOTEENERGY_PHASES], activeUs[NOTEENERGY_PHASES];
+	memset(wallUs, 0, sizeof(wallUs));
+	memset(activeUs, 0, sizeof(activeUs));
+	uint64_t cpuUs = ((uint64_t) cpuCycles * 1000000) / m->cpuHz;
+	wallUs[NOTEENERGY_BUILD] = activeUs[NOTEENERGY_BUILD] = cpuUs / 2;
+	wallUs[NOTEENERGY_PARSE] = activeUs[NOTEENERGY_PARSE] = cpuUs - cpuUs / 2;
+	wallUs[NOTEENERGY_WAIT] = (uint64_t) waitMs * 1000;
+
+	// Requests are paced in segments, between which the host sleeps
+	uint32_t pauses = reqBytes == 0 ? 0 : (reqBytes - 1) / NOTEWIRE_SEGMENT_MAX_LEN;
+	wallUs[NOTEENERGY_TX] = (uint64_t) pauses * NOTEWIRE_SEGMENT_DELAY_MS * 1000;
+
+	// Over I2C, each chunk has its address and length, each read of a chunk is preceded by a write
+	// asking for it, and the Notecard is polled while it's busy, with the CPU waiting on each transfer
+	uint32_t polls = waitMs / NOTEREQ_POLL_MS + 1;
+	if (m->i2c) {
+		uint32_t txChunks = (reqBytes + NOTE_I2C_MAX_DEFAULT - 1) / NOTE_I2C_MAX_DEFAULT;
+		uint32_t rxChunks = (rspBytes + NOTE_I2C_MAX_DEFAULT - 1) / NOTE_I2C_MAX_DEFAULT;
+		uint64_t txUs = (uint64_t) (reqBytes + txChunks*2) * TWI_US_PER_BYTE;
+		uint64_t rxUs = (uint64_t) (rspBytes + (rxChunks + polls)*6) * TWI_US_PER_BYTE;
+		wallUs[NOTEENERGY_TX] += txUs;
+		activeUs[NOTEENERGY_TX] = txUs;
+		wallUs[NOTEENERGY_RX] = activeUs[NOTEENERGY_RX] = rxUs;
+	} else {
+		wallUs[NOTEENERGY_TX] += (uint64_t) reqBytes * UART_US_PER_BYTE;
+		activeUs[NOTEENERGY_TX] = ((uint64_t) reqBytes * UART_CYCLES_PER_BYTE * 1000000) / m->cpuHz;
+		wallUs[NOTEENERGY_RX] = (uint64_t) rspBytes * UART_US_PER_BYTE;
+		activeUs[NOTEENERGY_RX] = ((uint64_t) rspBytes * UART_CYCLES_PER_BYTE * 1000000) / m->cpuHz;
+	}
+	noteEnergyStats s;
+	memset(&s, 0, sizeof(s));
+	s.requests = 1;
+	for (int p=0; p<NOTEENERGY_PHASES; p++)
+		noteEnergyAccount(m, &s, p, wallUs[p], activeUs[p]);
+	if (out != NULL)
+		*out = s;
+	return noteEnergyTotal(&s);
+}
+
+// Report the simulated energy of a transaction over both transports
+void noteEnergySimulateReport(const char *name, uint32_t reqBytes, uint32_t rspBytes, uint32_t waitMs, uint32_t cpuCycles) {
+	char buf[224], prefix[64];
+	noteEnergyModel m = *noteEnergyModelGet();
+	noteEnergyStats s;
+	for (int i2c=1; i2c>=0; i2c--) {
+		m.i2c = (i2c != 0);
+		noteEnergySimulate(&m, reqBytes, rspBytes, waitMs, cpuCycles, &s);
+		snprintf(prefix, sizeof(prefix), "noteenergy: %s over %s, ", name, m.i2c ? "i2c" : "serial");
+		noteEnergyFormat(buf, sizeof(buf), prefix, &s);
+		NoteDebug(buf);
+	}
+}
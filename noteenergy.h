@@ -0,0 +1,74 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEENERGY_H
+#define NOTEENERGY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "power.h"
+
+// Approximate currents of the transport peripherals while active, in microamps, excluding the CPU and
+// the clock that they run from
+#define NOTEENERGY_UA_TWI		50
+#define NOTEENERGY_UA_UART		55
+
+// Phases of a transaction.  The time that the CPU spends asleep within each phase is derived from
+// the difference between wall-clock time and CPU cycles, because the cycle counter stops in sleep,
+// and is accounted for separately from the phases.
+typedef enum {
+	NOTEENERGY_BUILD,			// Serializing the request, between writes to the transport
+	NOTEENERGY_TX,				// Writing the request to the transport, including segment pacing
+	NOTEENERGY_WAIT,			// Waiting between polls while the Notecard processes the request
+	NOTEENERGY_RX,				// Reading the response from the transport
+	NOTEENERGY_PARSE,			// Parsing the response, and delivering it to the callback
+	NOTEENERGY_PHASES,
+	NOTEENERGY_IDLE = NOTEENERGY_PHASES		// Not part of the transaction, such as waiting to be dispatched
+} noteEnergyPhase;
+
+// The current drawn by the CPU and peripherals in each state, in microamps
+typedef struct {
+	uint32_t cpuHz;
+	uint32_t supplyMv;
+	uint32_t runUa;
+	uint32_t sleepUa;
+	uint32_t twiUa;
+	uint32_t uartUa;
+	uint32_t hfxoUa;
+	bool i2c;
+} noteEnergyModel;
+
+// Timestamps of a transaction in progress
+typedef struct {
+	uint8_t phase;
+	uint32_t markCycles;
+	uint32_t markTicks;
+	uint32_t cycles[NOTEENERGY_PHASES];
+	uint32_t ticks[NOTEENERGY_PHASES];
+} noteEnergyTxn;
+
+// Time and energy of a transaction, or of the totals of many, by phase.  The energy of each phase is
+// that of the CPU running and of the transport, and the energy of the CPU while it was asleep during
+// any of the phases is in sleepNj.
+typedef struct {
+	uint32_t requests;
+	uint64_t wallUs[NOTEENERGY_PHASES];
+	uint64_t activeUs[NOTEENERGY_PHASES];
+	uint64_t nj[NOTEENERGY_PHASES];
+	uint64_t sleepUs;
+	uint64_t sleepNj;
+} noteEnergyStats;
+
+void noteEnergySetModel(const noteEnergyModel *model);
+void noteEnergyDefaultModel(noteEnergyModel *model);
+void noteEnergyBegin(noteEnergyTxn *t, noteEnergyPhase phase);
+void noteEnergyMark(noteEnergyTxn *t, noteEnergyPhase phase);
+void noteEnergyEnd(noteEnergyTxn *t);
+void noteEnergyGetStats(noteEnergyStats *stats, bool reset);
+uint64_t noteEnergyTotal(const noteEnergyStats *stats);
+void noteEnergyReport(void);
+uint64_t noteEnergySimulate(const noteEnergyModel *model, uint32_t reqBytes, uint32_t rspBytes, uint32_t waitMs, uint32_t cpuCycles, noteEnergyStats *out);
+void noteEnergySimulateReport(const char *name, uint32_t reqBytes, uint32_t rspBytes, uint32_t waitMs, uint32_t cpuCycles);
+
+#endif // NOTEENERGY_H
@@ -0,0 +1,232 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Inbound note delivery driven by file.changes.  Rather than polling each inbound notefile with
+// note.get, which costs a transaction per notefile per poll whether or not anything has arrived,
+// a single file.changes request asks the Notecard how many notes each watched notefile holds, and
+// note.get is only issued for those that hold some.  The notes are fetched and deleted one at a
+// time, oldest first, and handed to the notefile's handler.
+//
+// Checks are made on a timer whose interval doubles each time a check finds nothing, up to a
+// maximum, and drops back to the minimum as soon as anything arrives, so that an idle downlink
+// costs very little bus traffic while a busy one is still drained promptly.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "sched.h"
+#include "notereq.h"
+#include "noteinbox.h"
+
+// A watched notefile
+typedef struct {
+	const char *file;
+	noteInboxHandler handler;
+	void *context;
+	uint32_t pending;
+} noteInboxFile;
+
+static noteInboxFile files[NOTEINBOX_MAX_FILES];
+static int fileCount = 0;
+static uint32_t minMs = 0;
+static uint32_t maxMs = 0;
+static bool busy = false;
+static bool arrived = false;
+static bool more = false;
+static int fetching = 0;
+static uint32_t retimeMs = 0;
+static int retimeTries = 0;
+static noteInboxStats stats;
+
+// Forwards
+static void noteInboxPoll(void *context);
+static void noteInboxRetime(void *context);
+static void noteInboxChecked(noteReqHandle handle, J *rsp, void *context);
+static void noteInboxFetched(noteReqHandle handle, J *rsp, void *context);
+
+// The periodic check
+static schedJob pollJob = { .name = "inbox", .handler = noteInboxPoll };
+
+// Watch an inbound notefile, whose notes are handed to the handler as they are fetched
+bool noteInboxWatch(const char *file, noteInboxHandler handler, void *context) {
+	if (fileCount >= NOTEINBOX_MAX_FILES || handler == NULL)
+		return false;
+	files[fileCount].file = file;
+	files[fileCount].handler = handler;
+	files[fileCount].context = context;
+	files[fileCount].pending = 0;
+	fileCount++;
+	return true;
+}
+
+// Set the interval of the periodic check.  If the timer can't be restarted, which leaves it stopped,
+// restarting it is tried again from the scheduler a few times before giving up.
+static void noteInboxInterval(uint32_t ms) {
+	if (ms == stats.intervalMs && retimeMs == 0)
+		return;
+	pollJob.periodMs = ms;
+	if (schedJobStart(&pollJob, false)) {
+		stats.intervalMs = ms;
+		retimeMs = 0;
+		retimeTries = 0;
+		return;
+	}
+	stats.timerFailed++;
+	retimeMs = ms;
+	if (++retimeTries <= NOTEINBOX_TIMER_RETRIES && schedPost(noteInboxRetime, NULL))
+		return;
+	NoteDebug("noteinbox: can't restart the check timer\n");
+}
+
+// Try again to restart the timer
+static void noteInboxRetime(void *context) {
+	if (retimeMs != 0 && minMs != 0)
+		noteInboxInterval(retimeMs);
+}
+
+// Begin checking for inbound notes, starting with one right now
+bool noteInboxStart(uint32_t minIntervalMs, uint32_t maxIntervalMs) {
+	if (minIntervalMs == 0 || maxIntervalMs < minIntervalMs)
+		return false;
+	minMs = minIntervalMs;
+	maxMs = maxIntervalMs;
+	stats.intervalMs = minMs;
+	retimeMs = 0;
+	retimeTries = 0;
+	pollJob.periodMs = minMs;
+	return schedJobStart(&pollJob, true);
+}
+
+// Stop checking on the timer
+void noteInboxStop() {
+	schedJobStop(&pollJob);
+	minMs = 0;
+}
+
+// Timer handler for the periodic check
+static void noteInboxPoll(void *context) {
+	noteInboxCheck();
+}
+
+// Write the file.changes request for the watched notefiles
+static void noteInboxEmitCheck(noteWriter *w, void *context) {
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "file.changes");
+	noteWriterString(w, "tracker", NOTEINBOX_TRACKER);
+	noteWriterArrayBegin(w, "files");
+	for (int i=0; i<fileCount; i++)
+		noteWriterString(w, NULL, files[i].file);
+	noteWriterArrayEnd(w);
+	noteWriterObjectEnd(w);
+}
+
+// Check for inbound notes now, such as when the Notecard has signalled that some have arrived.  This
+// may be used instead of the timer, and is ignored if a check is already under way.
+void noteInboxCheck() {
+	if (busy || fileCount == 0)
+		return;
+	busy = noteRequestAsyncEmit(noteInboxEmitCheck, NULL, noteInboxChecked, NULL) != 0;
+	if (busy)
+		stats.checks++;
+}
+
+// The check and any fetches that followed it are done, so adjust the interval by what was found,
+// unless checks are being made on demand rather than on the timer
+static void noteInboxDone() {
+	busy = false;
+	if (minMs != 0 && arrived)
+		noteInboxInterval(minMs);
+	else if (minMs != 0)
+		noteInboxInterval(stats.intervalMs * 2 > maxMs ? maxMs : stats.intervalMs * 2);
+	if (more)
+		noteInboxCheck();
+}
+
+// Write the note.get request for the notefile being fetched
+static void noteInboxEmitFetch(noteWriter *w, void *context) {
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "note.get");
+	noteWriterString(w, "file", files[fetching].file);
+	noteWriterBool(w, "delete", true);
+	noteWriterObjectEnd(w);
+}
+
+// Fetch the next pending note, if any, else finish
+static void noteInboxFetchNext() {
+	while (fetching < fileCount && files[fetching].pending == 0)
+		fetching++;
+	if (fetching >= fileCount) {
+		noteInboxDone();
+		return;
+	}
+	if (noteRequestAsyncEmit(noteInboxEmitFetch, NULL, noteInboxFetched, NULL) == 0) {
+		stats.failed++;
+		noteInboxDone();
+		return;
+	}
+	stats.fetches++;
+}
+
+// Completion of file.changes, whose "info" holds the number of notes in each notefile
+static void noteInboxChecked(noteReqHandle handle, J *rsp, void *context) {
+	arrived = false;
+	more = false;
+	if (rsp == NULL || NoteResponseError(rsp)) {
+		stats.failed++;
+		if (rsp != NULL)
+			NoteDeleteResponse(rsp);
+		noteInboxDone();
+		return;
+	}
+	J *info = JGetObjectItem(rsp, "info");
+	for (int i=0; i<fileCount; i++) {
+		J *file = (info == NULL) ? NULL : JGetObjectItem(info, files[i].file);
+		uint32_t total = (file == NULL) ? 0 : (uint32_t) JGetNumber(file, "total");
+		if (total > NOTEINBOX_MAX_FETCH) {
+			total = NOTEINBOX_MAX_FETCH;
+			more = true;
+		}
+		files[i].pending = total;
+		if (total == 0)
+			stats.avoided++;
+	}
+	NoteDeleteResponse(rsp);
+	fetching = 0;
+	noteInboxFetchNext();
+}
+
+// Completion of note.get, handing the note to its notefile's handler
+static void noteInboxFetched(noteReqHandle handle, J *rsp, void *context) {
+	noteInboxFile *f = &files[fetching];
+	f->pending--;
+	if (rsp == NULL || NoteResponseError(rsp)) {
+
+		// The notefile is empty after all, or the Notecard can't be reached
+		if (rsp == NULL || strstr(JGetString(rsp, "err"), "{note-noexist}") == NULL)
+			stats.failed++;
+		f->pending = 0;
+	} else {
+		stats.received++;
+		arrived = true;
+		f->handler(f->file, rsp, f->context);
+	}
+	if (rsp != NULL)
+		NoteDeleteResponse(rsp);
+	noteInboxFetchNext();
+}
+
+// Get the statistics
+void noteInboxGetStats(noteInboxStats *out) {
+	*out = stats;
+}
+
+// Report how many polls checking for changes has avoided
+void noteInboxReport() {
+	char buf[192];
+	snprintf(buf, sizeof(buf), "noteinbox: %lu checks, %lu fetches, %lu received, %lu polls avoided, %lu failed, interval %lus%s\n",
+			 (unsigned long) stats.checks, (unsigned long) stats.fetches, (unsigned long) stats.received,
+			 (unsigned long) stats.avoided, (unsigned long) stats.failed, (unsigned long) (stats.intervalMs / 1000),
+			 retimeMs != 0 ? " (timer stopped)" : "");
+	NoteDebug(buf);
+}
@@ -0,0 +1,47 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEINBOX_H
+#define NOTEINBOX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "note.h"
+
+// Number of inbound notefiles that may be watched
+#define NOTEINBOX_MAX_FILES		4
+
+// Maximum notes fetched from one notefile per check, after which another check follows at once
+#define NOTEINBOX_MAX_FETCH		8
+
+// Number of times restarting the check timer is retried if it fails
+#define NOTEINBOX_TIMER_RETRIES	3
+
+// Name of the Notecard's change tracker used by the inbox
+#define NOTEINBOX_TRACKER		"noteinbox"
+
+// Called in thread context with the note.get response for each inbound note, whose "body" and
+// "payload" are those of the note.  The response is freed when the handler returns.
+typedef void (*noteInboxHandler)(const char *file, J *note, void *context);
+
+// What checking for changes has saved, where avoided is the number of note.get polls of an empty
+// notefile that blind polling would have made and that a check made unnecessary
+typedef struct {
+	uint32_t checks;
+	uint32_t fetches;
+	uint32_t received;
+	uint32_t avoided;
+	uint32_t failed;
+	uint32_t timerFailed;
+	uint32_t intervalMs;
+} noteInboxStats;
+
+bool noteInboxWatch(const char *file, noteInboxHandler handler, void *context);
+bool noteInboxStart(uint32_t minIntervalMs, uint32_t maxIntervalMs);
+void noteInboxStop(void);
+void noteInboxCheck(void);
+void noteInboxGetStats(noteInboxStats *stats);
+void noteInboxReport(void);
+
+#endif // NOTEINBOX_H
@@ -0,0 +1,413 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Outbound note queue.  Notes are held in a fixed number of slots until the Notecard has accepted
+// them, and are sent one at a time, highest priority class first and oldest first within a class,
+// so that an alarm never waits behind a backlog of routine telemetry.  A note that the Notecard
+// doesn't accept is retried with a backoff of its own, during which the notes behind it are still
+// sent, and when the outbox is full the drop policy decides
+// what is given up, so that RAM stays bounded however congested the link becomes.
+//
+// Besides notes whose body is held in the outbox, an entry may stand for a request generated by its
+// owner at the moment it is sent, such as a batch; the owner is told of the outcome, and is
+// responsible for retrying it.  A note whose body is held in the outbox is instead handed, when it
+// is given up, to the spill function if one has been set.  A note whose request is cancelled is
+// given up at once, because that happens only when the host is about to lose what is in RAM.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "sched.h"
+#include "noteoutbox.h"
+#include "app_timer.h"
+
+// A queued note
+typedef struct {
+	bool used;
+	bool inFlight;
+	uint8_t cls;
+	uint8_t attempts;
+	bool backingOff;
+	uint32_t notBefore;
+	uint32_t seq;
+	const char *file;
+	bool sync;
+	char body[NOTEOUTBOX_BODY_MAX];
+	noteReqEmitter emit;
+	void *emitContext;
+	noteReqCallback callback;
+	void *context;
+} noteOutboxEntry;
+
+// Where the body of a note is written before it is known whether there is room for it
+typedef struct {
+	char *buf;
+	size_t len;
+} noteOutboxStaging;
+
+static noteOutboxEntry entries[NOTEOUTBOX_SLOTS];
+static noteOutboxPolicy dropPolicy = NOTEOUTBOX_DROP_LOWEST;
+static uint32_t nextSeq = 0;
+static noteOutboxEntry *sending = NULL;
+static noteOutboxStats stats;
+static noteOutboxSpill spillFn = NULL;
+
+// Timer used to delay retries
+APP_TIMER_DEF(timerRetry);
+static bool timerCreated = false;
+
+// Forwards
+static void noteOutboxPump(void);
+static void noteOutboxEmitNote(noteWriter *w, void *context);
+static void noteOutboxDone(noteReqHandle handle, J *rsp, void *context);
+
+// Set the drop policy, discarding anything queued
+void noteOutboxInit(noteOutboxPolicy policy) {
+	memset(entries, 0, sizeof(entries));
+	memset(&stats, 0, sizeof(stats));
+	dropPolicy = policy;
+	sending = NULL;
+}
+
+// Set the function to which notes are handed when they are given up
+void noteOutboxSetSpill(noteOutboxSpill spill) {
+	spillFn = spill;
+}
+
+// Hand a note that is being given up to the spill function
+static void noteOutboxSpillNote(noteOutboxClass cls, const char *file, const char *body, bool sync) {
+	if (spillFn != NULL && spillFn(cls, file, body, sync))
+		stats.spilled++;
+}
+
+// Free an entry
+static void noteOutboxFree(noteOutboxEntry *e) {
+	e->used = false;
+	stats.depth[e->cls]--;
+}
+
+// Give up an entry to make room, telling its owner if it has one
+static void noteOutboxDrop(noteOutboxEntry *e) {
+	noteReqCallback callback = e->callback;
+	void *context = e->context;
+	stats.dropped++;
+	noteOutboxFree(e);
+	if (e->emit == NULL)
+		noteOutboxSpillNote((noteOutboxClass) e->cls, e->file, e->body, e->sync);
+	else if (callback != NULL)
+		callback(0, NULL, context);
+}
+
+// Give up everything that isn't in flight, as when the host is about to lose what is in RAM.  Notes
+// whose body is held in the outbox are handed to the spill function, and the owners of the rest are
+// told, as they are of a drop.
+void noteOutboxSpillAll() {
+	for (int i=0; i<NOTEOUTBOX_SLOTS; i++)
+		if (entries[i].used && !entries[i].inFlight)
+			noteOutboxDrop(&entries[i]);
+}
+
+// True if a is sent before b
+static bool noteOutboxBefore(noteOutboxEntry *a, noteOutboxEntry *b) {
+	return a->cls < b->cls || (a->cls == b->cls && a->seq < b->seq);
+}
+
+// Find a slot for a new entry, applying the drop policy if the outbox is full.  Returns NULL if the
+// new entry is the one to be dropped.  A note that is coalesced with a queued one takes its place as
+// a new note, rather than being counted as added.
+static noteOutboxEntry *noteOutboxAlloc(noteOutboxClass cls, const char *file) {
+
+	// Use a free slot if there is one
+	noteOutboxEntry *victim = NULL;
+	for (int i=0; i<NOTEOUTBOX_SLOTS && victim == NULL; i++)
+		if (!entries[i].used)
+			victim = &entries[i];
+
+	// The outbox is full, so coalesce it with the most recent queued note for the same notefile and class
+	if (victim == NULL && dropPolicy == NOTEOUTBOX_COALESCE && file != NULL) {
+		noteOutboxEntry *newest = NULL;
+		for (int i=0; i<NOTEOUTBOX_SLOTS; i++) {
+			noteOutboxEntry *e = &entries[i];
+			if (e->used && !e->inFlight && e->emit == NULL && e->cls == cls && strcmp(e->file, file) == 0)
+				if (newest == NULL || e->seq > newest->seq)
+					newest = e;
+		}
+		if (newest != NULL) {
+			stats.coalesced++;
+			newest->attempts = 0;
+			newest->backingOff = false;
+			newest->seq = nextSeq++;
+			return newest;
+		}
+	}
+
+	// Or else choose a victim
+	if (victim == NULL) {
+		for (int i=0; i<NOTEOUTBOX_SLOTS; i++) {
+			noteOutboxEntry *e = &entries[i];
+			if (e->inFlight)
+				continue;
+			if (dropPolicy == NOTEOUTBOX_DROP_OLDEST) {
+				if (victim == NULL || e->seq < victim->seq)
+					victim = e;
+			} else {
+				if (victim == NULL || e->cls > victim->cls || (e->cls == victim->cls && e->seq < victim->seq))
+					victim = e;
+			}
+		}
+		if (victim != NULL) {
+			if (dropPolicy != NOTEOUTBOX_DROP_OLDEST && victim->cls < cls)
+				victim = NULL;
+			else
+				noteOutboxDrop(victim);
+		}
+	}
+	if (victim == NULL) {
+		stats.dropped++;
+		return NULL;
+	}
+
+	// Initialize it
+	memset(victim, 0, sizeof(noteOutboxEntry));
+	victim->used = true;
+	victim->cls = (uint8_t) cls;
+	victim->seq = nextSeq++;
+	victim->file = file;
+	stats.added++;
+	stats.depth[cls]++;
+	uint16_t depth = 0;
+	for (int c=0; c<NOTEOUTBOX_CLASSES; c++)
+		depth += stats.depth[c];
+	if (depth > stats.maxDepth)
+		stats.maxDepth = depth;
+	return victim;
+}
+
+// Output function that writes a body into the staging buffer
+static const char *noteOutboxStage(void *context, const uint8_t *data, size_t len) {
+	noteOutboxStaging *s = (noteOutboxStaging *) context;
+	if (s->len + len >= NOTEOUTBOX_BODY_MAX)
+		return "note body is too large for the outbox";
+	memcpy(&s->buf[s->len], data, len);
+	s->len += len;
+	return NULL;
+}
+
+// Queue a note whose body is written by a function now, which is the cheapest way of adding one.
+// If sync is set, the Notecard is asked to send it to the service at once.  Returns false if the
+// body is too large, or if the drop policy chose this note to be dropped.
+bool noteOutboxAddEmit(noteOutboxClass cls, const char *file, noteReqEmitter emitBody, void *context, bool sync) {
+	static char body[NOTEOUTBOX_BODY_MAX];
+	static noteWriter w;
+	noteOutboxStaging staging = { body, 0 };
+	noteWriterBegin(&w, noteOutboxStage, &staging);
+	emitBody(&w, context);
+	if (noteWriterEnd(&w) != NULL) {
+		stats.dropped++;
+		return false;
+	}
+	body[staging.len] = '\0';
+	noteOutboxEntry *e = noteOutboxAlloc(cls, file);
+	if (e == NULL) {
+		noteOutboxSpillNote(cls, file, body, sync);
+		return false;
+	}
+	memcpy(e->body, body, staging.len+1);
+	e->sync = sync;
+	noteOutboxPump();
+	return true;
+}
+
+// Queue a note whose body is already JSON text, which is copied
+bool noteOutboxAddJSON(noteOutboxClass cls, const char *file, const char *body, bool sync) {
+	size_t len = strlen(body);
+	if (len >= NOTEOUTBOX_BODY_MAX) {
+		stats.dropped++;
+		return false;
+	}
+	noteOutboxEntry *e = noteOutboxAlloc(cls, file);
+	if (e == NULL) {
+		noteOutboxSpillNote(cls, file, body, sync);
+		return false;
+	}
+	memcpy(e->body, body, len+1);
+	e->sync = sync;
+	noteOutboxPump();
+	return true;
+}
+
+// Queue a request that is written by its owner when it is sent.  The callback is always called,
+// with the response once the request has been sent, or with a NULL response if it was dropped.
+// Because a drop happens while something else is being added, the callback must not itself add
+// anything to the outbox when its response is NULL.
+bool noteOutboxSubmit(noteOutboxClass cls, noteReqEmitter emit, void *emitContext, noteReqCallback callback, void *context) {
+	noteOutboxEntry *e = noteOutboxAlloc(cls, NULL);
+	if (e == NULL)
+		return false;
+	e->emit = emit;
+	e->emitContext = emitContext;
+	e->callback = callback;
+	e->context = context;
+	noteOutboxPump();
+	return true;
+}
+
+// Number of notes queued in a class, including any in flight
+uint16_t noteOutboxDepth(noteOutboxClass cls) {
+	return stats.depth[cls];
+}
+
+// Get the statistics, optionally resetting the counters
+void noteOutboxGetStats(noteOutboxStats *out, bool reset) {
+	if (out != NULL)
+		*out = stats;
+	if (reset) {
+		uint16_t depth[NOTEOUTBOX_CLASSES];
+		memcpy(depth, stats.depth, sizeof(depth));
+		memset(&stats, 0, sizeof(stats));
+		memcpy(stats.depth, depth, sizeof(depth));
+	}
+}
+
+// Report the depth of the queue and what has become of the notes added to it
+void noteOutboxReport() {
+	char buf[224];
+	snprintf(buf, sizeof(buf), "noteoutbox: depth %u/%u/%u (max %u), %lu added, %lu sent, %lu retries, %lu failed, %lu cancelled, %lu dropped, %lu coalesced, %lu spilled\n",
+			 stats.depth[NOTEOUTBOX_ALARM], stats.depth[NOTEOUTBOX_ROUTINE], stats.depth[NOTEOUTBOX_BULK], stats.maxDepth,
+			 (unsigned long) stats.added, (unsigned long) stats.sent, (unsigned long) stats.retries,
+			 (unsigned long) stats.failed, (unsigned long) stats.cancelled, (unsigned long) stats.dropped, (unsigned long) stats.coalesced,
+			 (unsigned long) stats.spilled);
+	NoteDebug(buf);
+}
+
+// The retry delay has elapsed
+static void noteOutboxRetry(void *context) {
+	noteOutboxPump();
+}
+
+// Retry timer handler, called at interrupt level
+static void timerRetryHandler(void *context) {
+	schedPost(noteOutboxRetry, NULL);
+}
+
+// Pump again after a while, or at once if the timer can't be started
+static void noteOutboxWake(uint32_t ms) {
+	if (!timerCreated)
+		timerCreated = (app_timer_create(&timerRetry, APP_TIMER_MODE_SINGLE_SHOT, timerRetryHandler) == NRF_SUCCESS);
+	if (timerCreated)
+		app_timer_stop(timerRetry);
+	if (!timerCreated || app_timer_start(timerRetry, APP_TIMER_TICKS(ms), NULL) != NRF_SUCCESS)
+		schedPost(noteOutboxRetry, NULL);
+}
+
+// Milliseconds until an entry may be sent, which is 0 unless it is backing off from a failed attempt
+static uint32_t noteOutboxWaitMs(noteOutboxEntry *e, uint32_t now) {
+	if (!e->backingOff)
+		return 0;
+	int32_t remaining = (int32_t) (e->notBefore - now);
+	if (remaining <= 0) {
+		e->backingOff = false;
+		return 0;
+	}
+	return (uint32_t) remaining;
+}
+
+// Send the highest priority note that isn't backing off, unless one is already in flight.  If they
+// are all backing off, come back when the first of them may be retried.
+static void noteOutboxPump() {
+	if (sending != NULL)
+		return;
+	uint32_t now = (uint32_t) millis();
+	uint32_t waitMs = 0;
+	noteOutboxEntry *next = NULL;
+	for (int i=0; i<NOTEOUTBOX_SLOTS; i++) {
+		noteOutboxEntry *e = &entries[i];
+		if (!e->used)
+			continue;
+		uint32_t ms = noteOutboxWaitMs(e, now);
+		if (ms != 0) {
+			if (waitMs == 0 || ms < waitMs)
+				waitMs = ms;
+		} else if (next == NULL || noteOutboxBefore(e, next)) {
+			next = e;
+		}
+	}
+	if (next == NULL) {
+		if (waitMs != 0)
+			noteOutboxWake(waitMs);
+		return;
+	}
+	noteReqHandle handle;
+	if (next->emit != NULL)
+		handle = noteRequestAsyncEmit(next->emit, next->emitContext, noteOutboxDone, next);
+	else
+		handle = noteRequestAsyncEmit(noteOutboxEmitNote, next, noteOutboxDone, next);
+	if (handle == 0) {
+		noteOutboxWake(NOTEREQ_POLL_MS);
+		return;
+	}
+	next->inFlight = true;
+	sending = next;
+}
+
+// Write the note.add request for a note whose body is held in the outbox
+static void noteOutboxEmitNote(noteWriter *w, void *context) {
+	noteOutboxEntry *e = (noteOutboxEntry *) context;
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "note.add");
+	noteWriterString(w, "file", e->file);
+	if (e->sync)
+		noteWriterBool(w, "sync", true);
+	noteWriterRawValue(w, "body", e->body);
+	noteWriterObjectEnd(w);
+}
+
+// Completion of the note in flight, which is retained for another attempt if it wasn't accepted
+static void noteOutboxDone(noteReqHandle handle, J *rsp, void *context) {
+	noteOutboxEntry *e = (noteOutboxEntry *) context;
+	bool success = (rsp != NULL && !NoteResponseError(rsp));
+	bool cancelled = (!success && noteRequestAsyncCancelled(rsp));
+	sending = NULL;
+	e->inFlight = false;
+	if (success)
+		stats.sent++;
+	else if (cancelled)
+		stats.cancelled++;
+
+	// Hand the outcome of a request to its owner
+	if (e->emit != NULL) {
+		noteReqCallback callback = e->callback;
+		void *callbackContext = e->context;
+		if (!success && !cancelled)
+			stats.failed++;
+		noteOutboxFree(e);
+		if (callback != NULL)
+			callback(handle, rsp, callbackContext);
+		else if (rsp != NULL)
+			NoteDeleteResponse(rsp);
+		noteOutboxPump();
+		return;
+	}
+
+	// Retry a note that wasn't accepted, backing off each time, while the notes behind it carry on.  A
+	// note that was cancelled wasn't attempted, and is given up without waiting.
+	if (rsp != NULL)
+		NoteDeleteResponse(rsp);
+	if (success) {
+		noteOutboxFree(e);
+	} else if (cancelled) {
+		noteOutboxFree(e);
+		noteOutboxSpillNote((noteOutboxClass) e->cls, e->file, e->body, e->sync);
+	} else if (++e->attempts >= NOTEOUTBOX_MAX_ATTEMPTS) {
+		stats.failed++;
+		noteOutboxFree(e);
+		noteOutboxSpillNote((noteOutboxClass) e->cls, e->file, e->body, e->sync);
+	} else {
+		stats.retries++;
+		e->backingOff = true;
+		e->notBefore = (uint32_t) millis() + (NOTEOUTBOX_RETRY_MS << (e->attempts - 1));
+	}
+	noteOutboxPump();
+
+}
@@ -0,0 +1,66 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEOUTBOX_H
+#define NOTEOUTBOX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+#include "notereq.h"
+#include "notewriter.h"
+
+// Capacity of the outbox, which is all the RAM it will ever use
+#define NOTEOUTBOX_SLOTS			8
+#define NOTEOUTBOX_BODY_MAX			96
+
+// Retries of a note that the Notecard didn't accept, with the delay doubling after each attempt
+#define NOTEOUTBOX_MAX_ATTEMPTS		5
+#define NOTEOUTBOX_RETRY_MS			1000
+
+// Priority classes, highest first
+typedef enum {
+	NOTEOUTBOX_ALARM,
+	NOTEOUTBOX_ROUTINE,
+	NOTEOUTBOX_BULK,
+	NOTEOUTBOX_CLASSES
+} noteOutboxClass;
+
+// What is given up when a note is added to a full outbox
+typedef enum {
+	NOTEOUTBOX_DROP_OLDEST,			// The oldest queued note, of any class
+	NOTEOUTBOX_DROP_LOWEST,			// The oldest note of the lowest class, unless that is above the new note's
+	NOTEOUTBOX_COALESCE				// The newest queued note for the same notefile and class is replaced, else as DROP_LOWEST
+} noteOutboxPolicy;
+
+// Where a note is handed when the outbox gives up on it, whether it was dropped or was never accepted,
+// so that it can be kept somewhere more durable than RAM
+typedef bool (*noteOutboxSpill)(noteOutboxClass cls, const char *file, const char *body, bool sync);
+
+// Queue depth and what has become of the notes that have been added
+typedef struct {
+	uint32_t added;
+	uint32_t sent;
+	uint32_t retries;
+	uint32_t failed;
+	uint32_t cancelled;
+	uint32_t dropped;
+	uint32_t coalesced;
+	uint32_t spilled;
+	uint16_t depth[NOTEOUTBOX_CLASSES];
+	uint16_t maxDepth;
+} noteOutboxStats;
+
+void noteOutboxInit(noteOutboxPolicy policy);
+void noteOutboxSetSpill(noteOutboxSpill spill);
+void noteOutboxSpillAll(void);
+bool noteOutboxAddJSON(noteOutboxClass cls, const char *file, const char *body, bool sync);
+bool noteOutboxAddEmit(noteOutboxClass cls, const char *file, noteReqEmitter emitBody, void *context, bool sync);
+bool noteOutboxSubmit(noteOutboxClass cls, noteReqEmitter emit, void *emitContext, noteReqCallback callback, void *context);
+uint16_t noteOutboxDepth(noteOutboxClass cls);
+void noteOutboxGetStats(noteOutboxStats *stats, bool reset);
+void noteOutboxReport(void);
+
+#endif // NOTEOUTBOX_H
@@ -0,0 +1,263 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Packed binary telemetry.  Formatting every reading as a JSON number costs a call to the floating
+// point formatter and typically six to ten bytes on the wire, plus its key.  For high-rate data
+// it is far denser to pack frames of readings into fixed-layout little-endian records, optionally
+// delta-encoded, and to send them as the base64 "payload" of a single note.
+//
+// The payload is optionally compressed, and then base64-encoded by note-c, as it is streamed to the
+// Notecard a few bytes at a time, so neither form is ever held in memory as a whole.  The header is
+// never compressed, so that the receiver can tell from its flags whether the rest is.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "notepack.h"
+#include "notecomp.h"
+#include "noteoutbox.h"
+
+// Raw bytes encoded at a time as the payload is written.  A multiple of 3, so that there is no
+// padding other than at the end.
+#define B64_CHUNK_LEN	48
+
+// The base64 stage of the payload, which encodes whole groups of 3 bytes at a time
+typedef struct {
+	noteWriter *w;
+	uint8_t pending[B64_CHUNK_LEN];
+	size_t len;
+} notePackB64;
+
+// Forwards
+static void notePackEmit(noteWriter *w, void *context);
+static void notePackDone(noteReqHandle handle, J *rsp, void *context);
+
+// Prepare a packer for frames with the specified fields
+bool notePackInit(notePacker *p, const notePackField *fields, int fieldCount, bool delta, bool compress) {
+	if (fieldCount <= 0 || fieldCount > NOTEPACK_MAX_FIELDS)
+		return false;
+	memset(p, 0, sizeof(notePacker));
+	p->fields = fields;
+	p->fieldCount = (uint8_t) fieldCount;
+	p->delta = delta;
+	p->compress = compress;
+	notePackReset(p);
+	return true;
+}
+
+// Discard the packed frames and begin a new payload
+void notePackReset(notePacker *p) {
+	p->buf[0] = NOTEPACK_VERSION;
+	p->buf[1] = (p->delta ? NOTEPACK_FLAG_DELTA : 0) | (p->compress ? NOTEPACK_FLAG_COMPRESSED : 0);
+	p->buf[2] = 0;
+	p->buf[3] = 0;
+	p->len = NOTEPACK_HEADER_LEN;
+	p->frames = 0;
+}
+
+// Append an integer in little-endian order
+static uint8_t *putLE(uint8_t *out, uint32_t value, int bytes) {
+	for (int i=0; i<bytes; i++) {
+		*out++ = (uint8_t) value;
+		value >>= 8;
+	}
+	return out;
+}
+
+// Append a signed difference as a zigzag varint, so that small differences of either sign are short
+static uint8_t *putDelta(uint8_t *out, int32_t delta) {
+	uint32_t zigzag = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+	while (zigzag >= 0x80) {
+		*out++ = (uint8_t) (zigzag | 0x80);
+		zigzag >>= 7;
+	}
+	*out++ = (uint8_t) zigzag;
+	return out;
+}
+
+// Append a frame of readings, one per field.  Returns false if the payload is full, if it is being
+// sent, or if a reading doesn't fit in its field.
+bool notePackFrame(notePacker *p, const JNUMBER *values) {
+	static const int32_t intMin[] = { INT8_MIN, INT16_MIN, INT32_MIN };
+	static const int32_t intMax[] = { INT8_MAX, INT16_MAX, INT32_MAX };
+	static const int intBytes[] = { 1, 2, 4 };
+	uint8_t frame[NOTEPACK_MAX_FIELDS * 5];
+	int32_t next[NOTEPACK_MAX_FIELDS];
+	uint8_t *out = frame;
+	if (p->busy || p->frames == UINT16_MAX)
+		return false;
+	for (int i=0; i<p->fieldCount; i++) {
+		const notePackField *f = &p->fields[i];
+		if (f->type == NOTEPACK_FLOAT32) {
+			float value = (float) values[i];
+			uint32_t bits;
+			memcpy(&bits, &value, sizeof(bits));
+			out = putLE(out, bits, 4);
+			continue;
+		}
+		JNUMBER scaled = values[i] * (f->scale == 0 ? 1 : f->scale);
+		scaled += (scaled < 0) ? -0.5 : 0.5;
+		if (scaled < intMin[f->type] || scaled > intMax[f->type])
+			return false;
+		next[i] = (int32_t) scaled;
+		if (p->delta && p->frames > 0)
+			out = putDelta(out, next[i] - p->prev[i]);
+		else
+			out = putLE(out, (uint32_t) next[i], intBytes[f->type]);
+	}
+	size_t frameLen = out - frame;
+	if (p->len + frameLen > sizeof(p->buf))
+		return false;
+	memcpy(&p->buf[p->len], frame, frameLen);
+	p->len += frameLen;
+	memcpy(p->prev, next, sizeof(next));
+	p->frames++;
+	putLE(&p->buf[2], p->frames, 2);
+	return true;
+}
+
+// Encode whatever is pending in the base64 stage
+static void notePackB64Flush(notePackB64 *b) {
+	char encoded[((B64_CHUNK_LEN + 2) / 3) * 4 + 1];
+	if (b->len == 0)
+		return;
+	JB64Encode(encoded, (const char *) b->pending, (int) b->len);
+	noteWriterRaw(b->w, encoded, strlen(encoded));
+	b->len = 0;
+}
+
+// Feed the base64 stage, which has the signature of a compressor's output function
+static const char *notePackB64Write(void *context, const uint8_t *data, size_t len) {
+	notePackB64 *b = (notePackB64 *) context;
+	while (len > 0) {
+		size_t n = sizeof(b->pending) - b->len;
+		if (n > len)
+			n = len;
+		memcpy(&b->pending[b->len], data, n);
+		b->len += n;
+		data += n;
+		len -= n;
+		if (b->len == sizeof(b->pending))
+			notePackB64Flush(b);
+	}
+	return NULL;
+}
+
+// Write the packed frames as the base64 "payload" field of the object being written
+void notePackWritePayload(notePacker *p, noteWriter *w) {
+	static noteCompressor c;
+	notePackB64 b64 = { .w = w };
+	noteWriterRawValue(w, "payload", "\"");
+	if (!p->compress) {
+		notePackB64Write(&b64, p->buf, p->len);
+	} else {
+		notePackB64Write(&b64, p->buf, NOTEPACK_HEADER_LEN);
+		noteCompBegin(&c, notePackB64Write, &b64);
+		noteCompWrite(&c, &p->buf[NOTEPACK_HEADER_LEN], p->len - NOTEPACK_HEADER_LEN);
+		noteCompEnd(&c);
+	}
+	notePackB64Flush(&b64);
+	noteWriterRaw(w, "\"", 1);
+}
+
+// Add the packed frames to a notefile as the payload of a note, which is sent through the outbox as
+// bulk data.  The packer is busy until the Notecard has responded or the outbox has dropped it, after
+// which the callback, if any, is called.  The packer is reset only if the note was added; otherwise
+// its frames are kept, so that they are sent again by the next submit along with any added since, or
+// can be discarded with notePackReset().  Returns false if there are no frames, if the packer is busy,
+// or if the outbox won't take it.
+bool notePackSubmit(notePacker *p, const char *file, noteReqCallback callback, void *context) {
+	if (p->busy || p->frames == 0)
+		return false;
+	p->file = file;
+	p->callback = callback;
+	p->context = context;
+	p->busy = noteOutboxSubmit(NOTEOUTBOX_BULK, notePackEmit, p, notePackDone, p);
+	return p->busy;
+}
+
+// Write the note.add request, at the moment it is transmitted
+static void notePackEmit(noteWriter *w, void *context) {
+	notePacker *p = (notePacker *) context;
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "note.add");
+	noteWriterString(w, "file", p->file);
+	notePackWritePayload(p, w);
+	noteWriterObjectEnd(w);
+}
+
+// Completion of the note.add request
+static void notePackDone(noteReqHandle handle, J *rsp, void *context) {
+	notePacker *p = (notePacker *) context;
+	p->busy = false;
+	if (rsp != NULL && !NoteResponseError(rsp))
+		notePackReset(p);
+	if (p->callback != NULL)
+		p->callback(handle, rsp, p->context);
+	else if (rsp != NULL)
+		NoteDeleteResponse(rsp);
+}
+
+// Output function for the benchmark, which only counts bytes
+static const char *notePackCount(void *context, const uint8_t *data, size_t len) {
+	return NULL;
+}
+
+// Measure the CPU time and bytes on the wire of a batch of readings written as a JSON array of bodies,
+// versus the same readings packed, delta-encoded, and written as a base64 payload
+void notePackBenchmark(int iterations) {
+	static const notePackField fields[] = {
+		{ NOTEPACK_INT16, 100 },
+		{ NOTEPACK_INT16, 1000 },
+		{ NOTEPACK_INT32, 1 },
+	};
+	enum { FRAMES = 16 };
+	static noteWriter w;
+	static notePacker p;
+	uint32_t began, jsonCycles, packCycles;
+	size_t jsonBytes = 0, packBytes = 0;
+	if (iterations <= 0)
+		return;
+
+	// JSON bodies, as sent by a batch
+	began = cycles();
+	for (int i=0; i<iterations; i++) {
+		noteWriterBegin(&w, notePackCount, NULL);
+		noteWriterArrayBegin(&w, NULL);
+		for (int f=0; f<FRAMES; f++) {
+			noteWriterObjectBegin(&w, NULL);
+			noteWriterNumber(&w, "temp", 23.25 + f * 0.25);
+			noteWriterNumber(&w, "voltage", 4.12);
+			noteWriterInt(&w, "count", f);
+			noteWriterObjectEnd(&w);
+		}
+		noteWriterArrayEnd(&w);
+		noteWriterEnd(&w);
+		jsonBytes = w.total;
+	}
+	jsonCycles = (cycles() - began) / iterations;
+
+	// Packed frames
+	began = cycles();
+	for (int i=0; i<iterations; i++) {
+		notePackInit(&p, fields, 3, true, false);
+		for (int f=0; f<FRAMES; f++) {
+			JNUMBER values[3] = { 23.25 + f * 0.25, 4.12, f };
+			notePackFrame(&p, values);
+		}
+		noteWriterBegin(&w, notePackCount, NULL);
+		noteWriterObjectBegin(&w, NULL);
+		notePackWritePayload(&p, &w);
+		noteWriterObjectEnd(&w);
+		noteWriterEnd(&w);
+		packBytes = w.total;
+	}
+	packCycles = (cycles() - began) / iterations;
+
+	char report[128];
+	snprintf(report, sizeof(report), "notepack: %d readings, JSON %lu cycles %lu bytes, packed %lu cycles %lu bytes (%lu raw)\n",
+			 FRAMES, (unsigned long) jsonCycles, (unsigned long) jsonBytes,
+			 (unsigned long) packCycles, (unsigned long) packBytes, (unsigned long) p.len);
+	NoteDebug(report);
+}
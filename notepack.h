@@ -0,0 +1,66 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEPACK_H
+#define NOTEPACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+#include "notereq.h"
+#include "notewriter.h"
+
+// Limits on a packed payload, before base64 encoding
+#define NOTEPACK_MAX_LEN		192
+#define NOTEPACK_MAX_FIELDS		8
+
+// Layout of the payload, which begins with a header of a version, flags, and a little-endian frame count
+#define NOTEPACK_VERSION		1
+#define NOTEPACK_FLAG_DELTA		0x01
+#define NOTEPACK_FLAG_COMPRESSED	0x02
+#define NOTEPACK_HEADER_LEN		4
+
+// Type in which a field is stored within a frame, always little-endian
+typedef enum {
+	NOTEPACK_INT8,
+	NOTEPACK_INT16,
+	NOTEPACK_INT32,
+	NOTEPACK_FLOAT32
+} notePackType;
+
+// A field of a frame.  Integer fields store the value multiplied by scale and rounded, so that, for
+// example, a temperature with a scale of 100 is stored in hundredths of a degree.  A scale of 0 is 1.
+typedef struct {
+	notePackType type;
+	float scale;
+} notePackField;
+
+// Frames of readings packed into a binary payload.  If delta is set, every frame after the first
+// stores its integer fields as zigzag varints of the difference from the previous frame, which for
+// slowly changing readings is usually a single byte.  If compress is set, the frames are compressed
+// as they are written to the payload.
+typedef struct {
+	const notePackField *fields;
+	uint8_t fieldCount;
+	bool delta;
+	bool compress;
+	uint8_t buf[NOTEPACK_MAX_LEN];
+	size_t len;
+	uint16_t frames;
+	int32_t prev[NOTEPACK_MAX_FIELDS];
+	bool busy;
+	const char *file;
+	noteReqCallback callback;
+	void *context;
+} notePacker;
+
+bool notePackInit(notePacker *p, const notePackField *fields, int fieldCount, bool delta, bool compress);
+void notePackReset(notePacker *p);
+bool notePackFrame(notePacker *p, const JNUMBER *values);
+void notePackWritePayload(notePacker *p, noteWriter *w);
+bool notePackSubmit(notePacker *p, const char *file, noteReqCallback callback, void *context);
+void notePackBenchmark(int iterations);
+
+#endif // NOTEPACK_H
@@ -0,0 +1,256 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Streaming selective parser for Notecard responses.  Most responses that the host cares about
+// are a flat object from which only a field or two is needed, such as the "value" of card.temp, so
+// rather than building a J tree for the whole response, this extracts just the requested top-level
+// fields byte by byte as the response is received.  Nested objects and arrays are skipped.
+
+#include <string.h>
+#include "noteparse.h"
+
+// Parser states
+enum {
+	PS_BEGIN,			// Before the opening brace
+	PS_KEY_WAIT,		// Expecting a key or the closing brace
+	PS_KEY,				// Within a key
+	PS_COLON,			// Expecting the colon after a key
+	PS_VALUE_WAIT,		// Expecting a value
+	PS_STRING,			// Within a string value
+	PS_SCALAR,			// Within a number, true, false or null
+	PS_NESTED,			// Within an object or array value, which is skipped
+	PS_COMMA,			// Expecting a comma or the closing brace
+	PS_DONE				// After the closing brace
+};
+
+// Initialize a parser to extract the specified fields
+void noteParseInit(noteParser *p, noteParseField *fields, int fieldCount) {
+	p->fields = fields;
+	p->fieldCount = fieldCount;
+	noteParseReset(p);
+}
+
+// Reset a parser so that it is ready for a new response
+void noteParseReset(noteParser *p) {
+	noteParseField *fields = p->fields;
+	int fieldCount = p->fieldCount;
+	memset(p, 0, sizeof(noteParser));
+	p->fields = fields;
+	p->fieldCount = fieldCount;
+	p->state = PS_BEGIN;
+	for (int i=0; i<fieldCount; i++) {
+		fields[i].present = false;
+		fields[i].number = 0;
+		fields[i].boolean = false;
+		if (fields[i].string != NULL && fields[i].stringMax > 0)
+			fields[i].string[0] = '\0';
+	}
+}
+
+// Find an extracted field by key
+noteParseField *noteParseGet(noteParser *p, const char *key) {
+	for (int i=0; i<p->fieldCount; i++)
+		if (strcmp(p->fields[i].key, key) == 0)
+			return &p->fields[i];
+	return NULL;
+}
+
+// Append a character to whatever string is being captured, counting the length of a key even when
+// it doesn't fit so that a long key isn't mistaken for its truncation
+static void noteParseCapture(noteParser *p, char ch) {
+	if (p->capture == p->key)
+		p->keyLen++;
+	if (p->capture != NULL && p->captureLen+1 < p->captureMax) {
+		p->capture[p->captureLen++] = ch;
+		p->capture[p->captureLen] = '\0';
+	}
+}
+
+// Process a character within a string, handling escapes, returning true if the string has ended
+static bool noteParseStringChar(noteParser *p, char ch) {
+	if (p->unicode > 0) {
+		if (--p->unicode == 0)
+			noteParseCapture(p, '?');
+		return false;
+	}
+	if (p->escape) {
+		p->escape = false;
+		switch (ch) {
+		case 'b': ch = '\b'; break;
+		case 'f': ch = '\f'; break;
+		case 'n': ch = '\n'; break;
+		case 'r': ch = '\r'; break;
+		case 't': ch = '\t'; break;
+		case 'u': p->unicode = 4; return false;
+		}
+		noteParseCapture(p, ch);
+		return false;
+	}
+	if (ch == '\\') {
+		p->escape = true;
+		return false;
+	}
+	if (ch == '"')
+		return true;
+	noteParseCapture(p, ch);
+	return false;
+}
+
+// Find the field that a key refers to, or NULL if it isn't wanted
+static noteParseField *noteParseTarget(noteParser *p) {
+	if (p->keyTooLong)
+		return NULL;
+	return noteParseGet(p, p->key);
+}
+
+// Convert a completed scalar into its field
+static void noteParseScalarDone(noteParser *p) {
+	noteParseField *f = p->target;
+	if (f == NULL)
+		return;
+	p->scalar[p->scalarLen] = '\0';
+	if (strcmp(p->scalar, "true") == 0 || strcmp(p->scalar, "false") == 0) {
+		f->boolean = (p->scalar[0] == 't');
+		f->number = f->boolean ? 1 : 0;
+		f->present = (f->type != NOTEPARSE_STRING);
+	} else if (strcmp(p->scalar, "null") != 0) {
+		char *end;
+		f->number = JAtoN(p->scalar, &end);
+		f->boolean = (f->number != 0);
+		f->present = (f->type != NOTEPARSE_STRING);
+	}
+}
+
+// Feed response data to the parser.  This has the signature of a noteWireSink, and always accepts
+// the data even if it isn't valid JSON, so that the rest of the response is still drained.
+bool noteParseSink(void *context, const uint8_t *data, size_t len) {
+	noteParser *p = (noteParser *) context;
+	for (size_t i=0; i<len && !p->invalid; i++) {
+		char ch = (char) data[i];
+		bool space = (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+		switch (p->state) {
+
+		case PS_BEGIN:
+			if (ch == '{')
+				p->state = PS_KEY_WAIT;
+			else if (!space)
+				p->invalid = true;
+			break;
+
+		case PS_KEY_WAIT:
+			if (ch == '"') {
+				p->state = PS_KEY;
+				p->keyLen = 0;
+				p->keyTooLong = false;
+				p->key[0] = '\0';
+				p->capture = p->key;
+				p->captureLen = 0;
+				p->captureMax = sizeof(p->key);
+			} else if (ch == '}') {
+				p->state = PS_DONE;
+				p->done = true;
+			} else if (!space) {
+				p->invalid = true;
+			}
+			break;
+
+		case PS_KEY:
+			if (noteParseStringChar(p, ch)) {
+				p->keyTooLong = (p->keyLen >= sizeof(p->key));
+				p->state = PS_COLON;
+			}
+			break;
+
+		case PS_COLON:
+			if (ch == ':') {
+				p->state = PS_VALUE_WAIT;
+				p->target = noteParseTarget(p);
+			} else if (!space) {
+				p->invalid = true;
+			}
+			break;
+
+		case PS_VALUE_WAIT:
+			if (space)
+				break;
+			if (ch == '"') {
+				p->state = PS_STRING;
+				p->capture = NULL;
+				p->captureLen = 0;
+				if (strcmp(p->key, "err") == 0 && !p->keyTooLong) {
+					p->capture = p->err;
+					p->captureMax = sizeof(p->err);
+				} else if (p->target != NULL && p->target->type == NOTEPARSE_STRING && p->target->string != NULL) {
+					p->capture = p->target->string;
+					p->captureMax = p->target->stringMax;
+				}
+				if (p->capture != NULL && p->captureMax > 0)
+					p->capture[0] = '\0';
+			} else if (ch == '{' || ch == '[') {
+				p->state = PS_NESTED;
+				p->depth = 1;
+				p->inString = false;
+			} else {
+				p->state = PS_SCALAR;
+				p->scalar[0] = ch;
+				p->scalarLen = 1;
+			}
+			break;
+
+		case PS_STRING:
+			if (noteParseStringChar(p, ch)) {
+				if (p->target != NULL && p->target->type == NOTEPARSE_STRING)
+					p->target->present = true;
+				p->state = PS_COMMA;
+			}
+			break;
+
+		case PS_NESTED:
+			if (p->inString) {
+				if (p->escape)
+					p->escape = false;
+				else if (ch == '\\')
+					p->escape = true;
+				else if (ch == '"')
+					p->inString = false;
+			} else if (ch == '"') {
+				p->inString = true;
+			} else if (ch == '{' || ch == '[') {
+				p->depth++;
+			} else if (ch == '}' || ch == ']') {
+				if (--p->depth == 0)
+					p->state = PS_COMMA;
+			}
+			break;
+
+		case PS_SCALAR:
+			if (ch != ',' && ch != '}' && !space) {
+				if (p->scalarLen+1 < sizeof(p->scalar))
+					p->scalar[p->scalarLen++] = ch;
+				else
+					p->invalid = true;
+				break;
+			}
+			noteParseScalarDone(p);
+			p->state = PS_COMMA;
+			// Fall through - the delimiter is processed as usual
+
+		case PS_COMMA:
+			if (ch == ',')
+				p->state = PS_KEY_WAIT;
+			else if (ch == '}') {
+				p->state = PS_DONE;
+				p->done = true;
+			} else if (!space) {
+				p->invalid = true;
+			}
+			break;
+
+		case PS_DONE:
+			break;
+
+		}
+	}
+	return true;
+}
@@ -0,0 +1,67 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEPARSE_H
+#define NOTEPARSE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+
+// Limits on what the parser will capture.  Longer keys can't match, longer scalars are invalid,
+// and longer strings (including "err") are truncated.
+#define NOTEPARSE_KEY_MAX		24
+#define NOTEPARSE_SCALAR_MAX	32
+#define NOTEPARSE_ERR_MAX		64
+
+// Type of value to be extracted for a field
+typedef enum {
+	NOTEPARSE_NUMBER,
+	NOTEPARSE_BOOL,
+	NOTEPARSE_STRING
+} noteParseType;
+
+// A top-level field of the response to be extracted.  For strings, the caller supplies the buffer.
+typedef struct {
+	const char *key;
+	noteParseType type;
+	char *string;
+	size_t stringMax;
+	bool present;
+	JNUMBER number;
+	bool boolean;
+} noteParseField;
+
+// A streaming parser that picks the requested fields out of a response as its bytes arrive,
+// without allocating memory and without retaining anything else.  Any "err" field is always
+// captured.
+typedef struct {
+	noteParseField *fields;
+	int fieldCount;
+	char err[NOTEPARSE_ERR_MAX];
+	bool done;
+	bool invalid;
+	uint8_t state;
+	uint8_t depth;
+	bool inString;
+	bool escape;
+	uint8_t unicode;
+	char key[NOTEPARSE_KEY_MAX];
+	size_t keyLen;
+	bool keyTooLong;
+	noteParseField *target;
+	char *capture;
+	size_t captureLen;
+	size_t captureMax;
+	char scalar[NOTEPARSE_SCALAR_MAX];
+	size_t scalarLen;
+} noteParser;
+
+void noteParseInit(noteParser *p, noteParseField *fields, int fieldCount);
+void noteParseReset(noteParser *p);
+bool noteParseSink(void *context, const uint8_t *data, size_t len);
+noteParseField *noteParseGet(noteParser *p, const char *key);
+
+#endif // NOTEPARSE_H
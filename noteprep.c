@@ -0,0 +1,125 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Prepared JSON.  Text whose shape never changes, such as the body of the note added for every alarm,
+// is formatted once from a skeleton in which each numeric field is marked with '@'.  Each time, only
+// the numbers are formatted into their fixed-width slots, and the text is then used as-is, so that
+// no JSON tree is built and no heap is touched.  Measurements are batched rather than being sent as
+// a note.add each, so the notes that are still sent one at a time are alarms, whose prepared body is
+// copied into the outbox; the outbox gives them priority and retries them, which a request submitted
+// straight to the Notecard wouldn't.
+//
+// For example, the skeleton
+//     {"temp":@,"low":@,"high":@}
+// has three slots, 0 for "temp", 1 for "low" and 2 for "high".
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "noteprep.h"
+
+// Format a skeleton into the supplied buffer, which must remain valid for the life of the
+// prepared text.  Returns false if the buffer is too small or there are too many slots.
+bool notePrepInit(notePrep *prep, char *buffer, size_t bufferSize, const char *skeleton) {
+	memset(prep, 0, sizeof(notePrep));
+	prep->json = buffer;
+	for (const char *s = skeleton; *s != '\0'; s++) {
+		size_t needed = (*s == NOTEPREP_SLOT_MARKER ? NOTEPREP_SLOT_WIDTH : 1);
+		if (prep->len + needed + 1 > bufferSize)
+			return false;
+		if (*s != NOTEPREP_SLOT_MARKER) {
+			prep->json[prep->len++] = *s;
+			continue;
+		}
+		if (prep->slots == NOTEPREP_MAX_SLOTS)
+			return false;
+		prep->slotOffset[prep->slots++] = (uint16_t) prep->len;
+		prep->json[prep->len] = '0';
+		memset(&prep->json[prep->len+1], ' ', NOTEPREP_SLOT_WIDTH-1);
+		prep->len += NOTEPREP_SLOT_WIDTH;
+	}
+	prep->json[prep->len] = '\0';
+	return true;
+}
+
+// Patch preformatted text into a slot
+static bool notePrepSetText(notePrep *prep, int slot, const char *text) {
+	if (slot < 0 || slot >= prep->slots)
+		return false;
+	size_t len = strlen(text);
+	if (len == 0 || len > NOTEPREP_SLOT_WIDTH)
+		return false;
+	char *p = &prep->json[prep->slotOffset[slot]];
+	memcpy(p, text, len);
+	memset(p+len, ' ', NOTEPREP_SLOT_WIDTH-len);
+	return true;
+}
+
+// Patch a number into a slot.  Returns false if the value can't be represented in the width of
+// the slot.
+bool notePrepSetNumber(notePrep *prep, int slot, JNUMBER value) {
+	char text[JNTOA_MAX];
+	JNtoA(value, text, NOTEPREP_PRECISION);
+	return notePrepSetText(prep, slot, text);
+}
+
+// Patch an integer into a slot, which is cheaper than formatting it as a JNUMBER
+bool notePrepSetInt(notePrep *prep, int slot, long value) {
+	char text[24];
+	snprintf(text, sizeof(text), "%ld", value);
+	return notePrepSetText(prep, slot, text);
+}
+
+// Measure the CPU cycles and heap operations needed to produce the text of a typical note.add
+// request, both by building and serializing a J tree and by patching a prepared request.
+void notePrepBenchmark(int iterations) {
+	uint32_t allocs, frees, allocsAfter, freesAfter, began;
+	if (iterations <= 0)
+		return;
+
+	// The J tree path, as a note.add would usually be built
+	heapStats(&allocs, &frees);
+	began = cycles();
+	for (int i=0; i<iterations; i++) {
+		J *req = NoteNewRequest("note.add");
+		if (req == NULL)
+			break;
+		JAddStringToObject(req, "file", "sensors.qo");
+		J *body = JCreateObject();
+		if (body != NULL) {
+			JAddNumberToObject(body, "temp", 23.5 + i);
+			JAddNumberToObject(body, "voltage", 4.12);
+			JAddNumberToObject(body, "count", i);
+			JAddItemToObject(req, "body", body);
+		}
+		char *json = JPrintUnformatted(req);
+		JDelete(req);
+		if (json != NULL)
+			JFree(json);
+	}
+	uint32_t treeCycles = (cycles() - began) / iterations;
+	heapStats(&allocsAfter, &freesAfter);
+	uint32_t treeOps = ((allocsAfter - allocs) + (freesAfter - frees)) / iterations;
+
+	// The prepared path
+	char buffer[160];
+	notePrep prep;
+	if (!notePrepInit(&prep, buffer, sizeof(buffer), "{\"req\":\"note.add\",\"file\":\"sensors.qo\",\"body\":{\"temp\":@,\"voltage\":@,\"count\":@}}"))
+		return;
+	heapStats(&allocs, &frees);
+	began = cycles();
+	for (int i=0; i<iterations; i++) {
+		notePrepSetNumber(&prep, 0, 23.5 + i);
+		notePrepSetNumber(&prep, 1, 4.12);
+		notePrepSetInt(&prep, 2, i);
+	}
+	uint32_t prepCycles = (cycles() - began) / iterations;
+	heapStats(&allocsAfter, &freesAfter);
+	uint32_t prepOps = ((allocsAfter - allocs) + (freesAfter - frees)) / iterations;
+
+	char report[128];
+	snprintf(report, sizeof(report), "noteprep: per note, J tree %lu cycles %lu heap ops, prepared %lu cycles %lu heap ops\n",
+			 (unsigned long) treeCycles, (unsigned long) treeOps, (unsigned long) prepCycles, (unsigned long) prepOps);
+	NoteDebug(report);
+}
@@ -0,0 +1,35 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEPREP_H
+#define NOTEPREP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+
+// In a skeleton, this character marks a numeric slot to be patched for each request
+#define NOTEPREP_SLOT_MARKER	'@'
+
+// Limits on the slots in prepared text.  Every slot is this many characters wide, so that
+// patching never moves the text around it; unused space is padded with JSON whitespace.
+#define NOTEPREP_MAX_SLOTS		8
+#define NOTEPREP_SLOT_WIDTH		16
+#define NOTEPREP_PRECISION		6
+
+// Prepared JSON text, which is formatted once and then patched in place
+typedef struct {
+	char *json;
+	size_t len;
+	uint8_t slots;
+	uint16_t slotOffset[NOTEPREP_MAX_SLOTS];
+} notePrep;
+
+bool notePrepInit(notePrep *prep, char *buffer, size_t bufferSize, const char *skeleton);
+bool notePrepSetNumber(notePrep *prep, int slot, JNUMBER value);
+bool notePrepSetInt(notePrep *prep, int slot, long value);
+void notePrepBenchmark(int iterations);
+
+#endif // NOTEPREP_H
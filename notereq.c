@@ -0,0 +1,600 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Non-blocking Notecard requests.  A request is queued and its handle returned to the caller at
+// once; the scheduler then transmits it, polls for the response on a timer while the Notecard is
+// busy, and finally delivers the parsed response to a completion callback.  Requests are processed
+// strictly in the order in which they were submitted.
+//
+// Responses are either parsed into a J tree, or, for queries, picked apart as they arrive by a
+// streaming parser that extracts only the fields the caller asked for, without using the heap.
+//
+// Requests that are submitted with a TTL are looked up in the response cache before being sent,
+// and a hit is delivered from RAM without any bus traffic.
+//
+// Requests are serialized by a streaming writer directly into the transport as they are sent, so
+// the serialized form of a request never exists in memory as a whole.
+//
+// The Notecard only processes one request at a time, so requests are pipelined on the host side:
+// the next request is transmitted the moment the current response has been received, and parsing
+// of that response and its callback are deferred to a separate scheduler event so that they
+// overlap the Notecard's processing of the next request.
+//
+// Each request is timestamped as it moves through the phases of its transaction, from which its
+// energy is estimated.
+//
+// Because this shares the transport with note-c, blocking calls such as NoteRequest() must not be
+// made while noteRequestAsyncIdle() is false.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "sched.h"
+#include "notewire.h"
+#include "notewriter.h"
+#include "notecache.h"
+#include "noteenergy.h"
+#include "arena.h"
+#include "notereq.h"
+#include "app_timer.h"
+
+// Life cycle of a request
+typedef enum {
+	SLOT_QUEUED,
+	SLOT_IN_FLIGHT,
+	SLOT_DONE
+} noteReqState;
+
+// A request, which occupies a slot from the time it is submitted until its callback returns
+typedef struct {
+	noteReqHandle handle;
+	noteReqState state;
+	J *req;
+	const char *json;
+	noteReqEmitter emit;
+	void *emitContext;
+	char *rsp;
+	const char *errstr;
+	const char *txErrstr;
+	size_t txLen;
+	bool cancelled;
+	noteReqCallback callback;
+	noteParser *parser;
+	noteReqQueryCallback queryCallback;
+	noteWireSink sink;
+	void *sinkContext;
+	noteReqStreamCallback streamCallback;
+	void *context;
+	uint32_t ttlMs;
+	uint32_t startTicks;
+	uint32_t busyTicks;
+	noteEnergyTxn energy;
+} noteReqSlot;
+
+// Slots in submission order, starting at the oldest
+static noteReqSlot queue[NOTEREQ_MAX_PENDING];
+static int queueHead = 0;
+static int queueCount = 0;
+static noteReqHandle lastHandle = 0;
+
+// State of the request that is in flight
+static noteReqSlot *inFlight = NULL;
+static bool servicePosted = false;
+static bool dispatchPosted = false;
+static char *rspBuffer = NULL;
+static size_t rspLen = 0;
+static size_t rspAlloc = 0;
+
+// Throughput statistics
+static noteReqStats stats;
+static uint32_t activeSinceTicks;
+
+// Timer used to poll for the response
+APP_TIMER_DEF(timerPoll);
+static bool timerCreated = false;
+
+// Forwards
+static void noteReqService(void *context);
+static void noteReqDispatch(void *context);
+static void noteReqPost(void);
+static bool noteReqStart(void);
+static const char *noteReqOutput(void *context, const uint8_t *data, size_t len);
+static void noteReqFinish(noteReqSlot *slot, const char *errstr);
+static bool noteReqSink(void *context, const uint8_t *data, size_t len);
+
+// Slot at the specified position in the queue
+static noteReqSlot *slotAt(int i) {
+	return &queue[(queueHead + i) % NOTEREQ_MAX_PENDING];
+}
+
+// Ticks elapsed since the specified RTC counter value
+static uint32_t ticksSince(uint32_t then) {
+	return app_timer_cnt_diff_compute(app_timer_cnt_get(), then);
+}
+
+// Convert RTC ticks to milliseconds
+static uint32_t ticksToMs(uint64_t ticks) {
+	return (uint32_t) ((ticks * 1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)) / APP_TIMER_CLOCK_FREQ);
+}
+
+// Allocate a slot at the tail of the queue, or return NULL if the queue is full
+static noteReqSlot *noteReqAlloc(noteReqCallback callback, void *context) {
+	if (queueCount == NOTEREQ_MAX_PENDING)
+		return NULL;
+	if (++lastHandle == 0)
+		lastHandle = 1;
+	if (queueCount == 0)
+		activeSinceTicks = app_timer_cnt_get();
+	noteReqSlot *slot = slotAt(queueCount);
+	memset(slot, 0, sizeof(noteReqSlot));
+	slot->handle = lastHandle;
+	slot->callback = callback;
+	slot->context = context;
+	queueCount++;
+	return slot;
+}
+
+// Submit a request, which is always consumed whether or not this succeeds.  The callback may be
+// NULL if the response is of no interest.  Returns 0 if the queue is full.
+noteReqHandle noteRequestAsync(J *req, noteReqCallback callback, void *context) {
+	return noteRequestAsyncCached(req, 0, callback, context);
+}
+
+// Submit a request whose response may be served from the cache, and which if it does go to the
+// Notecard will have its response cached for the specified number of milliseconds
+noteReqHandle noteRequestAsyncCached(J *req, uint32_t ttlMs, noteReqCallback callback, void *context) {
+	if (req == NULL)
+		return 0;
+	noteReqSlot *slot = noteReqAlloc(callback, context);
+	if (slot == NULL) {
+		JDelete(req);
+		return 0;
+	}
+	slot->state = SLOT_QUEUED;
+	slot->req = req;
+	slot->ttlMs = ttlMs;
+	noteReqPost();
+	return slot->handle;
+}
+
+// Submit a request that has already been serialized as JSON, without the terminating newline.
+// The text is not copied, and must remain unchanged until the callback has been called.
+noteReqHandle noteRequestAsyncJSON(const char *json, noteReqCallback callback, void *context) {
+	noteReqSlot *slot = noteReqAlloc(callback, context);
+	if (slot == NULL)
+		return 0;
+	slot->state = SLOT_QUEUED;
+	slot->json = json;
+	noteReqPost();
+	return slot->handle;
+}
+
+// Submit a query, a request whose JSON text is supplied as with noteRequestAsyncJSON(), but whose
+// response is fed through the specified streaming parser rather than being parsed into a J tree.
+// The parser is reset when the request is transmitted, and is handed to the callback on completion
+// with any I/O error reported in its err field.  Neither the request nor the response uses the heap.
+noteReqHandle noteRequestAsyncQuery(const char *json, noteParser *parser, noteReqQueryCallback callback, void *context) {
+	return noteRequestAsyncQueryCached(json, parser, 0, callback, context);
+}
+
+// Submit a query whose response may be served from the cache, as with noteRequestAsyncCached()
+noteReqHandle noteRequestAsyncQueryCached(const char *json, noteParser *parser, uint32_t ttlMs, noteReqQueryCallback callback, void *context) {
+	noteReqSlot *slot = noteReqAlloc(NULL, context);
+	if (slot == NULL)
+		return 0;
+	slot->state = SLOT_QUEUED;
+	slot->json = json;
+	slot->parser = parser;
+	slot->queryCallback = callback;
+	slot->ttlMs = ttlMs;
+	noteReqPost();
+	return slot->handle;
+}
+
+// Submit a request whose JSON is generated by a function at the moment it is transmitted, for
+// requests that are most cheaply produced by writing them directly rather than building a J tree.
+noteReqHandle noteRequestAsyncEmit(noteReqEmitter emit, void *emitContext, noteReqCallback callback, void *context) {
+	noteReqSlot *slot = noteReqAlloc(callback, context);
+	if (slot == NULL)
+		return 0;
+	slot->state = SLOT_QUEUED;
+	slot->emit = emit;
+	slot->emitContext = emitContext;
+	noteReqPost();
+	return slot->handle;
+}
+
+// Submit a request whose JSON is generated by a function, and whose response is handed to a sink as
+// it arrives rather than being parsed.  This is for responses that aren't JSON, such as binary data.
+noteReqHandle noteRequestAsyncStream(noteReqEmitter emit, void *emitContext, noteWireSink sink, void *sinkContext, noteReqStreamCallback callback, void *context) {
+	noteReqSlot *slot = noteReqAlloc(NULL, context);
+	if (slot == NULL)
+		return 0;
+	slot->state = SLOT_QUEUED;
+	slot->emit = emit;
+	slot->emitContext = emitContext;
+	slot->sink = sink;
+	slot->sinkContext = sinkContext;
+	slot->streamCallback = callback;
+	noteReqPost();
+	return slot->handle;
+}
+
+// Cancel a queued request without transmitting it.  Its callback is still called, in order, with
+// an error, so that its owner can release whatever it was holding for it.
+static void noteReqCancelSlot(noteReqSlot *slot) {
+	if (slot->req != NULL) {
+		JDelete(slot->req);
+		slot->req = NULL;
+	}
+	slot->errstr = "request was cancelled " NOTEREQ_CANCELLED;
+	slot->cancelled = true;
+	slot->state = SLOT_DONE;
+	if (!dispatchPosted)
+		dispatchPosted = schedPost(noteReqDispatch, NULL);
+}
+
+// Cancel a request that has not yet been transmitted.  Returns false if it is already in flight
+// or complete.  Either way, its callback will still be called.
+bool noteRequestAsyncCancel(noteReqHandle handle) {
+	for (int i=0; i<queueCount; i++) {
+		noteReqSlot *slot = slotAt(i);
+		if (slot->handle != handle)
+			continue;
+		if (slot->state != SLOT_QUEUED)
+			return false;
+		noteReqCancelSlot(slot);
+		return true;
+	}
+	return false;
+}
+
+// Cancel every request that has not yet been transmitted, returning how many were cancelled.  The
+// request in flight, if any, is left to finish or time out.
+int noteRequestAsyncCancelAll() {
+	int cancelled = 0;
+	for (int i=0; i<queueCount; i++) {
+		noteReqSlot *slot = slotAt(i);
+		if (slot->state == SLOT_QUEUED) {
+			noteReqCancelSlot(slot);
+			cancelled++;
+		}
+	}
+	return cancelled;
+}
+
+// True if the response is the error given to a request that was cancelled
+bool noteRequestAsyncCancelled(J *rsp) {
+	return rsp != NULL && strstr(JGetString(rsp, "err"), NOTEREQ_CANCELLED) != NULL;
+}
+
+// True if there are no requests queued, in flight, or awaiting dispatch
+bool noteRequestAsyncIdle() {
+	return queueCount == 0;
+}
+
+// Get the throughput statistics, optionally resetting them
+void noteRequestAsyncStats(noteReqStats *out, bool reset) {
+	if (out != NULL)
+		*out = stats;
+	if (reset)
+		memset(&stats, 0, sizeof(stats));
+}
+
+// Report achieved requests per second, versus what the same requests would have achieved if each
+// had been serialized, transmitted, waited for and parsed strictly one after another
+void noteRequestAsyncReport() {
+	uint32_t activeMs = ticksToMs(stats.activeTicks);
+	uint32_t serialMs = ticksToMs(stats.serialTicks);
+	uint32_t pipelined = activeMs == 0 ? 0 : (uint32_t) (((uint64_t) stats.completed * 100000) / activeMs);
+	uint32_t serial = serialMs == 0 ? 0 : (uint32_t) (((uint64_t) stats.completed * 100000) / serialMs);
+	char buf[160];
+	snprintf(buf, sizeof(buf), "notereq: %lu completed (%lu failed), %lu cancelled, %lu.%02lu req/s pipelined vs %lu.%02lu req/s serial\n",
+			 (unsigned long) stats.completed, (unsigned long) stats.failed, (unsigned long) stats.cancelled,
+			 (unsigned long) (pipelined / 100), (unsigned long) (pipelined % 100),
+			 (unsigned long) (serial / 100), (unsigned long) (serial % 100));
+	NoteDebug(buf);
+}
+
+// Post the service routine unless it is already queued
+static void noteReqPost() {
+	if (servicePosted)
+		return;
+	servicePosted = schedPost(noteReqService, NULL);
+}
+
+// Poll timer handler, called at interrupt level
+static void timerPollHandler(void *context) {
+	noteReqPost();
+}
+
+// Start the next request, or poll for the response to the one in flight
+static void noteReqService(void *context) {
+	servicePosted = false;
+
+	// Pick up whatever portion of the response is available, and as soon as it is complete
+	// get the next request onto the wire before doing anything else with it
+	while (inFlight != NULL || noteReqStart()) {
+		bool done;
+		noteEnergyMark(&inFlight->energy, NOTEENERGY_RX);
+		const char *errstr = noteWirePoll(noteReqSink, NULL, &done);
+		if (errstr == NULL && !done && ticksToMs(ticksSince(inFlight->startTicks)) > NOTEREQ_TIMEOUT_MS) {
+			noteWireReset();
+			errstr = "request or response was lost";
+		}
+		noteEnergyMark(&inFlight->energy, NOTEENERGY_WAIT);
+		if (errstr == NULL && !done)
+			break;
+		noteReqFinish(inFlight, errstr);
+	}
+	if (inFlight == NULL)
+		return;
+
+	// Come back later
+	if (!timerCreated)
+		timerCreated = (app_timer_create(&timerPoll, APP_TIMER_MODE_SINGLE_SHOT, timerPollHandler) == NRF_SUCCESS);
+	if (!timerCreated || app_timer_start(timerPoll, APP_TIMER_TICKS(NOTEREQ_POLL_MS), NULL) != NRF_SUCCESS)
+		noteReqPost();
+
+}
+
+// Look a request up in the cache, completing it from there if it's a hit.  If it's a miss, begin
+// capturing its response so that it can be cached.
+static bool noteReqFromCache(noteReqSlot *slot) {
+	noteCacheKey key;
+	char reqType[NOTECACHE_REQ_MAX];
+	if (slot->req != NULL) {
+		noteCacheKeyJ(&key, slot->req);
+		strlcpy(reqType, JGetString(slot->req, "req"), sizeof(reqType));
+	} else if (slot->json != NULL) {
+		noteCacheKeyJSON(&key, slot->json);
+		noteCacheReqTypeJSON(slot->json, reqType, sizeof(reqType));
+	} else {
+		return false;
+	}
+	const uint8_t *cached;
+	size_t cachedLen;
+	if (!noteCacheLookup(&key, &cached, &cachedLen)) {
+		noteCacheBegin(&key, reqType, slot->ttlMs);
+		return false;
+	}
+
+	// Replay the response just as if it had come from the Notecard
+	const char *errstr = NULL;
+	if (slot->parser != NULL) {
+		noteParseReset(slot->parser);
+		noteParseSink(slot->parser, cached, cachedLen);
+	} else {
+		slot->rsp = JMalloc(cachedLen+1);
+		if (slot->rsp == NULL) {
+			errstr = "insufficient memory";
+		} else {
+			memcpy(slot->rsp, cached, cachedLen);
+			slot->rsp[cachedLen] = '\0';
+		}
+	}
+	if (slot->req != NULL) {
+		JDelete(slot->req);
+		slot->req = NULL;
+	}
+	noteReqFinish(slot, errstr);
+	return true;
+}
+
+// Streaming writer output, which goes straight to the transport
+static const char *noteReqOutput(void *context, const uint8_t *data, size_t len) {
+	noteReqSlot *slot = (noteReqSlot *) context;
+	noteEnergyMark(&slot->energy, NOTEENERGY_TX);
+	const char *errstr = noteWireTransmitChunk(data, len);
+	noteEnergyMark(&slot->energy, NOTEENERGY_BUILD);
+	if (errstr == NULL)
+		slot->txLen += len;
+	return errstr;
+}
+
+// Transmit the oldest request that hasn't yet been sent, returning true if it is now in flight
+static bool noteReqStart() {
+	for (int i=0; i<queueCount; i++) {
+		noteReqSlot *slot = slotAt(i);
+		if (slot->state != SLOT_QUEUED)
+			continue;
+		noteEnergyBegin(&slot->energy, NOTEENERGY_BUILD);
+		if (slot->ttlMs > 0 && noteReqFromCache(slot))
+			continue;
+		slot->startTicks = app_timer_cnt_get();
+		if (slot->parser != NULL)
+			noteParseReset(slot->parser);
+		noteWireTransmitBegin();
+		noteWriter w;
+		noteWriterBegin(&w, noteReqOutput, slot);
+		if (slot->req != NULL) {
+			noteWriterJ(&w, NULL, slot->req);
+			JDelete(slot->req);
+			slot->req = NULL;
+		} else if (slot->json != NULL) {
+			noteWriterRaw(&w, slot->json, strlen(slot->json));
+		} else if (slot->emit != NULL) {
+			slot->emit(&w, slot->emitContext);
+		}
+		noteWriterRaw(&w, "\n", 1);
+		const char *errstr = noteWriterEnd(&w);
+
+		// If the request failed part way through being sent, the Notecard holds part of a line, which
+		// would be joined to the next request.  Terminate it, and wait for the error that the Notecard
+		// returns for it so that it isn't taken as the response to the next request.  If even that
+		// can't be sent, the transport is reset.
+		if (errstr != NULL && slot->txLen > 0) {
+			if (noteWireTransmitChunk((const uint8_t *) "\n", 1) == NULL) {
+				slot->txErrstr = errstr;
+				errstr = NULL;
+			} else {
+				noteWireReset();
+			}
+		}
+		if (errstr != NULL) {
+			noteReqFinish(slot, errstr);
+			continue;
+		}
+		noteEnergyMark(&slot->energy, NOTEENERGY_WAIT);
+		slot->state = SLOT_IN_FLIGHT;
+		inFlight = slot;
+		rspLen = 0;
+		return true;
+	}
+	return false;
+}
+
+// Feed response data to the parser for a query, or else accumulate it into a buffer that grows
+// as needed
+static bool noteReqSinkData(const uint8_t *data, size_t len) {
+	if (inFlight != NULL && inFlight->txErrstr != NULL)
+		return true;
+	if (inFlight != NULL && inFlight->ttlMs > 0)
+		noteCacheAppend(data, len);
+	if (inFlight != NULL && inFlight->parser != NULL)
+		return noteParseSink(inFlight->parser, data, len);
+	if (inFlight != NULL && inFlight->sink != NULL)
+		return inFlight->sink(inFlight->sinkContext, data, len);
+	if (rspLen + len + 1 > rspAlloc) {
+		size_t newAlloc = rspAlloc == 0 ? 64 : rspAlloc;
+		while (rspLen + len + 1 > newAlloc)
+			newAlloc *= 2;
+		char *newBuffer = JMalloc(newAlloc);
+		if (newBuffer == NULL)
+			return false;
+		if (rspBuffer != NULL) {
+			memcpy(newBuffer, rspBuffer, rspLen);
+			JFree(rspBuffer);
+		}
+		rspBuffer = newBuffer;
+		rspAlloc = newAlloc;
+	}
+	memcpy(&rspBuffer[rspLen], data, len);
+	rspLen += len;
+	rspBuffer[rspLen] = '\0';
+	return true;
+}
+
+// Response data as it is received, whose handling is charged to the parse phase
+static bool noteReqSink(void *context, const uint8_t *data, size_t len) {
+	if (inFlight == NULL)
+		return noteReqSinkData(data, len);
+	noteEnergyMark(&inFlight->energy, NOTEENERGY_PARSE);
+	bool success = noteReqSinkData(data, len);
+	noteEnergyMark(&inFlight->energy, NOTEENERGY_RX);
+	return success;
+}
+
+// Mark a request as done, taking ownership of the response if it is the one in flight, and
+// defer the parsing of the response and the callback to the dispatcher
+static void noteReqFinish(noteReqSlot *slot, const char *errstr) {
+	noteEnergyMark(&slot->energy, NOTEENERGY_IDLE);
+	if (slot->txErrstr != NULL)
+		errstr = slot->txErrstr;
+	if (slot->ttlMs > 0)
+		noteCacheCommit(errstr == NULL);
+	if (slot == inFlight) {
+		slot->busyTicks += ticksSince(slot->startTicks);
+		inFlight = NULL;
+		if (errstr == NULL) {
+			slot->rsp = rspBuffer;
+			rspBuffer = NULL;
+			rspAlloc = 0;
+		} else if (rspBuffer != NULL) {
+			// A partial response is of no use, and holding it would keep the arena from being reclaimed
+			JFree(rspBuffer);
+			rspBuffer = NULL;
+			rspAlloc = 0;
+		}
+	}
+	slot->errstr = errstr;
+	slot->state = SLOT_DONE;
+	if (!dispatchPosted)
+		dispatchPosted = schedPost(noteReqDispatch, NULL);
+}
+
+// Deliver the response to a query, which has already been parsed
+static void noteReqDeliverQuery(noteReqSlot *slot) {
+	const char *errstr = slot->errstr;
+	if (errstr == NULL && (slot->parser->invalid || !slot->parser->done))
+		errstr = "unrecognized response from card";
+	if (errstr != NULL) {
+		if (!slot->cancelled)
+			stats.failed++;
+		strlcpy(slot->parser->err, errstr, sizeof(slot->parser->err));
+	}
+	if (slot->queryCallback != NULL)
+		slot->queryCallback(slot->handle, slot->parser, slot->context);
+}
+
+// Deliver the outcome of a request whose response has already been streamed to its sink
+static void noteReqDeliverStream(noteReqSlot *slot) {
+	if (slot->errstr != NULL && !slot->cancelled)
+		stats.failed++;
+	if (slot->streamCallback != NULL)
+		slot->streamCallback(slot->handle, slot->errstr, slot->context);
+}
+
+// Parse and deliver a response, or synthesize one describing the error
+static void noteReqDeliver(noteReqSlot *slot) {
+	J *rsp = NULL;
+	const char *errstr = slot->errstr;
+	if (errstr == NULL) {
+		rsp = slot->rsp == NULL ? NULL : JParse(slot->rsp);
+		if (rsp == NULL)
+			errstr = "unrecognized response from card";
+	}
+	if (slot->rsp != NULL)
+		JFree(slot->rsp);
+	if (errstr != NULL) {
+		if (!slot->cancelled)
+			stats.failed++;
+		rsp = JCreateObject();
+		if (rsp != NULL)
+			JAddStringToObject(rsp, "err", errstr);
+	}
+	if (slot->callback != NULL)
+		slot->callback(slot->handle, rsp, slot->context);
+	else if (rsp != NULL)
+		JDelete(rsp);
+}
+
+// Deliver the responses to completed requests, in submission order
+static void noteReqDispatch(void *context) {
+	dispatchPosted = false;
+	while (queueCount > 0 && slotAt(0)->state == SLOT_DONE) {
+		noteReqSlot slot = *slotAt(0);
+		queueHead = (queueHead + 1) % NOTEREQ_MAX_PENDING;
+		queueCount--;
+
+		// Deliver it.  The callback may submit another request, which would restart the timing of
+		// active time, so what this burst has taken so far is remembered first.
+		bool last = (queueCount == 0);
+		uint32_t activeSince = activeSinceTicks;
+		uint32_t began = app_timer_cnt_get();
+		noteEnergyMark(&slot.energy, NOTEENERGY_PARSE);
+		if (slot.parser != NULL)
+			noteReqDeliverQuery(&slot);
+		else if (slot.sink != NULL)
+			noteReqDeliverStream(&slot);
+		else
+			noteReqDeliver(&slot);
+
+		// Account for it, unless it never went anywhere near the Notecard
+		arenaEndTransaction();
+		if (slot.cancelled) {
+			stats.cancelled++;
+		} else {
+			noteEnergyEnd(&slot.energy);
+			stats.completed++;
+			stats.serialTicks += slot.busyTicks + ticksSince(began);
+		}
+		if (last) {
+			stats.activeTicks += ticksSince(activeSince);
+			if (queueCount != 0)
+				activeSinceTicks = app_timer_cnt_get();
+		}
+
+	}
+}
@@ -0,0 +1,70 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEREQ_H
+#define NOTEREQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "note.h"
+#include "notewriter.h"
+#include "noteparse.h"
+#include "notewire.h"
+
+// Maximum number of requests that may be queued or in flight at once
+#define NOTEREQ_MAX_PENDING		4
+
+// How often we look to see if the Notecard has a response ready, and how long we wait for one
+#define NOTEREQ_POLL_MS			20
+#define NOTEREQ_TIMEOUT_MS		(10*1000)
+
+// Tag in the error of a request that was cancelled rather than sent, in the style of the Notecard's own
+#define NOTEREQ_CANCELLED		"{cancelled}"
+
+// Handle to a submitted request, where 0 is never a valid handle
+typedef uint16_t noteReqHandle;
+
+// Completion callback, called in thread context from the scheduler.  Just as with the response to
+// NoteRequestResponse(), rsp is owned by the callback and must be freed with NoteDeleteResponse().
+// I/O failures are reported as a response containing an "err" field.  rsp is NULL only if there
+// was insufficient memory to report the result.
+typedef void (*noteReqCallback)(noteReqHandle handle, J *rsp, void *context);
+
+// Completion callback for queries, whose response has been fed through a streaming parser.  Any
+// error, whether from the Notecard or from I/O, is in parser->err, which is otherwise empty.
+typedef void (*noteReqQueryCallback)(noteReqHandle handle, noteParser *parser, void *context);
+
+// Completion callback for requests whose response has been streamed to a sink supplied by the caller.
+// errstr is NULL if the whole response was received, else it describes the I/O error.
+typedef void (*noteReqStreamCallback)(noteReqHandle handle, const char *errstr, void *context);
+
+// Writes the JSON of a request, without the terminating newline, at the moment it is transmitted
+typedef void (*noteReqEmitter)(noteWriter *w, void *context);
+
+// Throughput statistics, in RTC ticks.  serialTicks is the sum of the time that each request would
+// have taken on its own, from serialization through parsing and callback, whereas activeTicks is
+// the wall-clock time during which requests were actually outstanding.
+typedef struct {
+	uint32_t completed;
+	uint32_t failed;
+	uint32_t cancelled;
+	uint64_t serialTicks;
+	uint64_t activeTicks;
+} noteReqStats;
+
+noteReqHandle noteRequestAsync(J *req, noteReqCallback callback, void *context);
+noteReqHandle noteRequestAsyncCached(J *req, uint32_t ttlMs, noteReqCallback callback, void *context);
+noteReqHandle noteRequestAsyncJSON(const char *json, noteReqCallback callback, void *context);
+noteReqHandle noteRequestAsyncQuery(const char *json, noteParser *parser, noteReqQueryCallback callback, void *context);
+noteReqHandle noteRequestAsyncQueryCached(const char *json, noteParser *parser, uint32_t ttlMs, noteReqQueryCallback callback, void *context);
+noteReqHandle noteRequestAsyncEmit(noteReqEmitter emit, void *emitContext, noteReqCallback callback, void *context);
+noteReqHandle noteRequestAsyncStream(noteReqEmitter emit, void *emitContext, noteWireSink sink, void *sinkContext, noteReqStreamCallback callback, void *context);
+bool noteRequestAsyncCancel(noteReqHandle handle);
+int noteRequestAsyncCancelAll(void);
+bool noteRequestAsyncCancelled(J *rsp);
+bool noteRequestAsyncIdle(void);
+void noteRequestAsyncStats(noteReqStats *stats, bool reset);
+void noteRequestAsyncReport(void);
+
+#endif // NOTEREQ_H
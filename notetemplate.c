@@ -0,0 +1,198 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Notefile templates.  Once a template has been registered for a notefile, the Notecard stores each
+// note's body as a fixed-length binary record rather than as JSON, which makes it faster to store
+// and far smaller to send over the air.  The template is described once, as a table of typed
+// fields, and the note.template request is generated from that table so that the two can't drift
+// apart.  Outgoing bodies are checked against the same table, because the Notecard would otherwise
+// silently truncate values that don't fit the types in the template.
+
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "noteparse.h"
+#include "notetemplate.h"
+
+// Largest magnitude of each numeric type.  Integers are checked against their signed range.
+static const JNUMBER typeMax[] = {
+	[NOTETEMPLATE_INT8] = 127.0,
+	[NOTETEMPLATE_INT16] = 32767.0,
+	[NOTETEMPLATE_INT32] = 2147483647.0,
+	[NOTETEMPLATE_INT64] = 9223372036854775807.0,
+	[NOTETEMPLATE_FLOAT16] = 65504.0,
+	[NOTETEMPLATE_FLOAT32] = 3.4028234e38,
+};
+
+// The value in a template that denotes each type
+static const char *typeCode[] = {
+	[NOTETEMPLATE_INT8] = "11",
+	[NOTETEMPLATE_INT16] = "12",
+	[NOTETEMPLATE_INT32] = "14",
+	[NOTETEMPLATE_INT64] = "18",
+	[NOTETEMPLATE_FLOAT16] = "12.1",
+	[NOTETEMPLATE_FLOAT32] = "14.1",
+	[NOTETEMPLATE_FLOAT64] = "18.1",
+	[NOTETEMPLATE_BOOL] = "true",
+};
+
+// Description of the most recent validation failure
+static char errBuf[64];
+
+// Forwards
+static void noteTemplateEmit(noteWriter *w, void *context);
+static void noteTemplateDone(noteReqHandle handle, J *rsp, void *context);
+
+// Register the template with the Notecard.  This is asynchronous, and because requests are processed
+// in order it may be followed at once by notes for the notefile.  Returns 0 if the queue is full.
+noteReqHandle noteTemplateRegister(noteTemplate *t) {
+	return noteRequestAsyncEmit(noteTemplateEmit, t, noteTemplateDone, t);
+}
+
+// Record a validation failure
+static const char *noteTemplateReject(noteTemplate *t, const noteTemplateField *f, const char *problem) {
+	t->rejected++;
+	snprintf(errBuf, sizeof(errBuf), "template: %s %s", f->name, problem);
+	return errBuf;
+}
+
+// Check a numeric value against the type of its field
+static const char *noteTemplateCheckNumber(noteTemplate *t, const noteTemplateField *f, JNUMBER value) {
+	switch (f->type) {
+	case NOTETEMPLATE_INT8:
+	case NOTETEMPLATE_INT16:
+	case NOTETEMPLATE_INT32:
+	case NOTETEMPLATE_INT64:
+		if (value < -typeMax[f->type]-1 || value > typeMax[f->type])
+			return noteTemplateReject(t, f, "is out of range");
+		if ((JNUMBER) (int64_t) value != value)
+			return noteTemplateReject(t, f, "is not an integer");
+		return NULL;
+	case NOTETEMPLATE_FLOAT16:
+	case NOTETEMPLATE_FLOAT32:
+		if (value < -typeMax[f->type] || value > typeMax[f->type])
+			return noteTemplateReject(t, f, "is out of range");
+		return NULL;
+	case NOTETEMPLATE_FLOAT64:
+		return NULL;
+	case NOTETEMPLATE_BOOL:
+		if (value != 0 && value != 1)
+			return noteTemplateReject(t, f, "is not a boolean");
+		return NULL;
+	default:
+		return noteTemplateReject(t, f, "is not a string");
+	}
+}
+
+// Check a record held as a J object.  An error message is returned, else NULL if it fits the template.
+const char *noteTemplateCheckJ(noteTemplate *t, J *record) {
+	for (int i=0; i<t->fieldCount; i++) {
+		const noteTemplateField *f = &t->fields[i];
+		J *item = JGetObjectItem(record, f->name);
+		if (item == NULL)
+			return noteTemplateReject(t, f, "is missing");
+		const char *errstr = NULL;
+		switch (item->type & 0xff) {
+		case JNumber:
+			errstr = noteTemplateCheckNumber(t, f, item->valuenumber);
+			break;
+		case JTrue:
+		case JFalse:
+			if (f->type != NOTETEMPLATE_BOOL)
+				errstr = noteTemplateReject(t, f, "is a boolean");
+			break;
+		case JString:
+			if (f->type != NOTETEMPLATE_STRING)
+				errstr = noteTemplateReject(t, f, "is a string");
+			else if (strlen(item->valuestring) > f->maxLen)
+				errstr = noteTemplateReject(t, f, "is too long");
+			break;
+		default:
+			errstr = noteTemplateReject(t, f, "is not a scalar");
+			break;
+		}
+		if (errstr != NULL)
+			return errstr;
+	}
+	return NULL;
+}
+
+// Check a record held as JSON text, such as one that has been written into a batch, without using
+// the heap.  An error message is returned, else NULL if it fits the template.
+const char *noteTemplateCheckJSON(noteTemplate *t, const char *json, size_t len) {
+	static noteParseField fields[NOTETEMPLATE_MAX_FIELDS];
+	static char strings[NOTETEMPLATE_MAX_FIELDS][NOTETEMPLATE_STRING_MAX+2];
+	static noteParser parser;
+	if (t->fieldCount > NOTETEMPLATE_MAX_FIELDS)
+		return "template: too many fields";
+	for (int i=0; i<t->fieldCount; i++) {
+		const noteTemplateField *f = &t->fields[i];
+		memset(&fields[i], 0, sizeof(fields[i]));
+		fields[i].key = f->name;
+		if (f->type == NOTETEMPLATE_STRING) {
+			fields[i].type = NOTEPARSE_STRING;
+			fields[i].string = strings[i];
+			fields[i].stringMax = sizeof(strings[i]);
+		} else {
+			fields[i].type = (f->type == NOTETEMPLATE_BOOL) ? NOTEPARSE_BOOL : NOTEPARSE_NUMBER;
+		}
+	}
+	noteParseInit(&parser, fields, t->fieldCount);
+	noteParseSink(&parser, (const uint8_t *) json, len);
+	if (parser.invalid || !parser.done)
+		return "template: record is not a JSON object";
+	for (int i=0; i<t->fieldCount; i++) {
+		const noteTemplateField *f = &t->fields[i];
+		if (!fields[i].present)
+			return noteTemplateReject(t, f, "is missing or of the wrong type");
+		if (f->type == NOTETEMPLATE_STRING) {
+			if (strlen(strings[i]) > f->maxLen || f->maxLen > NOTETEMPLATE_STRING_MAX)
+				return noteTemplateReject(t, f, "is too long");
+			continue;
+		}
+		const char *errstr = noteTemplateCheckNumber(t, f, fields[i].number);
+		if (errstr != NULL)
+			return errstr;
+	}
+	return NULL;
+}
+
+// Write a record whose fields hold the type codes, which is how the Notecard is told the schema
+static void noteTemplateWriteRecord(const noteTemplate *t, noteWriter *w, const char *key) {
+	noteWriterObjectBegin(w, key);
+	for (int i=0; i<t->fieldCount; i++) {
+		const noteTemplateField *f = &t->fields[i];
+		if (f->type == NOTETEMPLATE_STRING) {
+			char maxLen[8];
+			snprintf(maxLen, sizeof(maxLen), "%u", f->maxLen);
+			noteWriterString(w, f->name, maxLen);
+		} else {
+			noteWriterRawValue(w, f->name, typeCode[f->type]);
+		}
+	}
+	noteWriterObjectEnd(w);
+}
+
+// Write the note.template request
+static void noteTemplateEmit(noteWriter *w, void *context) {
+	noteTemplate *t = (noteTemplate *) context;
+	noteWriterObjectBegin(w, NULL);
+	noteWriterString(w, "req", "note.template");
+	noteWriterString(w, "file", t->file);
+	noteTemplateWriteRecord(t, w, "body");
+	noteWriterObjectEnd(w);
+}
+
+// Completion of the note.template request.  If it failed, notes are still accepted by the Notecard,
+// but are stored and sent as JSON.
+static void noteTemplateDone(noteReqHandle handle, J *rsp, void *context) {
+	noteTemplate *t = (noteTemplate *) context;
+	if (rsp == NULL || NoteResponseError(rsp)) {
+		char buf[96];
+		snprintf(buf, sizeof(buf), "notetemplate: %s: %s\n", t->file, rsp == NULL ? "insufficient memory" : JGetString(rsp, "err"));
+		NoteDebug(buf);
+	}
+	if (rsp != NULL)
+		NoteDeleteResponse(rsp);
+}
@@ -0,0 +1,55 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTETEMPLATE_H
+#define NOTETEMPLATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+#include "notereq.h"
+#include "notewriter.h"
+
+// Limits on a template
+#define NOTETEMPLATE_MAX_FIELDS		8
+#define NOTETEMPLATE_STRING_MAX		30
+
+// Type of a field, each of which is stored by the Notecard in a fixed binary encoding
+typedef enum {
+	NOTETEMPLATE_INT8,
+	NOTETEMPLATE_INT16,
+	NOTETEMPLATE_INT32,
+	NOTETEMPLATE_INT64,
+	NOTETEMPLATE_FLOAT16,
+	NOTETEMPLATE_FLOAT32,
+	NOTETEMPLATE_FLOAT64,
+	NOTETEMPLATE_BOOL,
+	NOTETEMPLATE_STRING
+} noteTemplateType;
+
+// A field of the body.  For strings, maxLen is the longest value that may be stored.
+typedef struct {
+	const char *name;
+	noteTemplateType type;
+	uint8_t maxLen;
+} noteTemplateField;
+
+// The schema of the body of the notes in a notefile, which is the single definition from which
+// both the note.template request and the validation of outgoing bodies are derived.  A Notecard
+// template describes one fixed-length flat record, so a template may only be registered for a
+// notefile to which each note is added on its own.  The same schema may still be used just to
+// check the records that a batch carries in an array.
+typedef struct {
+	const char *file;
+	const noteTemplateField *fields;
+	uint8_t fieldCount;
+	uint32_t rejected;
+} noteTemplate;
+
+noteReqHandle noteTemplateRegister(noteTemplate *t);
+const char *noteTemplateCheckJ(noteTemplate *t, J *record);
+const char *noteTemplateCheckJSON(noteTemplate *t, const char *json, size_t len);
+
+#endif // NOTETEMPLATE_H
@@ -0,0 +1,205 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Deferred trace of Notecard I/O.  Rather than writing debug output synchronously as it happens,
+// which over SWD stalls a transaction for milliseconds per line, each event is recorded in binary into
+// a ring: its kind, the RTC counter, its length, and the first few bytes of its data.  Recording takes
+// a slot with a compare-and-swap on the head and publishes it by writing the slot's sequence number
+// last, so it may be done from thread context or from any interrupt priority without locking.  If
+// the ring is full the new event is dropped and counted.  The ring is drained from idle by a single
+// consumer, either formatted as text to an output function, or read in binary by a host tool.
+//
+// note-c's debug output, which includes the reports of every module, is text whose whole length
+// matters, so rather than being captured as events it is copied into a separate ring of bytes.  It
+// is only ever written from thread context, so that ring needs no locking, and messages that don't
+// fit are dropped whole and counted.
+
+#include <stdio.h>
+#include <string.h>
+#include "notetrace.h"
+#include "app_timer.h"
+
+// The ring, in which head is the next slot to be taken by a producer and tail the next to be read
+static noteTraceEvent ring[NOTETRACE_EVENTS];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+static noteTraceStats stats;
+
+// Serial input arrives a byte at a time, so it is gathered into one event per line
+static uint8_t rxLine[NOTETRACE_PAYLOAD];
+static size_t rxLineLen = 0;
+static size_t rxLineTotal = 0;
+
+// The ring of debug text, in which textHead and textTail are free-running byte counts
+static char text[NOTETRACE_TEXT_SIZE];
+static uint32_t textHead = 0;
+static uint32_t textTail = 0;
+static uint32_t reportedTextDropped = 0;
+
+// Drain state
+static noteTraceOutput traceOutput = NULL;
+static uint32_t lastTicks = 0;
+static uint32_t reportedDropped = 0;
+
+// Record an event of the specified length, of which only the bytes at data are captured
+static void traceRecord(noteTraceType type, const void *data, size_t captured, size_t len) {
+	uint32_t ticks = app_timer_cnt_get();
+
+	// Take a slot, unless the ring is full
+	uint32_t slot = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	do {
+		if (slot - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= NOTETRACE_EVENTS) {
+			__atomic_fetch_add(&stats.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&head, &slot, slot+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	// Fill it in, and publish it
+	noteTraceEvent *e = &ring[slot & (NOTETRACE_EVENTS-1)];
+	size_t count = captured < NOTETRACE_PAYLOAD ? captured : NOTETRACE_PAYLOAD;
+	e->ticks = ticks;
+	e->len = len > UINT16_MAX ? UINT16_MAX : (uint16_t) len;
+	e->type = (uint8_t) type;
+	e->count = (uint8_t) count;
+	if (count > 0)
+		memcpy(e->data, data, count);
+	__atomic_store_n(&e->seq, slot+1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&stats.recorded, 1, __ATOMIC_RELAXED);
+}
+
+// Record an event
+void noteTraceRecord(noteTraceType type, const void *data, size_t len) {
+	traceRecord(type, data, len, len);
+}
+
+// Record a byte of serial input, which is called only from thread context
+void noteTraceReceiveByte(uint8_t byte) {
+	if (rxLineLen < sizeof(rxLine))
+		rxLine[rxLineLen++] = byte;
+	rxLineTotal++;
+	if (byte != '\n')
+		return;
+	traceRecord(NOTETRACE_RX, rxLine, rxLineLen, rxLineTotal);
+	rxLineLen = 0;
+	rxLineTotal = 0;
+}
+
+// Debug output hook for note-c, which copies the message into the text ring rather than writing it
+size_t noteTraceDebug(const char *message) {
+	size_t len = strlen(message);
+	if (len > NOTETRACE_TEXT_SIZE - (textHead - textTail)) {
+		stats.textDropped++;
+		return len;
+	}
+	for (size_t i=0; i<len; i++)
+		text[(textHead + i) & (NOTETRACE_TEXT_SIZE-1)] = message[i];
+	textHead += len;
+	return len;
+}
+
+// Write the next line of debug text, returning false if there is no more
+static bool noteTraceDrainText() {
+	if (textTail == textHead)
+		return false;
+	char line[NOTETRACE_TEXT_LINE_MAX+1];
+	size_t n = 0;
+	while (textTail != textHead && n < NOTETRACE_TEXT_LINE_MAX) {
+		char ch = text[textTail++ & (NOTETRACE_TEXT_SIZE-1)];
+		line[n++] = ch;
+		if (ch == '\n')
+			break;
+	}
+	line[n] = '\0';
+	traceOutput(line);
+	return true;
+}
+
+// Read the oldest event from the ring, returning false if there are none ready
+bool noteTraceRead(noteTraceEvent *event) {
+	uint32_t slot = tail;
+	if (slot == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+		return false;
+
+	// A producer that was preempted may have taken the slot without yet having published it
+	noteTraceEvent *e = &ring[slot & (NOTETRACE_EVENTS-1)];
+	if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != slot+1)
+		return false;
+	*event = *e;
+	__atomic_store_n(&tail, slot+1, __ATOMIC_RELEASE);
+	stats.drained++;
+	return true;
+}
+
+// Set the function to which trace lines are written when the ring is drained
+void noteTraceSetOutput(noteTraceOutput output) {
+	traceOutput = output;
+}
+
+// Drain some events from the ring, formatting them as text.  This is called when idle, and returns
+// true if there are more events still to be drained.
+bool noteTraceDrain() {
+	if (traceOutput == NULL)
+		return false;
+	static const char *const types[] = { "?", "tx", "rx", "reset", "error" };
+	bool more = true;
+	for (int i=0; more && i<NOTETRACE_DRAIN_MAX; i++) {
+		noteTraceEvent e;
+		more = noteTraceRead(&e);
+		if (!more)
+			break;
+
+		// Time since the previous event, with the 24-bit RTC counter taken into account
+		uint32_t ticks = app_timer_cnt_diff_compute(e.ticks, lastTicks);
+		uint32_t us = (uint32_t) (((uint64_t) ticks * 1000000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)) / APP_TIMER_CLOCK_FREQ);
+		lastTicks = e.ticks;
+
+		// The captured data, with anything unprintable shown as a dot
+		char data[NOTETRACE_PAYLOAD+1];
+		size_t n = 0;
+		for (size_t j=0; j<e.count; j++) {
+			uint8_t ch = e.data[j];
+			if (ch == '\n' && j+1 == e.count && e.count == e.len)
+				break;
+			data[n++] = (ch >= ' ' && ch < 0x7f) ? (char) ch : '.';
+		}
+		data[n] = '\0';
+
+		char line[80];
+		snprintf(line, sizeof(line), "trace: +%luus %s %u%s%s%s\n", (unsigned long) us,
+				 e.type < sizeof(types)/sizeof(types[0]) ? types[e.type] : types[0],
+				 e.len, n > 0 ? " " : "", data, e.count < e.len ? "..." : "");
+		traceOutput(line);
+	}
+
+	// Then the debug text, a line at a time
+	bool moreText = true;
+	for (int i=0; moreText && i<NOTETRACE_DRAIN_MAX; i++)
+		moreText = noteTraceDrainText();
+
+	// Say when events or text have been lost
+	uint32_t dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+	if (dropped != reportedDropped) {
+		char line[48];
+		snprintf(line, sizeof(line), "trace: %lu events dropped\n", (unsigned long) (dropped - reportedDropped));
+		reportedDropped = dropped;
+		traceOutput(line);
+	}
+	if (stats.textDropped != reportedTextDropped) {
+		char line[48];
+		snprintf(line, sizeof(line), "trace: %lu debug messages dropped\n", (unsigned long) (stats.textDropped - reportedTextDropped));
+		reportedTextDropped = stats.textDropped;
+		traceOutput(line);
+	}
+	return more || moreText;
+}
+
+// Get the trace statistics
+void noteTraceGetStats(noteTraceStats *s, bool reset) {
+	*s = stats;
+	if (reset) {
+		memset(&stats, 0, sizeof(stats));
+		reportedDropped = 0;
+		reportedTextDropped = 0;
+	}
+}
@@ -0,0 +1,63 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTETRACE_H
+#define NOTETRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of events that the ring holds, which must be a power of two, and the number of payload bytes
+// captured with each event.  The two together make each event 32 bytes.
+#define NOTETRACE_EVENTS			64
+#define NOTETRACE_PAYLOAD			20
+
+// Size of the separate ring that holds note-c's debug output, which is text of any length and so is
+// kept whole rather than being captured as events
+#define NOTETRACE_TEXT_SIZE			4096
+#define NOTETRACE_TEXT_LINE_MAX		128
+
+// Maximum number of events and of text lines written each time the rings are drained, so that a
+// burst of trace output never delays the scheduler for long
+#define NOTETRACE_DRAIN_MAX			8
+
+// Kinds of event
+typedef enum {
+	NOTETRACE_TX = 1,
+	NOTETRACE_RX,
+	NOTETRACE_RESET,
+	NOTETRACE_ERROR,
+} noteTraceType;
+
+// A recorded event.  len is the full length of the data, of which only the first count bytes were
+// captured.  ticks is the RTC counter at the time of the event.
+typedef struct {
+	uint32_t seq;
+	uint32_t ticks;
+	uint16_t len;
+	uint8_t type;
+	uint8_t count;
+	uint8_t data[NOTETRACE_PAYLOAD];
+} noteTraceEvent;
+
+// Where formatted trace lines are written when the ring is drained
+typedef void (*noteTraceOutput)(const char *text);
+
+typedef struct {
+	uint32_t recorded;
+	uint32_t dropped;
+	uint32_t drained;
+	uint32_t textDropped;
+} noteTraceStats;
+
+void noteTraceRecord(noteTraceType type, const void *data, size_t len);
+void noteTraceReceiveByte(uint8_t byte);
+size_t noteTraceDebug(const char *message);
+bool noteTraceRead(noteTraceEvent *event);
+void noteTraceSetOutput(noteTraceOutput output);
+bool noteTraceDrain(void);
+void noteTraceGetStats(noteTraceStats *stats, bool reset);
+
+#endif // NOTETRACE_H
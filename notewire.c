@@ -0,0 +1,139 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Split-phase access to the Notecard wire protocol, on top of the same I2C and serial functions
+// that are registered with note-c.  Unlike note-c's transactions, which block until the response
+// has been fully received, the receive side here is a non-blocking poll that only reads the bytes
+// the Notecard has ready, so that the caller can do other work while the Notecard is processing.
+
+#include <string.h>
+#include "main.h"
+#include "note.h"
+#include "notewire.h"
+
+// Data used for wire I/O
+static bool resetRequired = true;
+static size_t sentInSegment = 0;
+#if NOTECARD_USE_I2C
+static uint8_t rxChunk[NOTE_I2C_MAX_DEFAULT];
+#else
+static uint8_t rxChunk[32];
+#endif
+
+// Forwards
+static const char *noteWireReceive(noteWireSink sink, void *context, bool *done);
+static bool noteWireDiscard(void *context, const uint8_t *data, size_t len);
+
+// Force the transport to be reset before the next I/O, which is done after any I/O error
+void noteWireReset() {
+	resetRequired = true;
+}
+
+// Reset the transport if required, discarding anything that the Notecard may have left pending
+static void noteWireResetIfRequired() {
+	if (!resetRequired)
+		return;
+	resetRequired = false;
+#if NOTECARD_USE_I2C
+	noteI2CReset(NOTE_I2C_ADDR_DEFAULT);
+#else
+	noteSerialReset();
+#endif
+	bool done;
+	noteWireReceive(noteWireDiscard, NULL, &done);
+}
+
+// Sink used to drain stale input
+static bool noteWireDiscard(void *context, const uint8_t *data, size_t len) {
+	return true;
+}
+
+// Begin transmitting a new request
+void noteWireTransmitBegin() {
+	noteWireResetIfRequired();
+	sentInSegment = 0;
+}
+
+// Transmit part of a request, pacing the output in segments.  The caller is responsible for
+// terminating the request with a newline.  An error message is returned, else NULL if success.
+const char *noteWireTransmitChunk(const uint8_t *data, size_t len) {
+	while (len > 0) {
+		size_t chunklen = len;
+		if (chunklen > NOTEWIRE_SEGMENT_MAX_LEN - sentInSegment)
+			chunklen = NOTEWIRE_SEGMENT_MAX_LEN - sentInSegment;
+#if NOTECARD_USE_I2C
+		if (chunklen > NOTE_I2C_MAX_DEFAULT)
+			chunklen = NOTE_I2C_MAX_DEFAULT;
+		const char *errstr = noteI2CTransmit(NOTE_I2C_ADDR_DEFAULT, (uint8_t *) data, chunklen);
+		if (errstr != NULL) {
+			resetRequired = true;
+			return errstr;
+		}
+#else
+		noteSerialTransmit((uint8_t *) data, chunklen, true);
+#endif
+		data += chunklen;
+		len -= chunklen;
+		sentInSegment += chunklen;
+		if (sentInSegment >= NOTEWIRE_SEGMENT_MAX_LEN) {
+			sentInSegment = 0;
+			delay(NOTEWIRE_SEGMENT_DELAY_MS);
+		}
+	}
+	return NULL;
+}
+
+// Transmit a complete request in one call
+const char *noteWireTransmit(const uint8_t *data, size_t len) {
+	noteWireTransmitBegin();
+	return noteWireTransmitChunk(data, len);
+}
+
+// Poll for response data, passing whatever is available to the sink without waiting for more.
+// done is set when the terminating newline has been received.  An error message is returned,
+// else NULL if success.
+const char *noteWirePoll(noteWireSink sink, void *context, bool *done) {
+	const char *errstr = noteWireReceive(sink, context, done);
+	if (errstr != NULL)
+		resetRequired = true;
+	return errstr;
+}
+
+// Read everything that the Notecard currently has available
+static const char *noteWireReceive(noteWireSink sink, void *context, bool *done) {
+	*done = false;
+#if NOTECARD_USE_I2C
+	uint32_t available = 0;
+	const char *errstr = noteI2CReceive(NOTE_I2C_ADDR_DEFAULT, rxChunk, 0, &available);
+	while (errstr == NULL && available > 0) {
+		uint16_t chunklen = available > sizeof(rxChunk) ? sizeof(rxChunk) : (uint16_t) available;
+		errstr = noteI2CReceive(NOTE_I2C_ADDR_DEFAULT, rxChunk, chunklen, &available);
+		if (errstr != NULL)
+			break;
+		if (!sink(context, rxChunk, chunklen))
+			return "wire: response rejected";
+		if (rxChunk[chunklen-1] == '\n') {
+			*done = true;
+			break;
+		}
+	}
+	return errstr;
+#else
+	size_t len = 0;
+	while (!*done && noteSerialAvailable()) {
+		char ch = noteSerialReceive();
+		rxChunk[len++] = (uint8_t) ch;
+		if (ch == '\n')
+			*done = true;
+		if (*done || len == sizeof(rxChunk)) {
+			if (!sink(context, rxChunk, len))
+				return "wire: response rejected";
+			len = 0;
+		}
+	}
+	if (len > 0 && !sink(context, rxChunk, len))
+		return "wire: response rejected";
+	return NULL;
+#endif
+}
@@ -0,0 +1,26 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEWIRE_H
+#define NOTEWIRE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// The Notecard's input buffers must not be overrun, so requests are sent in segments with a pause
+// between them, in the same way that note-c does it.
+#define NOTEWIRE_SEGMENT_MAX_LEN		250
+#define NOTEWIRE_SEGMENT_DELAY_MS		250
+
+// Receives response bytes incrementally as they arrive from the Notecard, returning false to abort
+typedef bool (*noteWireSink)(void *context, const uint8_t *data, size_t len);
+
+void noteWireReset(void);
+void noteWireTransmitBegin(void);
+const char *noteWireTransmitChunk(const uint8_t *data, size_t len);
+const char *noteWireTransmit(const uint8_t *data, size_t len);
+const char *noteWirePoll(noteWireSink sink, void *context, bool *done);
+
+#endif // NOTEWIRE_H
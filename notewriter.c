@@ -0,0 +1,209 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Streaming JSON writer.  Tokens are formatted into a small fixed buffer that is handed to an
+// output function each time it fills, so when the output is the Notecard transport, a request of
+// any size is sent without its serialized form ever existing in memory and without using the heap.
+
+#include <stdio.h>
+#include <string.h>
+#include "notewriter.h"
+
+// Begin writing
+void noteWriterBegin(noteWriter *w, noteWriterOutput output, void *context) {
+	memset(w, 0, sizeof(noteWriter));
+	w->output = output;
+	w->context = context;
+}
+
+// Hand the buffered text to the output function
+static void noteWriterFlush(noteWriter *w) {
+	if (w->len == 0)
+		return;
+	if (w->errstr == NULL)
+		w->errstr = w->output(w->context, w->buf, w->len);
+	w->len = 0;
+}
+
+// Append text to the buffer, flushing as it fills
+static void noteWriterPut(noteWriter *w, const char *text, size_t len) {
+	w->total += len;
+	while (len > 0) {
+		size_t n = sizeof(w->buf) - w->len;
+		if (n > len)
+			n = len;
+		memcpy(&w->buf[w->len], text, n);
+		w->len += n;
+		text += n;
+		len -= n;
+		if (w->len == sizeof(w->buf))
+			noteWriterFlush(w);
+	}
+}
+
+// Append a string, quoted and escaped
+static void noteWriterQuoted(noteWriter *w, const char *s) {
+	noteWriterPut(w, "\"", 1);
+	while (*s != '\0') {
+		const char *run = s;
+		while (*s != '\0' && *s != '"' && *s != '\\' && (uint8_t) *s >= 0x20)
+			s++;
+		noteWriterPut(w, run, s - run);
+		if (*s == '\0')
+			break;
+		char esc[8];
+		switch (*s) {
+		case '"': strcpy(esc, "\\\""); break;
+		case '\\': strcpy(esc, "\\\\"); break;
+		case '\b': strcpy(esc, "\\b"); break;
+		case '\f': strcpy(esc, "\\f"); break;
+		case '\n': strcpy(esc, "\\n"); break;
+		case '\r': strcpy(esc, "\\r"); break;
+		case '\t': strcpy(esc, "\\t"); break;
+		default: snprintf(esc, sizeof(esc), "\\u%04x", (uint8_t) *s); break;
+		}
+		noteWriterPut(w, esc, strlen(esc));
+		s++;
+	}
+	noteWriterPut(w, "\"", 1);
+}
+
+// Begin a value, emitting the separator and key that precede it
+static void noteWriterValue(noteWriter *w, const char *key) {
+	uint32_t bit = 1UL << w->depth;
+	if (w->hasItems & bit)
+		noteWriterPut(w, ",", 1);
+	w->hasItems |= bit;
+	if (key != NULL) {
+		noteWriterQuoted(w, key);
+		noteWriterPut(w, ":", 1);
+	}
+}
+
+// Open a container
+static void noteWriterOpen(noteWriter *w, const char *key, const char *bracket) {
+	noteWriterValue(w, key);
+	noteWriterPut(w, bracket, 1);
+	if (w->depth+1 >= NOTEWRITER_MAX_DEPTH) {
+		if (w->errstr == NULL)
+			w->errstr = "writer: nested too deeply";
+		return;
+	}
+	w->depth++;
+	w->hasItems &= ~(1UL << w->depth);
+}
+
+// Close a container
+static void noteWriterClose(noteWriter *w, const char *bracket) {
+	if (w->depth > 0)
+		w->depth--;
+	noteWriterPut(w, bracket, 1);
+}
+
+// Finish writing, flushing anything buffered.  An error message is returned, else NULL if success.
+const char *noteWriterEnd(noteWriter *w) {
+	noteWriterFlush(w);
+	return w->errstr;
+}
+
+// Begin an object, where key is NULL at the top level or within an array
+void noteWriterObjectBegin(noteWriter *w, const char *key) {
+	noteWriterOpen(w, key, "{");
+}
+
+// End an object
+void noteWriterObjectEnd(noteWriter *w) {
+	noteWriterClose(w, "}");
+}
+
+// Begin an array
+void noteWriterArrayBegin(noteWriter *w, const char *key) {
+	noteWriterOpen(w, key, "[");
+}
+
+// End an array
+void noteWriterArrayEnd(noteWriter *w) {
+	noteWriterClose(w, "]");
+}
+
+// Write a string value
+void noteWriterString(noteWriter *w, const char *key, const char *value) {
+	noteWriterValue(w, key);
+	noteWriterQuoted(w, value == NULL ? "" : value);
+}
+
+// Write a number value
+void noteWriterNumber(noteWriter *w, const char *key, JNUMBER value) {
+	char text[JNTOA_MAX];
+	noteWriterValue(w, key);
+	JNtoA(value, text, -1);
+	noteWriterPut(w, text, strlen(text));
+}
+
+// Write an integer value, which is cheaper than formatting it as a JNUMBER
+void noteWriterInt(noteWriter *w, const char *key, long value) {
+	char text[24];
+	noteWriterValue(w, key);
+	snprintf(text, sizeof(text), "%ld", value);
+	noteWriterPut(w, text, strlen(text));
+}
+
+// Write a boolean value
+void noteWriterBool(noteWriter *w, const char *key, bool value) {
+	noteWriterValue(w, key);
+	if (value)
+		noteWriterPut(w, "true", 4);
+	else
+		noteWriterPut(w, "false", 5);
+}
+
+// Write a null value
+void noteWriterNull(noteWriter *w, const char *key) {
+	noteWriterValue(w, key);
+	noteWriterPut(w, "null", 4);
+}
+
+// Write a J item, including everything within it
+void noteWriterJ(noteWriter *w, const char *key, J *item) {
+	if (item == NULL)
+		return;
+	switch (item->type & 0xff) {
+	case JObject:
+	case JArray:
+		noteWriterOpen(w, key, (item->type & JObject) ? "{" : "[");
+		for (J *child = item->child; child != NULL; child = child->next)
+			noteWriterJ(w, (item->type & JObject) ? child->string : NULL, child);
+		noteWriterClose(w, (item->type & JObject) ? "}" : "]");
+		break;
+	case JString:
+		noteWriterString(w, key, item->valuestring);
+		break;
+	case JNumber:
+		noteWriterNumber(w, key, item->valuenumber);
+		break;
+	case JTrue:
+	case JFalse:
+		noteWriterBool(w, key, (item->type & JTrue) != 0);
+		break;
+	case JRaw:
+		noteWriterValue(w, key);
+		if (item->valuestring != NULL)
+			noteWriterPut(w, item->valuestring, strlen(item->valuestring));
+		break;
+	default:
+		noteWriterNull(w, key);
+		break;
+	}
+}
+
+// Write text that is already formatted as JSON, such as a prepared request
+void noteWriterRaw(noteWriter *w, const char *text, size_t len) {
+	noteWriterPut(w, text, len);
+}
+
+// Write a value that is already formatted as JSON, such as a number that must appear exactly as given
+void noteWriterRawValue(noteWriter *w, const char *key, const char *text) {
+	noteWriterValue(w, key);
+	noteWriterPut(w, text, strlen(text));
+}
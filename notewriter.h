@@ -0,0 +1,51 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef NOTEWRITER_H
+#define NOTEWRITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "note.h"
+
+// Size of the writer's buffer, which is the largest unit handed to the output function.  When
+// writing to the Notecard over I2C, this is one I2C transfer.
+#define NOTEWRITER_CHUNK_LEN	NOTE_I2C_MAX_DEFAULT
+
+// Maximum nesting of objects and arrays
+#define NOTEWRITER_MAX_DEPTH	16
+
+// Destination for chunks of JSON text.  An error message is returned, else NULL if success.
+typedef const char *(*noteWriterOutput)(void *context, const uint8_t *data, size_t len);
+
+// A streaming JSON writer.  Errors are sticky, so a sequence of calls can be made without checking
+// each one, and the first error is returned by noteWriterEnd().
+typedef struct {
+	noteWriterOutput output;
+	void *context;
+	uint8_t buf[NOTEWRITER_CHUNK_LEN];
+	size_t len;
+	size_t total;
+	uint8_t depth;
+	uint32_t hasItems;
+	const char *errstr;
+} noteWriter;
+
+void noteWriterBegin(noteWriter *w, noteWriterOutput output, void *context);
+const char *noteWriterEnd(noteWriter *w);
+void noteWriterObjectBegin(noteWriter *w, const char *key);
+void noteWriterObjectEnd(noteWriter *w);
+void noteWriterArrayBegin(noteWriter *w, const char *key);
+void noteWriterArrayEnd(noteWriter *w);
+void noteWriterString(noteWriter *w, const char *key, const char *value);
+void noteWriterNumber(noteWriter *w, const char *key, JNUMBER value);
+void noteWriterInt(noteWriter *w, const char *key, long value);
+void noteWriterBool(noteWriter *w, const char *key, bool value);
+void noteWriterNull(noteWriter *w, const char *key);
+void noteWriterJ(noteWriter *w, const char *key, J *item);
+void noteWriterRaw(noteWriter *w, const char *text, size_t len);
+void noteWriterRawValue(noteWriter *w, const char *key, const char *text);
+
+#endif // NOTEWRITER_H
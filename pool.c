@@ -0,0 +1,106 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Fixed-size block pools for note-c allocations, built on nrf_balloc.  Nearly every allocation
+// made while building or parsing JSON is either a J node or a short string, so each allocation is
+// routed to the smallest size class that fits it, where allocation and free are O(1) and can't
+// fragment.  Only allocations of unusual size, or those made when a pool is exhausted, fall back
+// to the per-transaction arena.
+
+#include <stdio.h>
+#include "pool.h"
+#include "arena.h"
+#include "note.h"
+#include "nrf_balloc.h"
+
+// The pools
+NRF_BALLOC_DEF(poolSmall, POOL_SMALL_SIZE, POOL_SMALL_COUNT);
+NRF_BALLOC_DEF(poolNode, sizeof(J), POOL_NODE_COUNT);
+
+// Size classes, in increasing order of block size
+typedef struct {
+	const nrf_balloc_t *pool;
+	poolClassStats stats;
+} poolClass;
+static poolClass classes[] = {
+	{ .pool = &poolSmall, .stats = { .blockSize = POOL_SMALL_SIZE, .blocks = POOL_SMALL_COUNT } },
+	{ .pool = &poolNode, .stats = { .blockSize = sizeof(J), .blocks = POOL_NODE_COUNT } },
+};
+#define POOL_CLASSES (sizeof(classes) / sizeof(classes[0]))
+static uint32_t fallbacks = 0;
+
+// Initialize the pools
+void poolInit() {
+	for (size_t i=0; i<POOL_CLASSES; i++)
+		nrf_balloc_init(classes[i].pool);
+}
+
+// True if a pointer lies within a pool's memory
+static bool poolContains(const poolClass *c, void *p) {
+	uint8_t *begin = (uint8_t *) c->pool->p_memory_begin;
+	uint8_t *end = begin + ((size_t) c->pool->block_size * c->stats.blocks);
+	return (uint8_t *) p >= begin && (uint8_t *) p < end;
+}
+
+// Allocate from the smallest size class that fits, falling back to the arena
+void *poolMalloc(size_t size) {
+	for (size_t i=0; i<POOL_CLASSES; i++) {
+		poolClass *c = &classes[i];
+		if (size > c->stats.blockSize)
+			continue;
+		void *p = nrf_balloc_alloc(c->pool);
+		if (p == NULL) {
+			c->stats.exhausted++;
+			continue;
+		}
+		c->stats.allocs++;
+		if (++c->stats.inUse > c->stats.highWater)
+			c->stats.highWater = c->stats.inUse;
+		return p;
+	}
+	fallbacks++;
+	return arenaMalloc(size);
+}
+
+// Free to whichever pool the block came from, or to the arena
+void poolFree(void *p) {
+	if (p == NULL)
+		return;
+	for (size_t i=0; i<POOL_CLASSES; i++) {
+		poolClass *c = &classes[i];
+		if (poolContains(c, p)) {
+			nrf_balloc_free(c->pool, p);
+			c->stats.inUse--;
+			return;
+		}
+	}
+	arenaFree(p);
+}
+
+// Get the statistics for a size class, returning false if there is no such class
+bool poolGetStats(int sizeClass, poolClassStats *stats) {
+	if (sizeClass < 0 || sizeClass >= (int) POOL_CLASSES)
+		return false;
+	*stats = classes[sizeClass].stats;
+	return true;
+}
+
+// Get the number of allocations that weren't satisfied by a pool
+uint32_t poolFallbacks() {
+	return fallbacks;
+}
+
+// Report pool utilization and high-water marks
+void poolReport() {
+	char buf[128];
+	for (size_t i=0; i<POOL_CLASSES; i++) {
+		poolClassStats *s = &classes[i].stats;
+		snprintf(buf, sizeof(buf), "pool %u: %u/%u in use, high water %u, %lu allocs, %lu exhausted\n",
+				 (unsigned) s->blockSize, s->inUse, s->blocks, s->highWater,
+				 (unsigned long) s->allocs, (unsigned long) s->exhausted);
+		NoteDebug(buf);
+	}
+	snprintf(buf, sizeof(buf), "pool: %lu allocations fell back to the arena\n", (unsigned long) fallbacks);
+	NoteDebug(buf);
+}
@@ -0,0 +1,35 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Block pools, one per size class.  The node class is exactly the size of a J item, and the small
+// class catches the short key and value strings that accompany most nodes.
+#define POOL_SMALL_SIZE		16
+#define POOL_SMALL_COUNT	32
+#define POOL_NODE_COUNT		32
+
+// Statistics for one size class
+typedef struct {
+	size_t blockSize;
+	uint16_t blocks;
+	uint16_t inUse;
+	uint16_t highWater;
+	uint32_t allocs;
+	uint32_t exhausted;
+} poolClassStats;
+
+void poolInit(void);
+void *poolMalloc(size_t size);
+void poolFree(void *p);
+bool poolGetStats(int sizeClass, poolClassStats *stats);
+uint32_t poolFallbacks(void);
+void poolReport(void);
+
+#endif // POOL_H
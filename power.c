@@ -0,0 +1,167 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Power management.  The DCDC regulator is enabled on boards that have its inductor fitted, which
+// roughly halves the current drawn while the CPU is running.  Every idle wait in the firmware goes
+// through powerSleep(), which sleeps in System ON through nrf_pwr_mgmt, and which keeps account of how
+// long was spent asleep and awake.  The high-frequency crystal is only requested while the transport
+// to the Notecard needs it, and released when the transport goes idle.  From the time spent in each
+// state and the current that each is estimated to draw, the average current and the energy consumed
+// are estimated, so that the cost of sending a note can be measured.
+
+#include <stdio.h>
+#include <string.h>
+#include "note.h"
+#include "power.h"
+#include "app_timer.h"
+#include "nrf_pwr_mgmt.h"
+#include "nrf_drv_power.h"
+#include "nrf_drv_clock.h"
+#include "boards.h"
+
+static powerStats stats;
+static uint32_t lastTicks;
+
+// Crystal state
+static volatile bool hfxoHeld = false;
+static uint32_t hfxoSinceTicks;
+static volatile uint32_t transportTicks;
+APP_TIMER_DEF(timerHfxo);
+static bool timerCreated = false;
+
+// Ticks elapsed since the specified RTC counter value
+static uint32_t ticksSince(uint32_t then) {
+	return app_timer_cnt_diff_compute(app_timer_cnt_get(), then);
+}
+
+// Convert RTC ticks to milliseconds
+static uint32_t ticksToMs(uint64_t ticks) {
+	return (uint32_t) ((ticks * 1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)) / APP_TIMER_CLOCK_FREQ);
+}
+
+// Initialize the POWER peripheral, enabling the DCDC regulator if the board can use it, and the
+// power management library
+void powerInit() {
+	nrf_drv_power_config_t config = { 0 };
+#ifdef BOARD_HAS_DCDC_INDUCTOR
+	config.dcdcen = true;
+	stats.dcdc = true;
+#endif
+	nrf_drv_power_init(&config);
+	nrf_pwr_mgmt_init();
+	lastTicks = app_timer_cnt_get();
+}
+
+// Account for the time since the last call as either asleep or awake
+static void powerAccount(bool asleep) {
+	uint32_t now = app_timer_cnt_get();
+	uint32_t elapsed = app_timer_cnt_diff_compute(now, lastTicks);
+	lastTicks = now;
+	if (asleep)
+		stats.sleepTicks += elapsed;
+	else
+		stats.runTicks += elapsed;
+}
+
+// Sleep until an event or interrupt, which is the one place in which the firmware waits while idle
+void powerSleep() {
+	powerAccount(false);
+	nrf_pwr_mgmt_run();
+	powerAccount(true);
+	stats.sleeps++;
+}
+
+// Release the crystal once the transport has been idle for long enough, called at interrupt level
+static void timerHfxoHandler(void *context) {
+	uint32_t idle = ticksSince(transportTicks);
+	if (idle < APP_TIMER_TICKS(POWER_HFXO_HOLD_MS)) {
+		app_timer_start(timerHfxo, APP_TIMER_TICKS(POWER_HFXO_HOLD_MS) - idle + APP_TIMER_MIN_TIMEOUT_TICKS, NULL);
+		return;
+	}
+	hfxoHeld = false;
+	stats.hfxoTicks += ticksSince(hfxoSinceTicks);
+	nrf_drv_clock_hfclk_release();
+}
+
+// Note that the transport to the Notecard is being used, which if the crystal is needed starts it, or
+// holds it for a while longer.  This is cheap enough to be called for every byte polled.
+void powerTransportActive() {
+#if POWER_HFXO_FOR_TRANSPORT
+	transportTicks = app_timer_cnt_get();
+	if (hfxoHeld)
+		return;
+	if (!timerCreated)
+		timerCreated = (app_timer_create(&timerHfxo, APP_TIMER_MODE_SINGLE_SHOT, timerHfxoHandler) == NRF_SUCCESS);
+	if (!timerCreated)
+		return;
+	hfxoHeld = true;
+	hfxoSinceTicks = transportTicks;
+	nrf_drv_clock_hfclk_request(NULL);
+	while (!nrf_drv_clock_hfclk_is_running()) ;
+	app_timer_start(timerHfxo, APP_TIMER_TICKS(POWER_HFXO_HOLD_MS), NULL);
+#endif
+}
+
+// Get the time spent in each state, optionally resetting it
+void powerGetStats(powerStats *out, bool reset) {
+	powerAccount(false);
+	if (out != NULL) {
+		*out = stats;
+		if (hfxoHeld)
+			out->hfxoTicks += ticksSince(hfxoSinceTicks);
+	}
+	if (reset) {
+		bool dcdc = stats.dcdc;
+		memset(&stats, 0, sizeof(stats));
+		stats.dcdc = dcdc;
+		if (hfxoHeld)
+			hfxoSinceTicks = app_timer_cnt_get();
+	}
+}
+
+// Estimated charge consumed, in microamp-ticks
+static uint64_t powerCharge(const powerStats *s) {
+	uint64_t run = s->dcdc ? POWER_UA_RUN_DCDC : POWER_UA_RUN_LDO;
+	return s->runTicks * run + s->sleepTicks * POWER_UA_SLEEP + s->hfxoTicks * POWER_UA_HFXO;
+}
+
+// Estimated average current, in microamps
+uint32_t powerMicroamps(const powerStats *s) {
+	uint64_t ticks = s->runTicks + s->sleepTicks;
+	return ticks == 0 ? 0 : (uint32_t) (powerCharge(s) / ticks);
+}
+
+// Estimated energy consumed, in microjoules
+uint64_t powerMicrojoules(const powerStats *s) {
+	uint64_t ticksPerSecond = APP_TIMER_CLOCK_FREQ / (APP_TIMER_CONFIG_RTC_FREQUENCY + 1);
+	return (powerCharge(s) * POWER_SUPPLY_MV) / (ticksPerSecond * 1000);
+}
+
+// Format a state's share of the time, and what it adds to the average current, in tenths
+static void powerFormatState(char *buf, size_t size, const char *name, uint64_t ticks, uint32_t ua, uint64_t total) {
+	uint32_t permille = total == 0 ? 0 : (uint32_t) ((ticks * 1000) / total);
+	uint32_t tenths = total == 0 ? 0 : (uint32_t) ((ticks * ua * 10) / total);
+	snprintf(buf, size, "%s %lu.%lu%% %lu.%luuA", name, (unsigned long) (permille / 10), (unsigned long) (permille % 10),
+			 (unsigned long) (tenths / 10), (unsigned long) (tenths % 10));
+}
+
+// Report the time spent in each state and the current that each accounts for, the average current,
+// and the energy per note sent during it.  The crystal runs alongside the CPU, so its share overlaps
+// the others, and the three currents add up to the average.
+void powerReport(uint32_t notes) {
+	char buf[192], runText[40], sleepText[40], hfxoText[40];
+	powerStats s;
+	powerGetStats(&s, false);
+	uint64_t total = s.runTicks + s.sleepTicks;
+	uint64_t uj = powerMicrojoules(&s);
+	snprintf(buf, sizeof(buf), "power: %s, %lus in %lu sleeps, average %luuA, %luuJ per note\n",
+			 s.dcdc ? "dcdc" : "ldo", (unsigned long) (ticksToMs(total) / 1000), (unsigned long) s.sleeps,
+			 (unsigned long) powerMicroamps(&s), (unsigned long) (notes == 0 ? 0 : uj / notes));
+	NoteDebug(buf);
+	powerFormatState(runText, sizeof(runText), "run", s.runTicks, s.dcdc ? POWER_UA_RUN_DCDC : POWER_UA_RUN_LDO, total);
+	powerFormatState(sleepText, sizeof(sleepText), "sleep", s.sleepTicks, POWER_UA_SLEEP, total);
+	powerFormatState(hfxoText, sizeof(hfxoText), "hfxo", s.hfxoTicks, POWER_UA_HFXO, total);
+	snprintf(buf, sizeof(buf), "power: %s, %s, %s\n", runText, sleepText, hfxoText);
+	NoteDebug(buf);
+}
@@ -0,0 +1,51 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "main.h"
+
+// The UART's baud rate is derived from HFCLK, whose internal RC oscillator is only accurate to a few
+// percent, so when the Notecard is on serial the crystal is held while the transport is active.
+// TWI is clocked by the master, so over I2C the RC oscillator is good enough.
+#ifndef POWER_HFXO_FOR_TRANSPORT
+#define POWER_HFXO_FOR_TRANSPORT	(!NOTECARD_USE_I2C)
+#endif
+
+// How long the crystal is held after the last transport activity, so that it isn't stopped and
+// restarted between the chunks of a transaction
+#define POWER_HFXO_HOLD_MS			20
+
+// Estimated supply current in each state, in microamps, from the nRF52840 product specification.  The
+// figures are for the CPU running from flash at 64MHz with the DCDC regulator or with the LDO, System
+// ON idle with the RTC running and all RAM retained, and the additional current of the crystal.
+#define POWER_UA_RUN_DCDC			3300
+#define POWER_UA_RUN_LDO			6300
+#define POWER_UA_SLEEP				3
+#define POWER_UA_HFXO				250
+
+// Supply voltage assumed when converting charge to energy
+#define POWER_SUPPLY_MV				3300
+
+// Time spent in each state, in RTC ticks
+typedef struct {
+	bool dcdc;
+	uint32_t sleeps;
+	uint64_t runTicks;
+	uint64_t sleepTicks;
+	uint64_t hfxoTicks;
+} powerStats;
+
+void powerInit(void);
+void powerSleep(void);
+void powerTransportActive(void);
+void powerGetStats(powerStats *stats, bool reset);
+uint32_t powerMicroamps(const powerStats *stats);
+uint64_t powerMicrojoules(const powerStats *stats);
+void powerReport(uint32_t notes);
+
+#endif // POWER_H
@@ -0,0 +1,110 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Local sample aggregation, decoupling the rate at which a sensor is sampled from the rate at which
+// data is sent to the Notecard.  Readings are taken on a timer into a RAM ring, and summarized as
+// running min, max, mean and count over a window of many samples.  The summary is emitted once
+// per window, or only when a reading crosses one of the configured thresholds, or both, so that
+// the number of Notecard transactions is a tiny fraction of the number of samples.
+
+#include <string.h>
+#include "main.h"
+#include "sampler.h"
+
+// Which side of the thresholds a reading is on
+#define BAND_LOW		-1
+#define BAND_NORMAL		0
+#define BAND_HIGH		1
+
+// Forwards
+static void samplerTake(void *context);
+
+// Start the window afresh
+static void samplerWindowReset(sampler *s) {
+	memset(&s->window, 0, sizeof(s->window));
+	s->window.startMs = (uint32_t) millis();
+	s->sum = 0;
+}
+
+// Start sampling.  The caller fills in the configuration fields and leaves the rest zeroed.
+bool samplerStart(sampler *s) {
+	if (s->read == NULL || s->emit == NULL || s->sampleMs == 0 || s->windowSamples == 0)
+		return false;
+	samplerWindowReset(s);
+	s->band = BAND_NORMAL;
+	s->job.name = "sampler";
+	s->job.periodMs = s->sampleMs;
+	s->job.handler = samplerTake;
+	s->job.context = s;
+	return schedJobStart(&s->job, true);
+}
+
+// Stop sampling, without emitting the partial window
+void samplerStop(sampler *s) {
+	schedJobStop(&s->job);
+}
+
+// Emit the current window, if it has any readings, and begin a new one
+void samplerFlush(sampler *s) {
+	if (s->window.count == 0)
+		return;
+	s->window.mean = (float) (s->sum / s->window.count);
+	s->window.endMs = (uint32_t) millis();
+	samplerWindow window = s->window;
+	samplerWindowReset(s);
+	s->emit(&window, s->context);
+}
+
+// Copy out the most recent readings, oldest first, returning how many were copied
+int samplerRecent(sampler *s, float *values, int maxValues) {
+	int n = s->ringCount < maxValues ? s->ringCount : maxValues;
+	int first = (s->ringHead + SAMPLER_RING_SIZE - n) % SAMPLER_RING_SIZE;
+	for (int i=0; i<n; i++)
+		values[i] = s->ring[(first + i) % SAMPLER_RING_SIZE];
+	return n;
+}
+
+// Take a reading, called periodically in thread context
+static void samplerTake(void *context) {
+	sampler *s = (sampler *) context;
+	float value;
+	if (!s->read(s->context, &value))
+		return;
+
+	// Retain it in the ring
+	s->ring[s->ringHead] = value;
+	s->ringHead = (s->ringHead + 1) % SAMPLER_RING_SIZE;
+	if (s->ringCount < SAMPLER_RING_SIZE)
+		s->ringCount++;
+
+	// Fold it into the window
+	samplerWindow *w = &s->window;
+	if (w->count == 0 || value < w->min)
+		w->min = value;
+	if (w->count == 0 || value > w->max)
+		w->max = value;
+	w->last = value;
+	w->count++;
+	s->sum += value;
+
+	// Detect threshold crossings, which are only counted on the way out of the normal band
+	if (s->thresholdHigh > s->thresholdLow) {
+		int8_t band = (value > s->thresholdHigh) ? BAND_HIGH : (value < s->thresholdLow) ? BAND_LOW : BAND_NORMAL;
+		if (band != s->band && band != BAND_NORMAL)
+			w->crossing = true;
+		s->band = band;
+	}
+
+	// Emit if it's time to do so
+	if ((s->emitWhen & SAMPLER_EMIT_CROSSING) && w->crossing) {
+		samplerFlush(s);
+		return;
+	}
+	if (w->count >= s->windowSamples) {
+		if (s->emitWhen & SAMPLER_EMIT_WINDOW)
+			samplerFlush(s);
+		else
+			samplerWindowReset(s);
+	}
+}
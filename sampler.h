@@ -0,0 +1,62 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sched.h"
+
+// Number of most recent raw samples retained
+#define SAMPLER_RING_SIZE		64
+
+// When a sampler hands a window of readings to its emit function
+#define SAMPLER_EMIT_WINDOW		0x01		// At the end of every window
+#define SAMPLER_EMIT_CROSSING	0x02		// As soon as a reading crosses a threshold
+
+// Summary of the readings in a window
+typedef struct {
+	float min;
+	float max;
+	float mean;
+	float last;
+	uint32_t count;
+	uint32_t startMs;
+	uint32_t endMs;
+	bool crossing;
+} samplerWindow;
+
+// Reads the sensor, returning false if no reading is available
+typedef bool (*samplerReadFn)(void *context, float *value);
+
+// Called in thread context with a completed window, typically to add a note
+typedef void (*samplerEmitFn)(const samplerWindow *window, void *context);
+
+// A sampling pipeline, which reads a sensor at a high rate and summarizes the readings in windows
+// that are many samples long
+typedef struct {
+	uint32_t sampleMs;
+	uint32_t windowSamples;
+	uint8_t emitWhen;
+	float thresholdLow;
+	float thresholdHigh;
+	samplerReadFn read;
+	samplerEmitFn emit;
+	void *context;
+	schedJob job;
+	float ring[SAMPLER_RING_SIZE];
+	uint16_t ringHead;
+	uint16_t ringCount;
+	double sum;
+	samplerWindow window;
+	int8_t band;
+} sampler;
+
+bool samplerStart(sampler *s);
+void samplerStop(sampler *s);
+void samplerFlush(sampler *s);
+int samplerRecent(sampler *s, float *values, int maxValues);
+
+#endif // SAMPLER_H
@@ -0,0 +1,123 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Cooperative run loop built on app_scheduler.  Timers, transport completions and GPIO events all
+// post their work here so that it runs in thread context, one handler at a time, and the core
+// sleeps whenever the queue is empty.
+
+#include "main.h"
+#include "sched.h"
+#include "notetrace.h"
+#include "nrf_log_ctrl.h"
+#include "app_scheduler.h"
+#include "app_error.h"
+
+// What's actually placed in the app_scheduler queue
+typedef struct {
+	schedHandler handler;
+	void *context;
+} schedEvent;
+
+// Forwards
+static void schedDispatch(void *eventData, uint16_t eventSize);
+static void schedJobTimerHandler(void *context);
+static void schedJobPost(schedJob *job);
+static void schedJobRun(void *context);
+
+// Initialize the scheduler, which must be done before any work is posted
+void schedInit() {
+	APP_SCHED_INIT(sizeof(schedEvent), SCHED_QUEUE_SIZE);
+}
+
+// Post work to be done in thread context.  This is safe to call from interrupt handlers, and
+// returns false if the queue is full.
+bool schedPost(schedHandler handler, void *context) {
+	schedEvent event = { .handler = handler, .context = context };
+	return app_sched_event_put(&event, sizeof(event), schedDispatch) == NRF_SUCCESS;
+}
+
+// Trampoline from the app_scheduler event format to ours
+static void schedDispatch(void *eventData, uint16_t eventSize) {
+	schedEvent *event = (schedEvent *) eventData;
+	event->handler(event->context);
+}
+
+// Start a periodic job, optionally posting its first run immediately rather than after one period.
+// Returns false if the timer can't be started, or if the period is too short for the timer to time.
+bool schedJobStart(schedJob *job, bool runNow) {
+	if (job->timer == NULL) {
+		job->timer = &job->timerData;
+		if (app_timer_create(&job->timer, APP_TIMER_MODE_REPEATED, schedJobTimerHandler) != NRF_SUCCESS)
+			return false;
+	}
+
+	// Time periods that are too long for the RTC as a number of segments, in the same way as delay()
+	uint32_t segments = (job->periodMs + SCHED_SEGMENT_MS - 1) / SCHED_SEGMENT_MS;
+	if (segments == 0)
+		return false;
+	uint64_t ticks = ((uint64_t) job->periodMs * APP_TIMER_CLOCK_FREQ) / (1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1));
+	uint32_t segmentTicks = (uint32_t) (ticks / segments);
+	if (segmentTicks < APP_TIMER_MIN_TIMEOUT_TICKS)
+		return false;
+	app_timer_stop(job->timer);
+	job->segments = segments;
+	job->segmentsLeft = segments;
+	if (app_timer_start(job->timer, segmentTicks, job) != NRF_SUCCESS)
+		return false;
+	if (runNow)
+		schedJobPost(job);
+	return true;
+}
+
+// Stop a periodic job.  A run that has already been posted will still be dispatched.
+void schedJobStop(schedJob *job) {
+	if (job->timer != NULL)
+		app_timer_stop(job->timer);
+}
+
+// Job timer handler, called at interrupt level at the end of each segment of the period
+static void schedJobTimerHandler(void *context) {
+	schedJob *job = (schedJob *) context;
+	if (job->segmentsLeft > 1) {
+		job->segmentsLeft--;
+		return;
+	}
+	job->segmentsLeft = job->segments;
+	schedJobPost(job);
+}
+
+// Post a run of a job.  If the previous run hasn't yet been dispatched we don't queue another one,
+// so that a slow job can't flood the queue.
+static void schedJobPost(schedJob *job) {
+	if (job->pending) {
+		job->overruns++;
+		return;
+	}
+	job->pending = true;
+	if (!schedPost(schedJobRun, job))
+		job->pending = false;
+}
+
+// Run a job in thread context
+static void schedJobRun(void *context) {
+	schedJob *job = (schedJob *) context;
+	job->pending = false;
+	job->runs++;
+	job->handler(job->context);
+}
+
+// The main run loop, which never returns.  app_sched_execute() drains the queue, and if an
+// interrupt posts more work after that, the event register it sets makes the sleep return at once.
+// Trace and log output is written only once the queue is empty, a little at a time, and the core
+// only sleeps once there is none left.
+void schedRun() {
+	while (true) {
+		app_sched_execute();
+		bool more = noteTraceDrain();
+		if (NRF_LOG_PROCESS())
+			more = true;
+		if (!more)
+			sleep_handler();
+	}
+}
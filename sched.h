@@ -0,0 +1,48 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "app_timer.h"
+
+// Capacity of the scheduler's event queue
+#define SCHED_QUEUE_SIZE	16
+
+// The RTC behind app_timer is only 24 bits wide, so it can't time anything longer than 512 seconds.
+// Longer periods are timed as a number of equal segments of no more than this.
+#define SCHED_SEGMENT_MS	(60*1000)
+
+// Work posted to the scheduler, always dispatched in thread context from schedRun()
+typedef void (*schedHandler)(void *context);
+
+// A periodic job whose handler is posted to the scheduler every time its timer expires.  Jobs
+// must have static storage duration because app_timer owns the timer node while it is running.
+typedef struct {
+	const char *name;
+	uint32_t periodMs;
+	schedHandler handler;
+	void *context;
+	app_timer_t timerData;
+	app_timer_id_t timer;
+	volatile bool pending;
+	uint32_t segments;
+	volatile uint32_t segmentsLeft;
+	uint32_t runs;
+	uint32_t overruns;
+} schedJob;
+
+// Define a periodic job
+#define SCHED_JOB_DEF(var, jobName, jobPeriodMs, jobHandler, jobContext) \
+	static schedJob var = { .name = jobName, .periodMs = jobPeriodMs, .handler = jobHandler, .context = jobContext }
+
+void schedInit(void);
+bool schedPost(schedHandler handler, void *context);
+bool schedJobStart(schedJob *job, bool runNow);
+void schedJobStop(schedJob *job);
+void schedRun(void);
+
+#endif // SCHED_H
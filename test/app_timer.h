@@ -0,0 +1,45 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// The parts of the SDK's app_timer to which the modules under test refer.  The RTC counter and the
+// timers are supplied by the test, so that it can control the passage of time.
+
+#ifndef APP_TIMER_H
+#define APP_TIMER_H
+
+#include <stdint.h>
+#include "sdk_errors.h"
+
+#define APP_TIMER_CLOCK_FREQ			32768
+#define APP_TIMER_CONFIG_RTC_FREQUENCY	0
+
+#define APP_TIMER_TICKS(MS)				((uint32_t) (((uint64_t) (MS) * APP_TIMER_CLOCK_FREQ) / 1000))
+
+typedef enum {
+	APP_TIMER_MODE_SINGLE_SHOT,
+	APP_TIMER_MODE_REPEATED
+} app_timer_mode_t;
+
+typedef void (*app_timer_timeout_handler_t)(void *p_context);
+typedef struct {
+	app_timer_timeout_handler_t handler;
+	app_timer_mode_t mode;
+} app_timer_t;
+typedef app_timer_t *app_timer_id_t;
+
+#define APP_TIMER_DEF(timer_id) \
+	static app_timer_t timer_id##_data; \
+	static const app_timer_id_t timer_id = &timer_id##_data
+
+uint32_t app_timer_cnt_get(void);
+ret_code_t app_timer_create(app_timer_id_t const *p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler);
+ret_code_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void *p_context);
+ret_code_t app_timer_stop(app_timer_id_t timer_id);
+
+// The RTC counter is 24 bits
+static inline uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from) {
+	return (ticks_to - ticks_from) & 0x00ffffff;
+}
+
+#endif // APP_TIMER_H
@@ -0,0 +1,44 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// What the host tests share: checks that report the line that failed and are counted rather than
+// stopping the test, and a repeatable pseudo-random sequence.
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+static int checkFailures = 0;
+
+#define CHECK(cond)		check((cond), #cond, __FILE__, __LINE__)
+static inline void check(bool ok, const char *what, const char *file, int line) {
+	if (!ok) {
+		printf("%s:%d: failed: %s\n", file, line, what);
+		checkFailures++;
+	}
+}
+
+// The exit status of the named test, once it has reported how it went
+static inline int checkResult(const char *test) {
+	if (checkFailures != 0) {
+		printf("%s: %d failed\n", test, checkFailures);
+		return 1;
+	}
+	printf("%s: passed\n", test);
+	return 0;
+}
+
+// Xorshift, which a test may seed to get a sequence of its own
+static uint32_t randomSeed = 1;
+static inline uint32_t random32() {
+	randomSeed ^= randomSeed << 13;
+	randomSeed ^= randomSeed >> 17;
+	randomSeed ^= randomSeed << 5;
+	return randomSeed;
+}
+
+#endif // CHECK_H
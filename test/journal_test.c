@@ -0,0 +1,247 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Host tests of the journal, on its RAM simulation of NOR flash.  Besides appending and replaying,
+// power is failed after every possible number of words of a write, and the journal is then
+// recovered as it would be after a reset, to check that exactly the records that were written whole
+// are replayed, in order, and that appending resumes after the torn one.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "journal.h"
+#include "check.h"
+
+// Stand-ins for the rest of the firmware and for note-c
+void NoteDebug(const char *message) {
+	fputs(message, stdout);
+}
+uint32_t cycles() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+char *JNtoA(JNUMBER f, char *buf, int precision) {
+	snprintf(buf, JNTOA_MAX, "%.*g", precision < 0 ? JNTOA_PRECISION : precision, f);
+	return buf;
+}
+
+// Responses, which are only ever compared with these
+static char rspSuccess, rspError;
+bool NoteResponseError(J *rsp) {
+	return rsp == (J *) &rspError;
+}
+void NoteDeleteResponse(J *rsp) {
+}
+
+// An outbox that holds the single note that replay submits until the test delivers it
+static noteReqEmitter submitEmit = NULL;
+static void *submitEmitContext;
+static noteReqCallback submitCallback;
+static void *submitContext;
+bool noteOutboxSubmit(noteOutboxClass cls, noteReqEmitter emit, void *emitContext, noteReqCallback callback, void *context) {
+	if (submitEmit != NULL)
+		return false;
+	submitEmit = emit;
+	submitEmitContext = emitContext;
+	submitCallback = callback;
+	submitContext = context;
+	return true;
+}
+
+// Where the request for the submitted note is written
+static char request[512];
+static size_t requestLen;
+static const char *requestOutput(void *context, const uint8_t *data, size_t len) {
+	if (requestLen + len >= sizeof(request))
+		return "request too long";
+	memcpy(&request[requestLen], data, len);
+	requestLen += len;
+	request[requestLen] = '\0';
+	return NULL;
+}
+
+// Deliver the submitted note, returning false if there isn't one or else leaving its request in
+// request[].  Its completion may submit the next.
+static bool deliver(bool success) {
+	if (submitEmit == NULL)
+		return false;
+	noteWriter w;
+	requestLen = 0;
+	noteWriterBegin(&w, requestOutput, NULL);
+	submitEmit(&w, submitEmitContext);
+	CHECK(noteWriterEnd(&w) == NULL);
+	submitEmit = NULL;
+	submitCallback(1, success ? (J *) &rspSuccess : (J *) &rspError, submitContext);
+	return true;
+}
+
+// True if the delivered request carried the specified body
+static bool delivered(const char *body) {
+	char expect[128];
+	snprintf(expect, sizeof(expect), "\"body\":%s}", body);
+	return strstr(request, expect) != NULL;
+}
+
+static uint32_t pending() {
+	journalStats stats;
+	journalGetStats(&stats);
+	return stats.pending;
+}
+
+static void numbered(char *body, size_t size, int n) {
+	// Bodies of different lengths, so that records aren't all padded alike
+	snprintf(body, size, "{\"n\":%d,\"pad\":\"%.*s\"}", n, n % 7, "xxxxxxx");
+}
+
+// Size that a record takes in flash, which is its two header words and its padded payload
+static uint32_t recordSize(const char *file, const char *body) {
+	return 8 + ((1 + strlen(file) + strlen(body) + 3) & ~3U);
+}
+
+// Notes survive a reset, are replayed oldest first, and a note that isn't accepted is retried
+static void testReplay() {
+	journalSimulateErase();
+	CHECK(journalAppend(NOTEOUTBOX_ALARM, "alarms.qo", "{\"a\":1}", true));
+	CHECK(journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"a\":2}", false));
+	CHECK(journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"a\":3}", false));
+	CHECK(journalSync());
+	CHECK(journalInit());
+	CHECK(pending() == 3);
+
+	CHECK(journalReplay());
+	CHECK(deliver(true));
+	CHECK(delivered("{\"a\":1}") && strstr(request, "\"file\":\"alarms.qo\"") != NULL && strstr(request, "\"sync\":true") != NULL);
+	CHECK(deliver(false));
+	CHECK(delivered("{\"a\":2}"));
+	CHECK(pending() == 2);
+	CHECK(!deliver(true));
+
+	CHECK(journalReplay());
+	CHECK(deliver(true));
+	CHECK(delivered("{\"a\":2}"));
+	CHECK(deliver(true));
+	CHECK(delivered("{\"a\":3}"));
+	CHECK(!deliver(true));
+	CHECK(pending() == 0);
+	CHECK(journalInit());
+	CHECK(pending() == 0);
+	CHECK(!journalReplay());
+}
+
+// Power fails after each possible number of words of a write of several records
+static void testPowerLossDuringWrite() {
+	enum { SAFE = 2, TORN = 6 };
+	char body[64];
+	uint32_t total = 0;
+	for (int i=SAFE; i<SAFE+TORN; i++) {
+		numbered(body, sizeof(body), i);
+		total += recordSize("sensors.qo", body) / 4;
+	}
+
+	for (uint32_t words=0; words<=total; words++) {
+		journalSimulateErase();
+		for (int i=0; i<SAFE; i++) {
+			numbered(body, sizeof(body), i);
+			journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", body, false);
+		}
+		CHECK(journalSync());
+		for (int i=SAFE; i<SAFE+TORN; i++) {
+			numbered(body, sizeof(body), i);
+			journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", body, false);
+		}
+		journalSimulatePowerLoss(words);
+		journalSync();
+		journalSimulatePowerLoss(-1);
+
+		// The records that were written whole, and whether one was torn
+		int whole = SAFE;
+		uint32_t end = 0;
+		for (int i=SAFE; i<SAFE+TORN; i++) {
+			numbered(body, sizeof(body), i);
+			end += recordSize("sensors.qo", body) / 4;
+			if (end > words)
+				break;
+			whole++;
+		}
+		bool torn = (whole < SAFE+TORN && words > end - recordSize("sensors.qo", body) / 4);
+
+		// After a reset, they are all that is pending, and appending carries on after them
+		CHECK(journalInit());
+		CHECK(pending() == (uint32_t) whole);
+		CHECK(journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"after\":true}", false));
+		CHECK(journalSync());
+		CHECK(journalInit());
+		CHECK(pending() == (uint32_t) whole + 1);
+
+		// And they are replayed in order, skipping the torn record
+		journalReplay();
+		for (int i=0; i<whole; i++) {
+			numbered(body, sizeof(body), i);
+			CHECK(deliver(true) && delivered(body));
+		}
+		CHECK(deliver(true) && delivered("{\"after\":true}"));
+		CHECK(!deliver(true));
+		journalStats stats;
+		journalGetStats(&stats);
+		CHECK(stats.pending == 0);
+		CHECK(stats.corrupt == (torn ? 1 : 0));
+	}
+}
+
+// Power fails while a note is being marked as delivered, so it is replayed again after the reset
+static void testPowerLossDuringDelivery() {
+	journalSimulateErase();
+	journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"a\":1}", false);
+	journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"a\":2}", false);
+	CHECK(journalReplay());
+	journalSimulatePowerLoss(0);
+	CHECK(deliver(true));
+	CHECK(delivered("{\"a\":1}"));
+	journalSimulatePowerLoss(-1);
+	submitEmit = NULL;
+
+	CHECK(journalInit());
+	CHECK(pending() == 2);
+	CHECK(journalReplay());
+	CHECK(deliver(true) && delivered("{\"a\":1}"));
+	CHECK(deliver(true) && delivered("{\"a\":2}"));
+	CHECK(pending() == 0);
+}
+
+// When the journal is full the oldest notes are lost, and what remains survives a reset in order
+static void testWrap() {
+	enum { RECORDS = 600 };
+	char body[64];
+	journalSimulateErase();
+	for (int i=0; i<RECORDS; i++) {
+		numbered(body, sizeof(body), i);
+		CHECK(journalAppend(NOTEOUTBOX_ROUTINE, "sensors.qo", body, false));
+	}
+	CHECK(journalSync());
+	journalStats stats;
+	journalGetStats(&stats);
+	CHECK(stats.lost > 0);
+	CHECK(stats.pending + stats.lost == RECORDS);
+
+	CHECK(journalInit());
+	CHECK(pending() == stats.pending);
+	journalReplay();
+	for (int i=RECORDS-stats.pending; i<RECORDS; i++) {
+		numbered(body, sizeof(body), i);
+		CHECK(deliver(true) && delivered(body));
+	}
+	CHECK(!deliver(true));
+	CHECK(pending() == 0);
+}
+
+int main() {
+	CHECK(journalInit());
+	testReplay();
+	testPowerLossDuringWrite();
+	testPowerLossDuringDelivery();
+	testWrap();
+	journalBenchmark(200);
+	return checkResult("journal_test");
+}
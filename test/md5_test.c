@@ -0,0 +1,64 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Host tests of MD5, against the test suite in RFC 1321, and fed a byte at a time and in pieces
+// that straddle its 64-byte blocks.
+
+#include <stdio.h>
+#include <string.h>
+#include "md5.h"
+#include "check.h"
+
+static const struct {
+	const char *text;
+	const char *digest;
+} suite[] = {
+	{ "", "d41d8cd98f00b204e9800998ecf8427e" },
+	{ "a", "0cc175b9c0f1b6a831c399e269772661" },
+	{ "abc", "900150983cd24fb0d6963f7d28e17f72" },
+	{ "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+	{ "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+	{ "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", "d174ab98d277d9f5a5611c2c9f419d9f" },
+	{ "12345678901234567890123456789012345678901234567890123456789012345678901234567890", "57edf4a22be3c955ac49da2e2107b67a" },
+};
+#define SUITE_LEN (sizeof(suite) / sizeof(suite[0]))
+
+int main() {
+	char hex[MD5_HEX_LEN];
+	for (size_t i=0; i<SUITE_LEN; i++) {
+		const uint8_t *text = (const uint8_t *) suite[i].text;
+		size_t len = strlen(suite[i].text);
+		md5Hex(text, len, hex);
+		CHECK(strcmp(hex, suite[i].digest) == 0);
+
+		// The same digest, whatever the pieces in which the data arrives
+		for (size_t piece=1; piece<=65; piece+=piece < 8 ? 1 : 19) {
+			md5Context ctx;
+			md5Init(&ctx);
+			for (size_t at=0; at<len; at+=piece)
+				md5Update(&ctx, &text[at], len-at < piece ? len-at : piece);
+			md5FinalHex(&ctx, hex);
+			CHECK(strcmp(hex, suite[i].digest) == 0);
+		}
+	}
+
+	// Lengths around the padding boundary, where the length no longer fits in the last block
+	uint8_t data[130];
+	for (size_t i=0; i<sizeof(data); i++)
+		data[i] = (uint8_t) (i * 7);
+	for (size_t len=50; len<=sizeof(data); len++) {
+		char whole[MD5_HEX_LEN];
+		md5Hex(data, len, whole);
+		md5Context ctx;
+		md5Init(&ctx);
+		for (size_t at=0; at<len; at++)
+			md5Update(&ctx, &data[at], 1);
+		md5FinalHex(&ctx, hex);
+		CHECK(strcmp(hex, whole) == 0);
+	}
+	md5Hex((const uint8_t *) "The quick brown fox jumps over the lazy dog", 43, hex);
+	CHECK(strcmp(hex, "9e107d9d372bb6826bd81d3542a419d6") == 0);
+
+	return checkResult("md5_test");
+}
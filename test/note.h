@@ -0,0 +1,56 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// The parts of note-c's interface to which the modules under test refer, so that they can be built
+// on a host without note-c.  Each test defines whichever of the functions it uses.
+
+#ifndef NOTE_H
+#define NOTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define NOTE_I2C_MAX_DEFAULT	30
+#define JNTOA_PRECISION			(10)
+#define JNTOA_MAX				(44)
+
+#define JInvalid				(0)
+#define JFalse					(1 << 0)
+#define JTrue					(1 << 1)
+#define JNULL					(1 << 2)
+#define JNumber					(1 << 3)
+#define JString					(1 << 4)
+#define JArray					(1 << 5)
+#define JObject					(1 << 6)
+#define JRaw					(1 << 7)
+
+typedef double JNUMBER;
+typedef struct J {
+	struct J *next;
+	struct J *prev;
+	struct J *child;
+	int type;
+	char *valuestring;
+	int valueint;
+	JNUMBER valuenumber;
+	char *string;
+} J;
+
+void NoteDebug(const char *message);
+bool NoteResponseError(J *rsp);
+void NoteDeleteResponse(J *rsp);
+char *JNtoA(JNUMBER f, char *buf, int precision);
+JNUMBER JAtoN(const char *string, char **endPtr);
+char *JGetString(J *json, const char *field);
+void *JMalloc(size_t size);
+void JFree(void *p);
+J *JParse(const char *value);
+J *JCreateObject(void);
+void JDelete(J *item);
+J *JAddStringToObject(J *object, const char *name, const char *string);
+size_t strlcpy(char *dst, const char *src, size_t siz);
+
+#endif // NOTE_H
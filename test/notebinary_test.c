@@ -0,0 +1,135 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Host tests of the COBS encoding used for binary transfers.  Data of every kind, including runs of
+// zeros, of the end-of-packet byte, and of non-zero bytes longer than a COBS block, is encoded and then
+// decoded in pieces of random size, as it would arrive from the Notecard.
+
+#include <stdio.h>
+#include <string.h>
+#include "notebinary.h"
+#include "check.h"
+
+// Stand-ins for the rest of the firmware and for note-c, of which only the encoding is exercised
+void NoteDebug(const char *message) {
+	fputs(message, stdout);
+}
+long unsigned int millis() {
+	return 0;
+}
+bool NoteResponseError(J *rsp) {
+	return false;
+}
+void NoteDeleteResponse(J *rsp) {
+}
+char *JGetString(J *json, const char *field) {
+	return "";
+}
+char *JNtoA(JNUMBER f, char *buf, int precision) {
+	snprintf(buf, JNTOA_MAX, "%.*g", precision < 0 ? JNTOA_PRECISION : precision, f);
+	return buf;
+}
+JNUMBER JAtoN(const char *string, char **endPtr) {
+	return strtod(string, endPtr);
+}
+size_t strlcpy(char *dst, const char *src, size_t siz) {
+	size_t len = strlen(src);
+	if (siz > 0) {
+		size_t n = len < siz-1 ? len : siz-1;
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+	return len;
+}
+noteReqHandle noteRequestAsyncQuery(const char *json, noteParser *parser, noteReqQueryCallback callback, void *context) {
+	return 0;
+}
+noteReqHandle noteRequestAsyncEmit(noteReqEmitter emit, void *emitContext, noteReqCallback callback, void *context) {
+	return 0;
+}
+noteReqHandle noteRequestAsyncStream(noteReqEmitter emit, void *emitContext, noteWireSink sink, void *sinkContext, noteReqStreamCallback callback, void *context) {
+	return 0;
+}
+
+// Where the encoding is written
+static uint8_t encoded[4096];
+static size_t encodedLen;
+static const char *encodedOutput(void *context, const uint8_t *data, size_t len) {
+	if (encodedLen + len > sizeof(encoded))
+		return "encoding too long";
+	memcpy(&encoded[encodedLen], data, len);
+	encodedLen += len;
+	return NULL;
+}
+
+// Encode data, check the encoding, and decode it in random pieces
+static void roundTrip(const uint8_t *data, size_t len) {
+	static uint8_t decoded[2048];
+	noteWriter w;
+	encodedLen = 0;
+	noteWriterBegin(&w, encodedOutput, NULL);
+	noteCobsWrite(&w, data, len, NOTEBINARY_EOP);
+	CHECK(noteWriterEnd(&w) == NULL);
+	CHECK(encodedLen == noteCobsEncodedLen(data, len));
+	CHECK(encodedLen <= len + len/254 + 1);
+	CHECK(memchr(encoded, NOTEBINARY_EOP, encodedLen) == NULL);
+	encoded[encodedLen++] = NOTEBINARY_EOP;
+
+	noteCobsDecoder d;
+	noteCobsDecodeBegin(&d, decoded, len);
+	for (size_t at=0; at<encodedLen; ) {
+		size_t piece = 1 + random32() % 40;
+		if (piece > encodedLen - at)
+			piece = encodedLen - at;
+		noteCobsDecodeFeed(&d, &encoded[at], piece, NOTEBINARY_EOP);
+		at += piece;
+	}
+	CHECK(d.done && !d.invalid);
+	CHECK(d.outLen == len && memcmp(decoded, data, len) == 0);
+}
+
+int main() {
+	static uint8_t data[2048];
+
+	// Edge cases: empty, all zeros, all end-of-packet, and non-zero runs either side of a block
+	roundTrip(data, 0);
+	memset(data, 0, sizeof(data));
+	roundTrip(data, 1);
+	roundTrip(data, 600);
+	memset(data, NOTEBINARY_EOP, sizeof(data));
+	roundTrip(data, 600);
+	memset(data, 0x55, sizeof(data));
+	for (size_t len=252; len<=256; len++)
+		roundTrip(data, len);
+	roundTrip(data, 254*3);
+	data[254] = 0;
+	roundTrip(data, 509);
+
+	// Random data with differing densities of zeros
+	for (int t=0; t<2000; t++) {
+		size_t len = random32() % sizeof(data);
+		int kind = t % 3;
+		for (size_t i=0; i<len; i++) {
+			uint32_t r = random32();
+			data[i] = kind == 0 ? (uint8_t) r : kind == 1 ? (r % 3 == 0 ? 0 : (uint8_t) (r >> 8)) : (r % 300 == 0 ? 0 : (uint8_t) (1 + r % 255));
+		}
+		roundTrip(data, len);
+	}
+
+	// A decoder given more than it has room for says so, rather than overrunning
+	uint8_t small[4];
+	memset(data, 0x22, 16);
+	noteWriter w;
+	encodedLen = 0;
+	noteWriterBegin(&w, encodedOutput, NULL);
+	noteCobsWrite(&w, data, 16, NOTEBINARY_EOP);
+	noteWriterEnd(&w);
+	encoded[encodedLen++] = NOTEBINARY_EOP;
+	noteCobsDecoder d;
+	noteCobsDecodeBegin(&d, small, sizeof(small));
+	noteCobsDecodeFeed(&d, encoded, encodedLen, NOTEBINARY_EOP);
+	CHECK(d.invalid);
+
+	return checkResult("notebinary_test");
+}
@@ -0,0 +1,102 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Host tests of LZSS compression.  Data ranging from incompressible to highly repetitive is
+// compressed and decompressed, each written in pieces of random size, and must come back unchanged.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "notecomp.h"
+#include "check.h"
+
+// Stand-ins for the rest of the firmware and for note-c
+void NoteDebug(const char *message) {
+	fputs(message, stdout);
+}
+uint32_t cycles() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+// Where the output of each stage is collected
+typedef struct {
+	uint8_t data[4096];
+	size_t len;
+} buffer;
+static const char *bufferOutput(void *context, const uint8_t *data, size_t len) {
+	buffer *b = (buffer *) context;
+	if (b->len + len > sizeof(b->data))
+		return "output too long";
+	memcpy(&b->data[b->len], data, len);
+	b->len += len;
+	return NULL;
+}
+
+// Compress and decompress data, returning the compressed length
+static size_t roundTrip(const uint8_t *data, size_t len) {
+	static noteCompressor c;
+	static noteDecompressor d;
+	static buffer compressed, decompressed;
+	compressed.len = 0;
+	decompressed.len = 0;
+
+	noteCompBegin(&c, bufferOutput, &compressed);
+	for (size_t at=0; at<len; ) {
+		size_t piece = 1 + random32() % 50;
+		if (piece > len - at)
+			piece = len - at;
+		noteCompWrite(&c, &data[at], piece);
+		at += piece;
+	}
+	CHECK(noteCompEnd(&c) == NULL);
+
+	noteDecompBegin(&d, bufferOutput, &decompressed);
+	for (size_t at=0; at<compressed.len; ) {
+		size_t piece = 1 + random32() % 9;
+		if (piece > compressed.len - at)
+			piece = compressed.len - at;
+		noteDecompWrite(&d, &compressed.data[at], piece);
+		at += piece;
+	}
+	CHECK(noteDecompEnd(&d) == NULL);
+	CHECK(decompressed.len == len && memcmp(decompressed.data, data, len) == 0);
+	return compressed.len;
+}
+
+int main() {
+	static uint8_t data[2048];
+	randomSeed = 3;
+
+	// Nothing, a single byte, and a single byte repeated across more than the window
+	CHECK(roundTrip(data, 0) == 0);
+	data[0] = 'x';
+	roundTrip(data, 1);
+	memset(data, 'x', sizeof(data));
+	CHECK(roundTrip(data, sizeof(data)) < sizeof(data) / 4);
+
+	// Incompressible data grows by no more than a bit per byte
+	for (size_t i=0; i<sizeof(data); i++)
+		data[i] = (uint8_t) random32();
+	CHECK(roundTrip(data, sizeof(data)) <= sizeof(data) + sizeof(data)/8 + 1);
+
+	// Text like the JSON of a batch compresses well
+	size_t len = 0;
+	for (int i=0; len+64<sizeof(data); i++)
+		len += (size_t) snprintf((char *) &data[len], sizeof(data)-len, "{\"temp\":%d.%d,\"voltage\":4.12,\"count\":%d},", 20 + i % 5, i % 4, i);
+	CHECK(roundTrip(data, len) < len / 2);
+
+	// Random data of every kind and length
+	for (int t=0; t<3000; t++) {
+		len = random32() % sizeof(data);
+		int kind = t % 3;
+		for (size_t i=0; i<len; i++)
+			data[i] = kind == 0 ? (uint8_t) random32() : kind == 1 ? (uint8_t) (random32() % 4) : (uint8_t) (i % 37);
+		roundTrip(data, len);
+	}
+
+	noteCompBenchmark(10);
+	return checkResult("notecomp_test");
+}
@@ -0,0 +1,121 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Host tests of the energy model, both of the simulation and of transactions timed with a cycle
+// counter and RTC that the test advances, checking that the time the CPU spends asleep is charged
+// to sleep rather than to the phase in which it happened.
+
+#include <stdio.h>
+#include <string.h>
+#include "noteenergy.h"
+#include "notereq.h"
+#include "check.h"
+
+// The counters, which only move when the test advances them
+static uint32_t nowCycles = 0;
+static uint32_t nowTicks = 0;
+uint32_t cycles() {
+	return nowCycles;
+}
+uint32_t app_timer_cnt_get() {
+	return nowTicks;
+}
+static void advance(uint32_t runCycles, uint32_t ticks) {
+	nowCycles += runCycles;
+	nowTicks = (nowTicks + ticks) & 0x00ffffff;
+}
+
+void NoteDebug(const char *message) {
+	fputs(message, stdout);
+}
+
+// A model with round numbers, in which 1us of running is 1nJ and 1us of sleep is 0.01nJ
+static const noteEnergyModel model = {
+	.cpuHz = 1000000,
+	.supplyMv = 1000,
+	.runUa = 1000,
+	.sleepUa = 10,
+	.twiUa = 0,
+	.uartUa = 0,
+	.hfxoUa = 0,
+	.i2c = true,
+};
+
+// The simulation of a transaction that only waits is almost all sleep
+static void testSimulate() {
+	noteEnergyStats s;
+	uint64_t nj = noteEnergySimulate(&model, 0, 0, 100, 2000, &s);
+	uint32_t polls = 100 / NOTEREQ_POLL_MS + 1;
+	uint64_t rxUs = (uint64_t) polls * 6 * 90;
+	CHECK(s.requests == 1);
+	CHECK(s.nj[NOTEENERGY_BUILD] == 1000);
+	CHECK(s.nj[NOTEENERGY_PARSE] == 1000);
+	CHECK(s.nj[NOTEENERGY_WAIT] == 0);
+	CHECK(s.nj[NOTEENERGY_RX] == rxUs);
+	CHECK(s.sleepUs == 100000);
+	CHECK(s.sleepNj == 1000);
+	CHECK(nj == 3000 + rxUs);
+	CHECK(nj == noteEnergyTotal(&s));
+
+	// Waiting costs more over serial, where the crystal is held for the UART, than over I2C
+	noteEnergyModel m;
+	noteEnergyDefaultModel(&m);
+	m.i2c = true;
+	uint64_t i2c = noteEnergySimulate(&m, 100, 20, 1000, 20000, NULL) - noteEnergySimulate(&m, 100, 20, 0, 20000, NULL);
+	m.i2c = false;
+	uint64_t serial = noteEnergySimulate(&m, 100, 20, 1000, 20000, NULL) - noteEnergySimulate(&m, 100, 20, 0, 20000, NULL);
+	CHECK(serial > i2c);
+
+	// And whatever the transport, sleep is the time that the CPU wasn't running
+	noteEnergySimulate(&m, 600, 20, 50, 20000, &s);
+	CHECK(s.sleepUs == s.wallUs[NOTEENERGY_BUILD] + s.wallUs[NOTEENERGY_TX] + s.wallUs[NOTEENERGY_WAIT] + s.wallUs[NOTEENERGY_RX] + s.wallUs[NOTEENERGY_PARSE]
+		  - s.activeUs[NOTEENERGY_BUILD] - s.activeUs[NOTEENERGY_TX] - s.activeUs[NOTEENERGY_WAIT] - s.activeUs[NOTEENERGY_RX] - s.activeUs[NOTEENERGY_PARSE]);
+}
+
+// A measured transaction, with the RTC wrapping part way through
+static void testMeasure() {
+	noteEnergySetModel(&model);
+	noteEnergyGetStats(NULL, true);
+	nowTicks = 0x00ffffff - 100;
+
+	noteEnergyTxn t;
+	noteEnergyBegin(&t, NOTEENERGY_BUILD);
+	advance(2000, 66);				// 2ms running
+	noteEnergyMark(&t, NOTEENERGY_TX);
+	advance(1000, 33);				// 1ms running
+	noteEnergyMark(&t, NOTEENERGY_WAIT);
+	advance(500, 3277);				// 0.5ms running in 100ms
+	noteEnergyMark(&t, NOTEENERGY_RX);
+	advance(1000, 33);
+	noteEnergyMark(&t, NOTEENERGY_PARSE);
+	advance(1000, 33);
+	noteEnergyEnd(&t);
+	advance(5000, 32768);			// Not part of the transaction
+	noteEnergyMark(&t, NOTEENERGY_BUILD);
+
+	noteEnergyStats s;
+	noteEnergyGetStats(&s, false);
+	CHECK(s.requests == 1);
+	CHECK(s.activeUs[NOTEENERGY_WAIT] == 500);
+	CHECK(s.wallUs[NOTEENERGY_WAIT] == (3277ULL * 1000000) / 32768);
+	CHECK(s.nj[NOTEENERGY_WAIT] == 500);
+	CHECK(s.nj[NOTEENERGY_BUILD] == 2000);
+	uint64_t wall = 0, active = 0;
+	for (int p=0; p<NOTEENERGY_PHASES; p++) {
+		wall += s.wallUs[p];
+		active += s.activeUs[p];
+	}
+	CHECK(active == 5500);
+	CHECK(s.sleepUs == wall - active);
+	CHECK(s.sleepNj == (s.sleepUs * 10) / 1000);
+	CHECK(noteEnergyTotal(&s) == 5500 + s.sleepNj);
+	noteEnergyReport();
+}
+
+int main() {
+	testSimulate();
+	testMeasure();
+	noteEnergySimulateReport("note.add", 120, 4, 50, 20000);
+	return checkResult("noteenergy_test");
+}
@@ -0,0 +1,231 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Host tests of the outbox, against a request queue that holds the one note the outbox has in
+// flight until the test delivers it.  Time only passes when the test advances it, so that notes can
+// be checked to be sent past one that is backing off, and to be retried when its backoff ends.  What
+// the outbox holds when the host is about to sleep is checked to be spilled.
+
+#include <stdio.h>
+#include <string.h>
+#include "sched.h"
+#include "noteoutbox.h"
+#include "check.h"
+
+// The clock, which only moves when the test advances it
+static uint32_t nowMs = 0;
+long unsigned int millis() {
+	return nowMs;
+}
+
+// Stand-ins for the rest of the firmware and for note-c
+void NoteDebug(const char *message) {
+	fputs(message, stdout);
+}
+char *JNtoA(JNUMBER f, char *buf, int precision) {
+	snprintf(buf, JNTOA_MAX, "%.*g", precision < 0 ? JNTOA_PRECISION : precision, f);
+	return buf;
+}
+
+// Responses, which are only ever compared with these
+static J rspSuccess, rspError, rspCancelled;
+bool NoteResponseError(J *rsp) {
+	return rsp == &rspError || rsp == &rspCancelled;
+}
+void NoteDeleteResponse(J *rsp) {
+}
+bool noteRequestAsyncCancelled(J *rsp) {
+	return rsp == &rspCancelled;
+}
+
+// The retry timer, which the test fires by running what its handler posts
+static app_timer_timeout_handler_t timerHandler;
+static bool timerRunning;
+static uint32_t timerMs;
+ret_code_t app_timer_create(app_timer_id_t const *p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler) {
+	timerHandler = timeout_handler;
+	return NRF_SUCCESS;
+}
+ret_code_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void *p_context) {
+	timerRunning = true;
+	timerMs = (uint32_t) (((uint64_t) timeout_ticks * 1000) / APP_TIMER_CLOCK_FREQ);
+	return NRF_SUCCESS;
+}
+ret_code_t app_timer_stop(app_timer_id_t timer_id) {
+	timerRunning = false;
+	return NRF_SUCCESS;
+}
+static schedHandler postedHandler = NULL;
+bool schedPost(schedHandler handler, void *context) {
+	postedHandler = handler;
+	return true;
+}
+
+// Advance the clock to when the retry timer expires, and run what it posts
+static void fireTimer() {
+	CHECK(timerRunning);
+	nowMs += timerMs;
+	timerRunning = false;
+	timerHandler(NULL);
+	schedHandler handler = postedHandler;
+	postedHandler = NULL;
+	if (handler != NULL)
+		handler(NULL);
+}
+
+// A request queue that holds a single request, and that can be made to appear full
+static bool queueFull = false;
+static noteReqEmitter submitEmit = NULL;
+static void *submitEmitContext;
+static noteReqCallback submitCallback;
+static void *submitContext;
+noteReqHandle noteRequestAsyncEmit(noteReqEmitter emit, void *emitContext, noteReqCallback callback, void *context) {
+	if (queueFull || submitEmit != NULL)
+		return 0;
+	submitEmit = emit;
+	submitEmitContext = emitContext;
+	submitCallback = callback;
+	submitContext = context;
+	return 1;
+}
+
+// Where the request for the note in flight is written
+static char request[256];
+static size_t requestLen;
+static const char *requestOutput(void *context, const uint8_t *data, size_t len) {
+	if (requestLen + len >= sizeof(request))
+		return "request too long";
+	memcpy(&request[requestLen], data, len);
+	requestLen += len;
+	request[requestLen] = '\0';
+	return NULL;
+}
+
+// Deliver the note in flight with the specified response, returning false if there isn't one or else
+// leaving its request in request[]
+static bool deliverResponse(J *rsp) {
+	if (submitEmit == NULL)
+		return false;
+	noteWriter w;
+	requestLen = 0;
+	noteWriterBegin(&w, requestOutput, NULL);
+	submitEmit(&w, submitEmitContext);
+	CHECK(noteWriterEnd(&w) == NULL);
+	submitEmit = NULL;
+	submitCallback(1, rsp, submitContext);
+	return true;
+}
+static bool deliver(bool success) {
+	return deliverResponse(success ? &rspSuccess : &rspError);
+}
+
+// True if the delivered request carried the specified body
+static bool delivered(const char *body) {
+	char expect[128];
+	snprintf(expect, sizeof(expect), "\"body\":%s}", body);
+	return strstr(request, expect) != NULL;
+}
+
+// Notes that were given up
+static int spills = 0;
+static bool spill(noteOutboxClass cls, const char *file, const char *body, bool sync) {
+	spills++;
+	return true;
+}
+
+// A routine note that is backing off doesn't hold up an alarm, and is retried when its backoff ends
+static void testBackoffPerNote() {
+	noteOutboxInit(NOTEOUTBOX_DROP_LOWEST);
+	CHECK(noteOutboxAddJSON(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"a\":1}", false));
+	CHECK(deliver(false) && delivered("{\"a\":1}"));
+	CHECK(!deliver(true));
+	CHECK(timerRunning && timerMs == NOTEOUTBOX_RETRY_MS);
+
+	CHECK(noteOutboxAddJSON(NOTEOUTBOX_ALARM, "alarms.qo", "{\"b\":2}", true));
+	CHECK(deliver(true) && delivered("{\"b\":2}"));
+	CHECK(!deliver(true));
+
+	fireTimer();
+	CHECK(deliver(true) && delivered("{\"a\":1}"));
+	CHECK(!deliver(true));
+
+	noteOutboxStats stats;
+	noteOutboxGetStats(&stats, false);
+	CHECK(stats.added == 2);
+	CHECK(stats.sent == 2);
+	CHECK(stats.retries == 1);
+	CHECK(stats.failed == 0);
+}
+
+// A note coalesced into a full outbox counts only as coalesced, and starts its attempts afresh
+static void testCoalesce() {
+	noteOutboxInit(NOTEOUTBOX_COALESCE);
+	noteOutboxSetSpill(spill);
+	spills = 0;
+	CHECK(noteOutboxAddJSON(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"n\":0}", false));
+	for (int i=1; i<NOTEOUTBOX_MAX_ATTEMPTS-1; i++) {
+		CHECK(deliver(false) && delivered("{\"n\":0}"));
+		fireTimer();
+	}
+	CHECK(deliver(false) && delivered("{\"n\":0}"));
+
+	// The note has one attempt left when the outbox is filled, and it is then replaced
+	queueFull = true;
+	for (int i=1; i<NOTEOUTBOX_SLOTS; i++)
+		CHECK(noteOutboxAddJSON(NOTEOUTBOX_ROUTINE, "other.qo", "{\"other\":true}", false));
+	CHECK(noteOutboxAddJSON(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"n\":1}", false));
+	CHECK(noteOutboxDepth(NOTEOUTBOX_ROUTINE) == NOTEOUTBOX_SLOTS);
+	noteOutboxStats stats;
+	noteOutboxGetStats(&stats, false);
+	CHECK(stats.added == NOTEOUTBOX_SLOTS);
+	CHECK(stats.coalesced == 1);
+
+	// The replacement is sent after the notes that were queued before it, and is retried
+	queueFull = false;
+	fireTimer();
+	for (int i=1; i<NOTEOUTBOX_SLOTS; i++)
+		CHECK(deliver(true) && delivered("{\"other\":true}"));
+	CHECK(deliver(false) && delivered("{\"n\":1}"));
+	fireTimer();
+	CHECK(deliver(true) && delivered("{\"n\":1}"));
+	CHECK(!deliver(true));
+	noteOutboxGetStats(&stats, false);
+	CHECK(stats.failed == 0);
+	CHECK(spills == 0);
+	CHECK(noteOutboxDepth(NOTEOUTBOX_ROUTINE) == 0);
+}
+
+// Before the host loses what is in RAM, everything queued is spilled, and a note whose request is
+// cancelled is spilled without counting as an attempt or backing off
+static void testSpillAll() {
+	noteOutboxInit(NOTEOUTBOX_DROP_LOWEST);
+	noteOutboxSetSpill(spill);
+	spills = 0;
+	timerRunning = false;
+	CHECK(noteOutboxAddJSON(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"a\":1}", false));
+	CHECK(noteOutboxAddJSON(NOTEOUTBOX_ROUTINE, "sensors.qo", "{\"a\":2}", false));
+	CHECK(noteOutboxAddJSON(NOTEOUTBOX_ALARM, "alarms.qo", "{\"b\":3}", true));
+	noteOutboxSpillAll();
+	CHECK(spills == 2);
+	CHECK(noteOutboxDepth(NOTEOUTBOX_ROUTINE) + noteOutboxDepth(NOTEOUTBOX_ALARM) == 1);
+
+	CHECK(deliverResponse(&rspCancelled) && delivered("{\"a\":1}"));
+	CHECK(!deliver(true));
+	CHECK(spills == 3);
+	CHECK(!timerRunning);
+	noteOutboxStats stats;
+	noteOutboxGetStats(&stats, false);
+	CHECK(stats.cancelled == 1);
+	CHECK(stats.retries == 0);
+	CHECK(stats.failed == 0);
+	CHECK(stats.spilled == 3);
+	CHECK(noteOutboxDepth(NOTEOUTBOX_ROUTINE) + noteOutboxDepth(NOTEOUTBOX_ALARM) == 0);
+}
+
+int main() {
+	testBackoffPerNote();
+	testCoalesce();
+	testSpillAll();
+	return checkResult("noteoutbox_test");
+}
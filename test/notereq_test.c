@@ -0,0 +1,195 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// Host tests of the asynchronous request queue, against a Notecard whose responses the test scripts.
+// Cancelled requests are checked to be left out of the throughput figures.  note-c's allocations come
+// from the arena, as they do on the target, so that a request that fails part way through its
+// response can be checked not to keep the arena from being reclaimed.
+
+#include <stdio.h>
+#include <string.h>
+#include "sched.h"
+#include "arena.h"
+#include "notereq.h"
+#include "app_timer.h"
+#include "check.h"
+
+// Stand-ins for the rest of the firmware
+void NoteDebug(const char *message) {
+	fputs(message, stdout);
+}
+long unsigned int millis() {
+	return 0;
+}
+uint32_t cycles() {
+	return 0;
+}
+uint32_t app_timer_cnt_get() {
+	return 0;
+}
+size_t strlcpy(char *dst, const char *src, size_t siz) {
+	size_t len = strlen(src);
+	if (siz != 0) {
+		size_t n = len < siz-1 ? len : siz-1;
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+	return len;
+}
+
+// There are no timers, so that polling for a response falls back to the scheduler
+ret_code_t app_timer_create(app_timer_id_t const *p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler) {
+	return NRF_ERROR_INVALID_STATE;
+}
+ret_code_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void *p_context) {
+	return NRF_ERROR_INVALID_STATE;
+}
+ret_code_t app_timer_stop(app_timer_id_t timer_id) {
+	return NRF_SUCCESS;
+}
+
+// A scheduler whose queue the test runs until it is empty
+static struct {
+	schedHandler handler;
+	void *context;
+} posted[SCHED_QUEUE_SIZE];
+static int postedCount = 0;
+bool schedPost(schedHandler handler, void *context) {
+	if (postedCount == SCHED_QUEUE_SIZE)
+		return false;
+	posted[postedCount].handler = handler;
+	posted[postedCount].context = context;
+	postedCount++;
+	return true;
+}
+static void schedDrain() {
+	for (int runs=0; postedCount > 0 && runs < 1000; runs++) {
+		schedHandler handler = posted[0].handler;
+		void *context = posted[0].context;
+		memmove(&posted[0], &posted[1], --postedCount * sizeof(posted[0]));
+		handler(context);
+	}
+}
+
+// note-c, which allocates from the arena.  Responses are only ever compared with these.
+static J rspParsed, rspError;
+void *JMalloc(size_t size) {
+	return arenaMalloc(size);
+}
+void JFree(void *p) {
+	arenaFree(p);
+}
+J *JParse(const char *value) {
+	return &rspParsed;
+}
+J *JCreateObject() {
+	return &rspError;
+}
+void JDelete(J *item) {
+}
+J *JAddStringToObject(J *object, const char *name, const char *string) {
+	return object;
+}
+char *JGetString(J *json, const char *field) {
+	return "";
+}
+char *JNtoA(JNUMBER f, char *buf, int precision) {
+	snprintf(buf, JNTOA_MAX, "%.*g", precision < 0 ? JNTOA_PRECISION : precision, f);
+	return buf;
+}
+JNUMBER JAtoN(const char *string, char **endPtr) {
+	return strtod(string, endPtr);
+}
+
+// The Notecard, which answers each request with the scripted response, followed by the scripted error
+static const char *wireResponse;
+static const char *wireErrstr;
+void noteWireReset() {
+}
+void noteWireTransmitBegin() {
+}
+const char *noteWireTransmitChunk(const uint8_t *data, size_t len) {
+	return NULL;
+}
+const char *noteWireTransmit(const uint8_t *data, size_t len) {
+	return NULL;
+}
+const char *noteWirePoll(noteWireSink sink, void *context, bool *done) {
+	*done = false;
+	if (!sink(context, (const uint8_t *) wireResponse, strlen(wireResponse)))
+		return "response was rejected";
+	if (wireErrstr != NULL)
+		return wireErrstr;
+	*done = true;
+	return NULL;
+}
+
+// Completion of a request
+static J *completed;
+static void requestDone(noteReqHandle handle, J *rsp, void *context) {
+	completed = rsp;
+}
+
+// Send a request, with the Notecard answering as scripted, and return its response
+static J *request(const char *response, const char *errstr) {
+	wireResponse = response;
+	wireErrstr = errstr;
+	completed = NULL;
+	CHECK(noteRequestAsyncJSON("{\"req\":\"card.status\"}", requestDone, NULL) != 0);
+	schedDrain();
+	CHECK(noteRequestAsyncIdle());
+	return completed;
+}
+
+// The arena is reclaimed after every transaction, including one whose response was cut short
+static void testArenaReclaimed() {
+	arenaStats before, after;
+	arenaGetStats(&before);
+	CHECK(request("{\"status\":\"{normal}\"}\n", NULL) == &rspParsed);
+	arenaGetStats(&after);
+	CHECK(after.resets == before.resets + 1);
+
+	before = after;
+	CHECK(request("{\"status\":", "i2c: no response") == &rspError);
+	arenaGetStats(&after);
+	CHECK(after.resets == before.resets + 1);
+	CHECK(after.live == 0);
+
+	before = after;
+	CHECK(request("{\"status\":\"{normal}\"}\n", NULL) == &rspParsed);
+	arenaGetStats(&after);
+	CHECK(after.resets == before.resets + 1);
+	CHECK(after.held == 0);
+	CHECK(after.used == 0);
+
+	noteReqStats stats;
+	noteRequestAsyncStats(&stats, false);
+	CHECK(stats.completed == 3);
+	CHECK(stats.failed == 1);
+}
+
+// A cancelled request is completed with an error, but isn't counted as completed or as failed
+static void testCancel() {
+	noteReqStats stats;
+	noteRequestAsyncStats(NULL, true);
+	wireResponse = "{}\n";
+	wireErrstr = NULL;
+	completed = NULL;
+	CHECK(noteRequestAsyncJSON("{\"req\":\"card.status\"}", NULL, NULL) != 0);
+	noteReqHandle handle = noteRequestAsyncJSON("{\"req\":\"card.status\"}", requestDone, NULL);
+	CHECK(noteRequestAsyncCancel(handle));
+	schedDrain();
+	CHECK(noteRequestAsyncIdle());
+	CHECK(completed == &rspError);
+	noteRequestAsyncStats(&stats, false);
+	CHECK(stats.completed == 1);
+	CHECK(stats.failed == 0);
+	CHECK(stats.cancelled == 1);
+}
+
+int main() {
+	testArenaReclaimed();
+	testCancel();
+	return checkResult("notereq_test");
+}
@@ -0,0 +1,17 @@
+// Copyright 2019 Blues Inc.  All rights reserved.
+// Use of this source code is governed by licenses granted by the
+// copyright holder including that found in the LICENSE file.
+//
+// The SDK's error codes to which the modules under test refer.
+
+#ifndef SDK_ERRORS_H
+#define SDK_ERRORS_H
+
+#include <stdint.h>
+
+typedef uint32_t ret_code_t;
+
+#define NRF_SUCCESS				0
+#define NRF_ERROR_INVALID_STATE	8
+
+#endif // SDK_ERRORS_H